@@ -30,9 +30,14 @@ sub bwaSmartMapping {   #smart paring, for interleaved fastqs
 
 sub bwaRemapping {
 
-  my ($class, $bwaBin, $samtoolsBin, $ReadGroup, $threads, $bwaindex, $outBam, $premBam) = @_;
+  my ($class, $bwaBin, $samtoolsBin, $ReadGroup, $threads, $bwaindex, $outBam, $premBam, $bamStatsBin) = @_;
 
-  my $cmd = "$samtoolsBin collate -@ $threads -uOn128 $premBam $premBam\_tmp | $samtoolsBin fastq -@ $threads - | $bwaBin mem -r 1.2 -R \'$ReadGroup\' -p -t $threads $bwaindex - | $samtoolsBin view -bS -@ $threads - >$outBam";
+  my $toFastq = "$samtoolsBin collate -@ $threads -uOn128 $premBam $premBam\_tmp | $samtoolsBin fastq -@ $threads -";
+  if (defined($bamStatsBin) and $bamStatsBin ne '') {   #name grouped premap bam: one pass, no collate
+    $toFastq = "$bamStatsBin --mapping $premBam --readlength 0 --maxIntron 23000 --type fixflag --fastq - --fastqCategories all 2>$premBam\.fastq\.log";
+  }
+
+  my $cmd = "$toFastq | $bwaBin mem -r 1.2 -R \'$ReadGroup\' -p -t $threads $bwaindex - | $samtoolsBin view -bS -@ $threads - >$outBam";
 
   return $cmd;
 
@@ -139,6 +144,16 @@ sub MarkDuplicates {
 
 }
 
+sub MarkDuplicatesNative {   #same flags and metrics as Picard, one streaming pass
+
+  my ($class, $markDuplicatesBin, $inBam, $outBam, $metric, $threads, $tmpDir) = @_;
+
+  my $cmd = "$markDuplicatesBin --input $inBam --output $outBam --metrics $metric --threads $threads --spillDir $tmpDir";
+
+  return $cmd;
+
+}
+
 
 sub BaseRecalibration {
 
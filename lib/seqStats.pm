@@ -19,9 +19,14 @@ sub mappingStats {
 
 sub xenoStats {
 
-  my ($class, $bamStatsBin, $BAM, $outBam, $readlen, $xenoStatsOut) = @_;
+  my ($class, $bamStatsBin, $BAM, $outBam, $readlen, $xenoStatsOut, $threads) = @_;
 
-  my $cmd = "$bamStatsBin --mapping $BAM --writer $outBam --readlength $readlen --maxIntron 23000 --type xeno >$xenoStatsOut";
+  my $threadOpt = '';
+  if (defined($threads) and $threads > 1) {   #reader/classifier/writer pipeline
+    $threadOpt = "--threads $threads ";
+  }
+
+  my $cmd = "$bamStatsBin --mapping $BAM --writer $outBam --readlength $readlen --maxIntron 23000 --type xeno $threadOpt>$xenoStatsOut";
 
   return $cmd;
 
@@ -30,11 +35,19 @@ sub xenoStats {
 
 sub grepStarts {
 
-  my  ($class, $grepStartsBin, $targetRegion, $BAM, $bedCover, $chrInBam) = @_;
+  my  ($class, $grepStartsBin, $targetRegion, $BAM, $bedCover, $chrInBam, $insHist, $gcWig, $mapWig, $corOut) = @_;
+
+  my $insOpt = '';
+  if (defined($insHist) and $insHist ne 'SRP') {   #insert size histogram in the same pass
+    $insOpt = "--insert $insHist ";
+  }
+  if (defined($corOut) and $corOut ne 'SRP' and -s "$gcWig" and -s "$mapWig") {   #gc and mappability corrected bin counts
+    $insOpt .= "--gcWig $gcWig --mapWig $mapWig --corrected $corOut ";
+  }
 
-  my $cmd = "$grepStartsBin --region $targetRegion --mapping $BAM >$bedCover";
+  my $cmd = "$grepStartsBin --region $targetRegion --mapping $BAM $insOpt>$bedCover";
   if ($chrInBam ne 'SRP') {
-    $cmd = "$grepStartsBin --region $targetRegion --mapping $BAM --chr $chrInBam >$bedCover";
+    $cmd = "$grepStartsBin --region $targetRegion --mapping $BAM --chr $chrInBam $insOpt>$bedCover";
   }
 
   return $cmd;
@@ -165,9 +165,10 @@ sub grepINDELvcf {
 
 sub rechecksnv {
 
-  my ($class, $rechecksnvBin, $recheckTable, $BAM, $recheckOut, $chrPref, $skipPileup) = @_;
+  my ($class, $rechecksnvBin, $recheckTable, $BAM, $recheckOut, $chrPref, $skipPileup, $GFASTA) = @_;
 
   my $skipPileupOpt = ($skipPileup eq 'yes')? '--skipPileup' : '';
+  $skipPileupOpt .= " --genome $GFASTA" if (defined($GFASTA) and $GFASTA ne '');   #mismatches against the reference, no MD needed
   my $cmd = "$rechecksnvBin --var $recheckTable --mapping $BAM $skipPileupOpt >$recheckOut";
   if ($chrPref ne 'SRP'){
     $cmd = "$rechecksnvBin --var $recheckTable --mapping $BAM $skipPileupOpt --chr $chrPref >$recheckOut";
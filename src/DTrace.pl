@@ -73,6 +73,7 @@ $options{'transtate'}   = 1e12;
 $options{'tranclone'}   = 1e9;
 $options{'maxMem'} = '4g';
 $options{'javaTmp'} = '/local/scratch';
+$options{'picardMarkDup'} = 0;
 $options{'nwigString'}  = 'SRP';
 $options{'homoThred'}   = 0.85;
 $options{'ndepthThred'} = 8;
@@ -128,6 +129,7 @@ GetOptions(
            "quiet"        => \$options{'quiet'},
            "maxMem=s"     => \$options{'maxMem'},
            "javaTmp=s"    => \$options{'javaTmp'},
+           "picardMarkDup" => \$options{'picardMarkDup'},
            "splitChr"     => \$options{'splitChr'},
            "readlen=i"    => \$options{'readlen'},
            "mapper=s"     => \$options{'mapper'},
@@ -546,7 +548,9 @@ if (exists($runlevel{$runlevels}) or exists($runTask{'mapping'}) or exists($runT
     my $ReadGroup = '@RG'."\tID:".$options{'bamID'}."\tSM\:".$options{'sampleName'}."\tPL\:".$options{'platform'};
     my $cmd;
     if (exists($runTask{'remap'}) and -e "$premapBam") {
-      $cmd = bwaMapping->bwaRemapping($confs{'bwaBin'}, $confs{'samtoolsBin'}, $ReadGroup, $options{'threads'}, $confs{'BWAINDEX'}, $rawBam, $premapBam);
+      my $premapHD = `$confs{'samtoolsBin'} view -H $premapBam | grep -m1 '^\@HD'`;   #name grouped: fastq straight from Rseq_bam_stats
+      my $bamStatsBin = ($premapHD =~ /\tSO:queryname\b|\tGO:query\b/)? "$options{'bin'}/Rseq_bam_stats" : '';   #else (sorted, unsorted, no HD) collate
+      $cmd = bwaMapping->bwaRemapping($confs{'bwaBin'}, $confs{'samtoolsBin'}, $ReadGroup, $options{'threads'}, $confs{'BWAINDEX'}, $rawBam, $premapBam, $bamStatsBin);
     } elsif ($options{'fastqFiles2'} eq 'interleaved') {  #need smart paring
       $cmd = bwaMapping->bwaSmartMapping($confs{'bwaBin'}, $confs{'samtoolsBin'}, $ReadGroup, $options{'threads'}, $confs{'BWAINDEX'}, $rawBam, $options{'fastqFiles1'});
     } elsif ($options{'fastqFiles2'} eq 'SRP') {     #single end
@@ -561,7 +565,7 @@ if (exists($runlevel{$runlevels}) or exists($runTask{'mapping'}) or exists($runT
 
     my $xenoStats = "$options{'lanepath'}/02_MAPPING/$options{'sampleName'}\.xenoStats";
     my $noMouseBam = "$options{'lanepath'}/02_MAPPING/$options{'sampleName'}\.noMouse\.bam";
-    my $cmd = seqStats->xenoStats("$options{'bin'}/Rseq_bam_stats", $rawBam,  $noMouseBam, $options{'readlen'}, $xenoStats);
+    my $cmd = seqStats->xenoStats("$options{'bin'}/Rseq_bam_stats", $rawBam,  $noMouseBam, $options{'readlen'}, $xenoStats, $options{'threads'});
     unless (-e "$xenoStats") {
       RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
     }
@@ -698,7 +702,10 @@ if (exists($runlevel{$runlevels}) or exists($runTask{'mapping'}) or exists($runT
 
     if ((-s "$brBam" and !(-s "$rmDupBam")) or exists($runTask{'MarkDuplicates'})) {  #rmDup
       my $rmDupMetric = $brBam.".rmDupMetric";
-      my $cmd = bwaMapping->MarkDuplicates($confs{'MarkDuplicatesBin'}, $brBam, $rmDupBam, $rmDupMetric, $options{'maxMem'}, $options{'javaTmp'}, $confs{'java'});
+      my $cmd = bwaMapping->MarkDuplicatesNative("$options{'bin'}/markDuplicates", $brBam, $rmDupBam, $rmDupMetric, $options{'threads'}, $options{'javaTmp'});
+      if ($options{'picardMarkDup'} or !(-x "$options{'bin'}/markDuplicates")) {
+        $cmd = bwaMapping->MarkDuplicates($confs{'MarkDuplicatesBin'}, $brBam, $rmDupBam, $rmDupMetric, $options{'maxMem'}, $options{'javaTmp'}, $confs{'java'});
+      }
       if ($options{'skipTask'} =~ /MarkDuplicates/) {
         $cmd = "mv $brBam $rmDupBam";
       }
@@ -710,7 +717,7 @@ if (exists($runlevel{$runlevels}) or exists($runTask{'mapping'}) or exists($runT
     }
 
     if ((-s "$rmDupBam" and !(-s "$finalBam")) or exists($runTask{'recalMD'})) {
-      if ($options{'skipTask'} !~ /recalMD/) {
+      if ($options{'skipTask'} !~ /recalMD/) {   #calmd by default: MD/NM and the BQ tags (-E) of finalBam are used outside DTrace too
         my $cmd = bwaMapping->recalMD($confs{'samtoolsBin'}, $rmDupBam, $confs{'GFASTA'}, $finalBam, $options{'threads'});
         RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
         $cmd = bwaMapping->bamIndex($confs{'samtoolsBin'}, $options{'threads'}, $finalBam); #index it
@@ -765,12 +772,13 @@ if (exists $runlevel{$runlevels}) {
     RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
   }
 
-  #loren curve
+  #loren curve (and insert size histogram for paired-end in the same pass)
   my $bedCover = "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.bedcoverNoDup";
   my $lorenzCover = "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.lorenzNoDup";
+  my $insHist = ($options{'seqType'} =~ /paired/)? "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.insHist" : 'SRP';
   unless (-s "$lorenzCover") {
     unless (-s "$bedCover") {
-      my $cmd = seqStats->grepStarts("$options{'bin'}/grep_starts", $confs{'targetRegion'}, $statBam, $bedCover, $options{'chrPrefInBam'});
+      my $cmd = seqStats->grepStarts("$options{'bin'}/grep_starts", $confs{'targetRegion'}, $statBam, $bedCover, $options{'chrPrefInBam'}, $insHist);
       RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
     }
     my $cmd = seqStats->getLorenz("$options{'bin'}/lorenzCurveNGS.pl", $bedCover, $lorenzCover, $options{'lorenzScaleFactor'});
@@ -784,9 +792,10 @@ if (exists $runlevel{$runlevels}) {
   #for titanCNA
   my $bedCount = "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.w1k.count";
   my $wigOut = "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.wig";
+  my $corOut = "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.cor";
   unless (-s "$wigOut") {
     unless (-s "$bedCount") {
-      my $cmd = seqStats->grepStarts("$options{'bin'}/grep_starts", $confs{'w1kBed'}, $finalBam, $bedCount, $options{'chrPrefInBam'});
+      my $cmd = seqStats->grepStarts("$options{'bin'}/grep_starts", $confs{'w1kBed'}, $finalBam, $bedCount, $options{'chrPrefInBam'}, 'SRP', $confs{'gcWigTitan'}, $confs{'mapWigTitan'}, $corOut);
       RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
     }
     my $cmd = seqStats->bed2wig("$options{'bin'}/bed2wig.pl", $bedCount, $wigOut);
@@ -799,7 +808,11 @@ if (exists $runlevel{$runlevels}) {
 
   #for insert size
   if ($options{'seqType'} =~ /paired/) { #do the insert size only if it is paired-end
-    unless (-s "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.ins\.gz") {
+    my $insFile = "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.ins\.gz";
+    if (-s "$insHist") {                   #histogram from grep_starts
+      $insFile = $insHist;
+    }
+    unless (-s "$insFile") {
       unless (-s "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.ins") {
         my $insertBam = $finalBam;
         if ( $finalBam !~ /\.bam$/ ) {  #likely a file of file names
@@ -817,7 +830,7 @@ if (exists $runlevel{$runlevels}) {
 
     unless (-s "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.insertSize\.pdf") {
       my $cmd = seqStats->plotInsertSize($confs{'RscriptBin'}, "$options{'bin'}/insertSize.R", "$options{'lanepath'}/03_STATS/", $options{'sampleName'},
-                                         "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.ins\.gz", "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.insertSize\.pdf");
+                                         $insFile, "$options{'lanepath'}/03_STATS/$options{'sampleName'}\.insertSize\.pdf");
       RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
     }
   } #insert size
@@ -1261,7 +1274,7 @@ if (exists($runlevel{$runlevels}) or exists($runTask{'recheck'}) or exists($runT
     my $recheckBams = ($options{'recheckBams'} ne 'SRP')? $options{'recheckBams'} : $finalBam;
     my $recheckBasename = basename($options{'recheck'});
     my $recheckOut = "$options{'lanepath'}/04_SNV/$options{'sampleName'}\.$recheckBasename\.rechecked";
-    my $cmd = snvCalling->rechecksnv("$options{'bin'}/novelSnvFilter_ACGT", $options{'recheck'}, $recheckBams, $recheckOut, $options{'chrPrefInBam'}, $options{'skipPileup'});
+    my $cmd = snvCalling->rechecksnv("$options{'bin'}/novelSnvFilter_ACGT", $options{'recheck'}, $recheckBams, $recheckOut, $options{'chrPrefInBam'}, $options{'skipPileup'}, $confs{'GFASTA'});
     if ($options{'recheck'} =~ /indel/) {
       $cmd = snvCalling->rechecksnv("$options{'bin'}/novelIndelFilter", $options{'recheck'}, $recheckBams, $recheckOut, $options{'chrPrefInBam'}, $options{'skipPileup'});
     }
@@ -1587,20 +1600,22 @@ if (exists($runlevel{$runlevels}) or exists($runTask{'MutectCallOnly'}) or exist
       RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
     }
     unless (-s "$varout_mutect\.filtered\.classified\.founds\.nopara") {
-      my $cmd = "perl $options{'bin'}/readsFlankingVariants.pl $confs{'GFASTA'} $varout_mutect\.filtered\.classified\.founds snv >$varout_mutect\.filtered\.classified\.founds.flanking.fa";
-      RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-      unless (-s "$varout_mutect\.filtered\.classified\.founds.flanking.bam") {
-         $cmd = bwaMapping->bowtieMappingSnv($confs{'bowtieBin'}, $confs{'BowtieINDEX'}, "$varout_mutect\.filtered\.classified\.founds.flanking.fa", "$varout_mutect\.filtered\.classified\.founds.flanking.sam", $options{'threads'});
-         RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-         $cmd = bwaMapping->samToBam($confs{'samtoolsBin'}, "$varout_mutect\.filtered\.classified\.founds.flanking.sam", "$varout_mutect\.filtered\.classified\.founds.flanking.bam", $options{'threads'});
-         RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+      my $cmd;
+      if (exists($confs{'KmerINDEX'}) and -s "$confs{'KmerINDEX'}") {      #paralog flanks by kmer lookups, no remapping
+        $cmd = "$options{'bin'}/mappingFlankingVariants --genome $confs{'GFASTA'} --variants $varout_mutect\.filtered\.classified\.founds --type snv --kmerIndex $confs{'KmerINDEX'} --paralog $varout_mutect\.filtered\.classified\.founds\.1";
+        RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+      } else {
+        $cmd = "$options{'bin'}/mappingFlankingVariants --genome $confs{'GFASTA'} --variants $varout_mutect\.filtered\.classified\.founds --type snv --flanks $varout_mutect\.filtered\.classified\.founds.flanking.fa";
+        RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+        unless (-s "$varout_mutect\.filtered\.classified\.founds.flanking.bam") {
+           $cmd = bwaMapping->bowtieMappingSnv($confs{'bowtieBin'}, $confs{'BowtieINDEX'}, "$varout_mutect\.filtered\.classified\.founds.flanking.fa", "$varout_mutect\.filtered\.classified\.founds.flanking.sam", $options{'threads'});
+           RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+           $cmd = bwaMapping->samToBam($confs{'samtoolsBin'}, "$varout_mutect\.filtered\.classified\.founds.flanking.sam", "$varout_mutect\.filtered\.classified\.founds.flanking.bam", $options{'threads'});
+           RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+        }
+        $cmd = "$options{'bin'}/mappingFlankingVariants --mapping $varout_mutect\.filtered\.classified\.founds.flanking.bam --genome $confs{'GFASTA'} --readlength $options{'readlen'} --type s --threads $options{'threads'} --variants $varout_mutect\.filtered\.classified\.founds --paralog $varout_mutect\.filtered\.classified\.founds\.1";
+        RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
       }
-      $cmd = "$options{'bin'}/mappingFlankingVariants --mapping $varout_mutect\.filtered\.classified\.founds.flanking.bam --readlength $options{'readlen'} --type s >$varout_mutect\.filtered\.classified\.founds.flanking.bam.out";
-      RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-      $cmd = "perl $options{'bin'}/badvariantmapping.pl $varout_mutect\.filtered\.classified\.founds.flanking.bam.out >$varout_mutect\.filtered\.classified\.founds.flanking.bam.out.bad";
-      RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-      $cmd = "perl $options{'bin'}/intersectFiles.pl -o $varout_mutect\.filtered\.classified\.founds -m $varout_mutect\.filtered\.classified\.founds.flanking.bam.out.bad -count >$varout_mutect\.filtered\.classified\.founds\.1";
-      RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
       my $PRC = `head -1 $varout_mutect\.filtered\.classified\.founds\.1 |awk '{print \$NF}'`;
       $PRC =~ s/\n$//;
       my $PRCI = `perl $options{'bin'}/columnIndex.pl $PRC $varout_mutect\.filtered\.classified\.founds\.1`;
@@ -1668,24 +1683,26 @@ if (exists($runlevel{$runlevels}) or exists($runTask{'MutectCallOnly'}) or exist
       RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
     }
     unless (-s "$varout_samtools\.filtered\.nopara") {
-      my $cmd = "perl $options{'bin'}/readsFlankingVariants.pl $confs{'GFASTA'} $varout_samtools\.filtered snv >$varout_samtools\.filtered.flanking.fa";
-      unless (-s "$varout_samtools\.filtered.flanking.fa") {
+      my $cmd;
+      if (exists($confs{'KmerINDEX'}) and -s "$confs{'KmerINDEX'}") {      #paralog flanks by kmer lookups, no remapping
+        $cmd = "$options{'bin'}/mappingFlankingVariants --genome $confs{'GFASTA'} --variants $varout_samtools\.filtered --type snv --kmerIndex $confs{'KmerINDEX'} --paralog $varout_samtools\.filtered\.1";
         RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-      }
-      unless (-s "$varout_samtools\.filtered.flanking.bam") {
-	 unless (-s "$varout_samtools\.filtered.flanking.sam") {
-           $cmd = bwaMapping->bowtieMappingSnv($confs{'bowtieBin'}, $confs{'BowtieINDEX'}, "$varout_samtools\.filtered.flanking.fa", "$varout_samtools\.filtered.flanking.sam", $options{'threads'});
+      } else {
+        $cmd = "$options{'bin'}/mappingFlankingVariants --genome $confs{'GFASTA'} --variants $varout_samtools\.filtered --type snv --flanks $varout_samtools\.filtered.flanking.fa";
+        unless (-s "$varout_samtools\.filtered.flanking.fa") {
+          RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+        }
+        unless (-s "$varout_samtools\.filtered.flanking.bam") {
+	   unless (-s "$varout_samtools\.filtered.flanking.sam") {
+             $cmd = bwaMapping->bowtieMappingSnv($confs{'bowtieBin'}, $confs{'BowtieINDEX'}, "$varout_samtools\.filtered.flanking.fa", "$varout_samtools\.filtered.flanking.sam", $options{'threads'});
+             RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+	   }
+           $cmd = bwaMapping->samToBam($confs{'samtoolsBin'}, "$varout_samtools\.filtered.flanking.sam", "$varout_samtools\.filtered.flanking.bam", $options{'threads'});
            RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-	 }
-         $cmd = bwaMapping->samToBam($confs{'samtoolsBin'}, "$varout_samtools\.filtered.flanking.sam", "$varout_samtools\.filtered.flanking.bam", $options{'threads'});
-         RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
+        }
+        $cmd = "$options{'bin'}/mappingFlankingVariants --mapping $varout_samtools\.filtered.flanking.bam --genome $confs{'GFASTA'} --readlength $options{'readlen'} --type s --threads $options{'threads'} --variants $varout_samtools\.filtered --paralog $varout_samtools\.filtered\.1";
+        RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
       }
-      $cmd = "$options{'bin'}/mappingFlankingVariants --mapping $varout_samtools\.filtered.flanking.bam --readlength $options{'readlen'} --type s >$varout_samtools\.filtered.flanking.bam.out";
-      RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-      $cmd = "perl $options{'bin'}/badvariantmapping.pl $varout_samtools\.filtered.flanking.bam.out >$varout_samtools\.filtered.flanking.bam.out.bad";
-      RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
-      $cmd = "perl $options{'bin'}/intersectFiles.pl -o $varout_samtools\.filtered -m $varout_samtools\.filtered.flanking.bam.out.bad -count >$varout_samtools\.filtered\.1";
-      RunCommand($cmd,$options{'noexecute'},$options{'quiet'});
       my $PRC = `head -1 $varout_samtools\.filtered\.1 |awk '{print \$NF}'`;
       $PRC =~ s/\n$//;
       my $PRCI = `perl $options{'bin'}/columnIndex.pl $PRC $varout_samtools\.filtered\.1`;
@@ -1755,6 +1772,7 @@ sub helpm {
   print STDERR "\nrunlevel 2: mapping and report of mapping statistics\n";
   print STDERR "\t--mapper\tthe mapper for read-alignment, now support \'bwa\' (default).\n";
   print STDERR "\t--gf\t\tthe graphical format in mapping report, \'png\' (default) or \'pdf\' (when a x11 window is not available)\n";
+  print STDERR "\t--picardMarkDup\tmark the duplicates with Picard MarkDuplicates instead of the native markDuplicates (default not set)\n";
 
   print STDERR "\nrunlevel 3: STATS\n";
 
@@ -5,6 +5,7 @@
   (any mapper)
 
   ********** this will only work for a bam file or files sorted by read name **********
+  ********** (or coordinate sorted ones with --sorting coordinate, see MateCache) *****
 
   2) also calculate paired-end mapping to generate "best" alignment of a fragment
   (based on flag containing "Primary" Record), write the uniquely mapped reads into a new bam file
@@ -34,35 +35,127 @@ using namespace BamTools;
 #include <deque>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <unistd.h>
 #include <cstring>
 #include <sstream>
 #include "Rseq_bam_stats.h"
+#include "bgzf_writer.h"
+#include "bgzf_reader.h"
+#include "sam_reader.h"
+#include "dup_sketch.h"
+#include "ref_mismatch.h"
+#include "line_writer.h"
 #include <iomanip>
-#include "boost/regex.hpp"
-using namespace boost;
 using namespace std;
 
 
 struct RseqSTATS {
-  unsigned int num_Reads;
-  unsigned int num_Duplicates;
-  unsigned int num_FailedQC;
-  unsigned int num_Mapped;
-  unsigned int num_Unique;
-  unsigned int num_spliced;
-  unsigned int num_Singletons;
-  unsigned int num_ProperPair;
-  unsigned int num_WrongPair;
-  unsigned int num_ProperPair_dis;
-  unsigned int num_WrongPair_dis;
-  unsigned int num_xenoPair;                 //for human and mouse merged pair
-  unsigned int num_xenoMulti;                //for reads mapping to both mouse and human
-  unsigned int num_mouse;                    //for mouse reads
-  unsigned int num_human;                    //for human reads
-  unsigned int num_Multi;
-  unsigned int num_Unmapped;
-  unsigned int num_UniqueHalf;
-  unsigned int num_multiMis;
+  unsigned long long num_Reads;
+  unsigned long long num_Duplicates;
+  unsigned long long num_FailedQC;
+  unsigned long long num_Mapped;
+  unsigned long long num_Unique;
+  unsigned long long num_spliced;
+  unsigned long long num_Singletons;
+  unsigned long long num_ProperPair;
+  unsigned long long num_WrongPair;
+  unsigned long long num_ProperPair_dis;
+  unsigned long long num_WrongPair_dis;
+  unsigned long long num_xenoPair;                 //for human and mouse merged pair
+  unsigned long long num_xenoMulti;                //for reads mapping to both mouse and human
+  unsigned long long num_mouse;                    //for mouse reads
+  unsigned long long num_human;                    //for human reads
+  unsigned long long num_Multi;
+  unsigned long long num_Unmapped;
+  unsigned long long num_UniqueHalf;
+  unsigned long long num_multiMis;
+};
+
+const struct {        // counter names of the machine readable output (json / tsv)
+  const char *name;
+  unsigned long long RseqSTATS::*count;
+} stats_fields[] = {
+  {"Reads", &RseqSTATS::num_Reads}, {"Mapped", &RseqSTATS::num_Mapped}, {"Unmapped", &RseqSTATS::num_Unmapped},
+  {"Unique", &RseqSTATS::num_Unique}, {"Uniquehalf", &RseqSTATS::num_UniqueHalf}, {"duplicates", &RseqSTATS::num_Duplicates},
+  {"multiMis", &RseqSTATS::num_multiMis}, {"failed_QC", &RseqSTATS::num_FailedQC}, {"singletons", &RseqSTATS::num_Singletons},
+  {"ProperPair", &RseqSTATS::num_ProperPair}, {"ProperPairDis", &RseqSTATS::num_ProperPair_dis},
+  {"WrongPair", &RseqSTATS::num_WrongPair}, {"WrongPairDis", &RseqSTATS::num_WrongPair_dis}, {"Spliced", &RseqSTATS::num_spliced},
+  {"MultiMap", &RseqSTATS::num_Multi}, {"xenoPair", &RseqSTATS::num_xenoPair}, {"xenoMulti", &RseqSTATS::num_xenoMulti},
+  {"mouseReads", &RseqSTATS::num_mouse}, {"humanReads", &RseqSTATS::num_human}
+};
+
+struct RecordInfo {   // what the per-record pass tells the fragment level
+  unsigned int group;
+  bool xenoMulti;
+  unsigned char xenoClass;   // xeno decision of the record: XENO_* bits
+  unsigned int unique;
+  bool jc;
+  bool write;
+  string chrom;
+  unsigned int alignmentStart;
+  unsigned int alignmentEnd;
+};
+
+// the char data of a record (name, bases, qualities, tags) is only built when something needs it
+bool tags_NH = true;            // the aligner writes NH tags (looked up on the first mapped record)
+bool tags_XA = true;            // XA hits can cross species (reference with both chr and non-chr contigs)
+bool count_mismatches = true;   // mismatch count (type multiMis only)
+class RefMismatch *ref_mismatch = NULL;   // --genome: mismatches against the reference, else from the MD tag
+
+const unsigned char XENO_ROUTED = 1;     // the record got a xeno decision (mapped end, not a duplicate)
+const unsigned char XENO_MOUSE  = 2;     // aligned to a mouse (chr) contig
+const unsigned char XENO_MULTI  = 4;     // XA hits in the other species
+const unsigned char XENO_PAIR   = 8;     // the mates are on different species
+
+struct BreakpointHit {  // a clipped unique read at a breakpoint, for the clustered breakpoint output
+  int refID;
+  unsigned int position;
+  bool discordant;     // mate on another chromosome or further than maxIntron
+  char clip;           // clip type S or H
+  bool atEnd;          // the clip is at the alignment end
+};
+
+struct CharData {     // char data of a record: built yet? and the raw bytes to build it from (passthrough input)
+  bool decoded;
+  const string *raw;
+};
+
+struct RecordSource { // BamTools reader, or the raw record reader (single bam, or SAM/BAM on stdin)
+  BamMultiReader *multi;
+  RawReader *raw;
+  string file;         // the input file of the raw reader
+  bool probeNH;        // stdin: NH looked up on the first mapped record (no rewinding)
+};
+
+struct FragRecord {   // what the fragment level needs of a record
+  string name;
+  unsigned int group;
+  bool first;
+  bool mapped;
+  bool mateMapped;
+  bool primary;
+  bool duplicate;
+  bool failedQC;
+  bool properPair;
+  bool oneCigar;
+  bool jc;
+  unsigned int unique;
+  int refID;
+  unsigned int alignmentStart;
+  unsigned int alignmentEnd;
+  int mateRefID;
+  int matePosition;
+  unsigned int rank;   // replay order inside a name: mate, then primary before secondary and supplementary
+};
+
+struct MateGroup {    // records of a read name waiting for the rest (coordinate sorted input)
+  vector <struct FragRecord> recs;
+  unsigned int seen[2];
+  unsigned int expected[2];
 };
 
 struct Alignment {
@@ -74,8 +167,6 @@ struct Alignment {
   unsigned int end2;
   unsigned int cate; // 1:unmapped; 2:multi; 3:singleton; 4:unique;  (UN 5-9) 5:one_end_mapped; 6:1uniq; 7:2uniq; 8:1multi; 9:2multi; 10:saved_one_end_unique
   bool junction;
-  BamAlignment mate1;
-  BamAlignment mate2;
 };
 
 
@@ -83,12 +174,579 @@ inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, v
 inline void splitstring(const string &str, vector<string> &elements, const string &delimiter);
 inline string int2str(unsigned int &i);
 inline void print_stats(struct RseqSTATS &rstats);
+inline void print_groups(const class StatsGroups &groups, const string &format);
+inline void char_data(BamAlignment &bam, struct CharData &cd);
+inline bool next_record(struct RecordSource &source, BamAlignment &bam, string &raw);
+typedef bool (*RecordStatsFn)(BamAlignment &bam, struct CharData &cd, const RefVector &refs, struct RseqSTATS &stats, struct RecordInfo &info, bool writing, unsigned int cliplen, unsigned int maxIntron, LineWriter *bp_out, vector <struct BreakpointHit> *bp_hits, LineWriter *unmapped_out);
+template <bool Paired, bool MultiMis, bool Breakpoints> inline bool record_stats(BamAlignment &bam, struct CharData &cd, const RefVector &refs, struct RseqSTATS &stats, struct RecordInfo &info, bool writing, unsigned int cliplen, unsigned int maxIntron, LineWriter *bp_out, vector <struct BreakpointHit> *bp_hits, LineWriter *unmapped_out);
+inline RecordStatsFn record_stats_for(const string &type, bool breakpoints);
+inline void frag_record(const BamAlignment &bam, const struct RecordInfo &info, struct FragRecord &rec);
+typedef void (*FragmentStatsFn)(const struct FragRecord &rec, struct Alignment &frag, string &old_frag, struct RseqSTATS &BAMSTATS, const RefVector &refs, unsigned int maxIntron, LineWriter *arp_out);
+template <bool Paired> inline void fragment_stats(const struct FragRecord &rec, struct Alignment &frag, string &old_frag, struct RseqSTATS &BAMSTATS, const RefVector &refs, unsigned int maxIntron, LineWriter *arp_out);
+inline bool frag_rank_less(const struct FragRecord &a, const struct FragRecord &b);
+inline void write_frag(ostream &out, const struct FragRecord &rec);
+inline bool read_frag(istream &in, struct FragRecord &rec);
+inline void add_stats(struct RseqSTATS &total, const struct RseqSTATS &part);
+inline void record_pipeline(struct RecordSource &source, const RefVector &refs, BgzfWriter &writer, bool writing, unsigned int cliplen, unsigned int maxIntron, RecordStatsFn record_fn, LineWriter *bp_out, class BreakpointClusters *clusters, bool sortedInput, LineWriter *unmapped_out, class FastqEmitter *fastq, class XenoRouter *router, class StatsGroups &groupStats, class DupSketches *sketches, int threads);
+
+class StatsGroups {
+
+  // counters per read group (RG tag) or per input file, in the order the groups first appear;
+  // without a grouping all records count into the single group "all"
+
+ public:
+  StatsGroups() : last(0) {}
+
+  void SetGroupBy(const string &by) {
+    groupby = by;
+    if ( groupby != "rg" && groupby != "file" ) groupby = "";
+    if ( groupby == "" ) Find("all");
+  }
+
+  const string &GroupBy() const {
+    return groupby;
+  }
+
+  unsigned int Group(BamAlignment &bam, struct CharData &cd, const struct RecordSource &source) {
+    if ( groupby == "" ) return 0;
+    if ( groupby == "file" ) return Find( (source.raw != NULL) ? source.file : bam.Filename );
+    char_data(bam, cd);
+    string rg;
+    if ( !bam.GetTag("RG", rg) ) rg = "NA";
+    return Find(rg);
+  }
+
+  unsigned int Find(const string &name) {
+    if ( !names.empty() && names[last] == name ) return last;
+    map <string, unsigned int>::iterator it = index.find(name);
+    if ( it == index.end() ) {
+      struct RseqSTATS zero = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+      it = index.insert( pair <string, unsigned int> (name, names.size()) ).first;
+      names.push_back(name);
+      stats.push_back(zero);
+    }
+    last = it->second;
+    return last;
+  }
+
+  struct RseqSTATS &operator[](unsigned int g) {
+    return stats[g];
+  }
+
+  void Merge(const StatsGroups &part) {
+    for (size_t g = 0; g < part.names.size(); g++) add_stats(stats[Find(part.names[g])], part.stats[g]);
+  }
+
+  void Total(struct RseqSTATS &total) const {
+    struct RseqSTATS zero = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+    total = zero;
+    for (size_t g = 0; g < stats.size(); g++) add_stats(total, stats[g]);
+  }
+
+  vector <string> names;
+  vector <struct RseqSTATS> stats;
+
+ private:
+  string groupby;
+  map <string, unsigned int> index;
+  unsigned int last;
+
+};
+
+struct RecordBatch {  // a batch of records passed through the per-record pipeline
+  vector <BamAlignment> reads;
+  vector <string> raws;
+  vector <bool> write;
+  vector <bool> xenoMulti;
+  vector <unsigned char> xenoClass;
+  StatsGroups groups;
+  string breakpoints;
+  vector <struct BreakpointHit> bp_hits;
+  string unmapped;
+  DupSketches sketches;
+  bool done;
+};
+
+class BreakpointClusters {
+
+  // breakpoints of the clipped reads counted per position in a sorted buffer, neighbouring positions
+  // (closer than the tolerance) merged into one candidate junction. with coordinate sorted input the
+  // sites behind the current read are final and written out as the stream goes, otherwise at the end
+
+ public:
+  BreakpointClusters(unsigned int tol, const RefVector &refvec) : out(NULL), tolerance(tol), refs(refvec), checkRef(-1), checkPos(0) {}
+
+  void SetOutput(LineWriter *output) {
+    out = output;
+    *out << "#chr\tstart\tend\tpeak\treads\tdiscordant\tsoftClip\thardClip\tstartClip\tendClip" << '\n';
+  }
+
+  void Add(const struct BreakpointHit &hit) {
+    struct site &st = sites[ pair <int, unsigned int> (hit.refID, hit.position) ];
+    ++st.reads;
+    if ( hit.discordant == true ) ++st.discordant;
+    if ( hit.clip == 'S' ) ++st.soft;
+    if ( hit.clip == 'H' ) ++st.hard;
+    if ( hit.atEnd == true ) ++st.atEnd;
+  }
+
+  void Advance(int refID, unsigned int position) {   // coordinate sorted input: no breakpoint before this comes any more
+    if ( refID == checkRef && position < checkPos + 1000 ) return;
+    checkRef = refID;
+    checkPos = position;
+    emit(refID, position);
+  }
+
+  void Flush() {
+    emit(-2, 0);
+  }
+
+ private:
+  struct site {
+    site() : reads(0), discordant(0), soft(0), hard(0), atEnd(0) {}
+    unsigned int reads;
+    unsigned int discordant;
+    unsigned int soft;
+    unsigned int hard;
+    unsigned int atEnd;
+  };
+
+  LineWriter *out;
+  unsigned int tolerance;
+  const RefVector &refs;
+  map < pair <int, unsigned int>, struct site > sites;
+  int checkRef;
+  unsigned int checkPos;
+
+  void emit(int refID, unsigned int position) {      // write the clusters that cannot grow any more (all for refID -2)
+    map < pair <int, unsigned int>, struct site >::iterator first = sites.begin();
+    while ( first != sites.end() ) {
+      map < pair <int, unsigned int>, struct site >::iterator last = first, next = first;
+      struct site sum;
+      unsigned int peak = first->first.second, peakReads = 0;
+      for (; next != sites.end() && next->first.first == first->first.first && next->first.second <= last->first.second + tolerance; ++next) {
+        last = next;
+        sum.reads += next->second.reads;
+        sum.discordant += next->second.discordant;
+        sum.soft += next->second.soft;
+        sum.hard += next->second.hard;
+        sum.atEnd += next->second.atEnd;
+        if ( next->second.reads > peakReads ) {
+          peak = next->first.second;
+          peakReads = next->second.reads;
+        }
+      }
+      if ( refID != -2 && last->first.first == refID && last->first.second + tolerance >= position ) break;
+      *out << refs.at(first->first.first).RefName << "\t" << first->first.second << "\t" << last->first.second << "\t" << peak
+           << "\t" << sum.reads << "\t" << sum.discordant << "\t" << sum.soft << "\t" << sum.hard
+           << "\t" << (sum.reads - sum.atEnd) << "\t" << sum.atEnd << "\n";
+      sites.erase(first, next);
+      first = next;
+    }
+  }
+
+};
+
+class FastqEmitter {
+
+  // FASTQ of chosen read categories straight from the name grouped pass: the primary records of a name
+  // are collected, and when the next name starts the name is classified and its reads are written in
+  // their original orientation (interleaved or _1/_2 files, plain or BGZF, which any gzip reader takes)
+
+ public:
+  FastqEmitter() : enabled(false), paired(false), compress(false), toStdout(false), written(0), incomplete(0) {}
+
+  bool Open(const string &prefix, const string &categories, const string &layout, const string &compression, int threads) {
+    enabled = true;
+    paired = ( layout == "paired" );
+    compress = ( compression == "bgzf" || compression == "gzip" );
+    toStdout = ( prefix == "-" );
+    vector <string> cats;
+    splitstring(categories, cats, ",");
+    for (size_t i = 0; i < cats.size(); i++) wanted.insert(cats[i]);
+    if ( wanted.empty() ) wanted.insert("unmapped");
+    string suffix = (compress == true) ? ".fq.gz" : ".fq";
+    for (int f = 0; f < (paired ? 2 : 1); f++) {
+      string fname = (toStdout == true) ? "-" : prefix + (paired ? (f == 0 ? "_1" : "_2") : "") + suffix;
+      if ( compress == true ) {
+        if ( !bgzf[f].Open(fname, threads) ) return false;
+      } else {
+        plain[f] = (toStdout == true) ? stdout : fopen(fname.c_str(), "w");
+        if ( plain[f] == NULL ) return false;
+      }
+    }
+    reset("");
+    return true;
+  }
+
+  bool Enabled() const {
+    return enabled;
+  }
+
+  bool ToStdout() const {
+    return toStdout;
+  }
+
+  void Add(const BamAlignment &bam, bool xenoMulti) {   // records with their char data, grouped by name
+    if ( bam.Name != name ) {
+      emit();
+      reset(bam.Name);
+    }
+    if ( xenoMulti == true ) xeno = true;
+    if ( bam.IsPrimaryAlignment() == false || (bam.AlignmentFlag & 0x800) != 0 ) return;   // secondary, supplementary
+    pairedRead = bam.IsPaired();
+    struct mate &m = mates[ (pairedRead == true && bam.IsSecondMate() == true) ? 1 : 0 ];
+    m.seen = true;
+    m.mapped = bam.IsMapped();
+    m.refID = bam.RefID;
+    m.proper = bam.IsProperPair();
+    m.seq = bam.QueryBases;
+    m.qual = (bam.Qualities.size() == bam.QueryBases.size()) ? bam.Qualities : string(bam.QueryBases.size(), '"');
+    if ( bam.IsReverseStrand() == true ) {           // back to the sequencer orientation
+      reverse(m.seq.begin(), m.seq.end());
+      for (size_t i = 0; i < m.seq.size(); i++) m.seq[i] = complement(m.seq[i]);
+      reverse(m.qual.begin(), m.qual.end());
+    }
+  }
+
+  void Close() {
+    if ( enabled == false ) return;
+    emit();
+    for (int f = 0; f < (paired ? 2 : 1); f++) {
+      if ( compress == true )             bgzf[f].Close();
+      else if ( plain[f] == stdout )      fflush(plain[f]);
+      else                                fclose(plain[f]);
+    }
+    cerr << "fastq: " << written << " names written, " << incomplete << " pairs with a mate missing skipped" << endl;
+    enabled = false;
+  }
+
+ private:
+  struct mate {
+    bool seen;
+    bool mapped;
+    int refID;
+    bool proper;
+    string seq;
+    string qual;
+  };
+
+  bool enabled;
+  bool paired;
+  bool compress;
+  bool toStdout;
+  set <string> wanted;                               // all, unmapped, singleton, xenoMulti, wrongPair
+  FILE *plain[2];
+  BgzfWriter bgzf[2];
+  string name;
+  struct mate mates[2];
+  bool pairedRead;
+  bool xeno;
+  unsigned long long written;
+  unsigned long long incomplete;
+  string text;
+
+  void reset(const string &newName) {
+    name = newName;
+    mates[0].seen = mates[1].seen = false;
+    pairedRead = false;
+    xeno = false;
+  }
+
+  static char complement(char b) {
+    switch (b) {
+    case 'A': return 'T';
+    case 'C': return 'G';
+    case 'G': return 'C';
+    case 'T': return 'A';
+    case 'a': return 't';
+    case 'c': return 'g';
+    case 'g': return 'c';
+    case 't': return 'a';
+    default:  return b;
+    }
+  }
+
+  void emit() {
+    if ( name == "" || (mates[0].seen == false && mates[1].seen == false) ) return;
+    unsigned int nmapped = (mates[0].seen && mates[0].mapped) + (mates[1].seen && mates[1].mapped);
+    bool take = ( wanted.count("all") > 0 );
+    if ( wanted.count("unmapped") > 0 && nmapped == 0 ) take = true;
+    if ( wanted.count("singleton") > 0 && pairedRead == true && nmapped == 1 ) take = true;
+    if ( wanted.count("wrongPair") > 0 && pairedRead == true && nmapped == 2
+         && (mates[0].refID != mates[1].refID || mates[0].proper == false) ) take = true;
+    if ( wanted.count("xenoMulti") > 0 && xeno == true ) take = true;
+    if ( take == false ) return;
+    if ( pairedRead == true && (mates[0].seen == false || mates[1].seen == false) ) {
+      ++incomplete;
+      return;
+    }
+    for (int m = 0; m < (pairedRead ? 2 : 1); m++) {
+      text.clear();
+      text += '@';
+      text += name;
+      if ( pairedRead == true ) text += (m == 0) ? "/1" : "/2";
+      text += '\n';
+      text += mates[m].seq;
+      text += "\n+\n";
+      text += mates[m].qual;
+      text += '\n';
+      int f = (paired == true) ? m : 0;
+      if ( compress == true ) bgzf[f].Write(text.data(), text.size());
+      else                    fwrite(text.data(), 1, text.size(), plain[f]);
+    }
+    ++written;
+  }
+
+};
+
+class XenoRouter {
+
+  // xeno split output: the records of a read name are held until the next name starts, then the whole
+  // fragment goes to the human, mouse or ambiguous writer (each with its own compression thread), so
+  // mates and their secondary / supplementary records always land in the same bam.
+  // ambiguous: a record with XA hits in the other species, or the records on both species
+
+ public:
+  XenoRouter() : nrecs(0), cls(0), mouse(false), human(false) {
+    for (int c = 0; c < 3; c++) {
+      writers[c] = NULL;
+      fragments[c] = 0;
+    }
+  }
+
+  enum { HUMAN = 0, MOUSE = 1, AMBIGUOUS = 2 };
+
+  void SetWriter(int category, BgzfWriter *writer) {
+    writers[category] = writer;
+  }
+
+  void Add(const char *recName, const string &record, unsigned char xenoClass) {   // record bytes without block_size
+    if ( name != recName ) {
+      Flush();
+      name = recName;
+    }
+    if ( nrecs == recs.size() ) recs.resize(nrecs + 1);
+    recs[nrecs++] = record;
+    cls |= xenoClass;
+    if ( xenoClass & XENO_MOUSE ) mouse = true;
+    else                          human = true;
+  }
+
+  void Flush() {
+    if ( nrecs > 0 ) {
+      int category = HUMAN;
+      if ( (cls & (XENO_MULTI | XENO_PAIR)) || (mouse == true && human == true) ) category = AMBIGUOUS;
+      else if ( mouse == true )                                                  category = MOUSE;
+      ++fragments[category];
+      if ( writers[category] != NULL ) {
+        for (size_t i = 0; i < nrecs; i++) writers[category]->SaveRaw(recs[i]);
+      }
+    }
+    nrecs = 0;
+    cls = 0;
+    mouse = human = false;
+  }
+
+  unsigned long long fragments[3];
+
+ private:
+  BgzfWriter *writers[3];
+  string name;
+  vector <string> recs;                              // kept between names, only the first nrecs are used
+  size_t nrecs;
+  unsigned char cls;
+  bool mouse;
+  bool human;
+
+};
+
+class MateCache {
+
+  // coordinate sorted input: the records of a read name are kept until all of them are seen
+  // (both mates, NH alignments and SA parts of each mate), then handed back for the fragment level.
+  // beyond the memory cap all waiting names are spilled into hashed bucket files, later records of
+  // a spilled name follow it there, and the buckets are grouped by name at the end.
+
+ public:
+  MateCache(size_t capMB, const string &dir) : cap(capMB * 1048576), bytes(0), spilled(false) {
+    prefix = (dir == "") ? "." : dir;
+    stringstream ss;
+    ss << prefix << "/Rseq_bam_stats." << getpid() << ".mates.";
+    prefix = ss.str();
+  }
+
+  bool Add(const BamAlignment &bam, const struct RecordInfo &info, bool passed, vector <struct FragRecord> &done) {
+
+    unsigned int m = ( bam.IsPaired() == true && bam.IsFirstMate() == false ) ? 1 : 0;
+    unsigned int parts = 1;
+    if ( bam.HasTag("NH") ) bam.GetTag("NH", parts);
+    if ( parts == 0 ) parts = 1;
+    string SA;
+    if ( bam.GetTag("SA", SA) ) parts += count(SA.begin(), SA.end(), ';');
+
+    if ( spilled == true && spilled_names.count(name_hash(bam.Name)) > 0 ) {   // the name lives on disk now
+      if ( passed == true ) {
+        struct FragRecord rec;
+        frag_record(bam, info, rec);
+        rec.rank = rank_of(bam);
+        write_frag(bucket(bam.Name), rec);
+      }
+      return false;
+    }
+
+    unordered_map <string, struct MateGroup>::iterator git = waiting.find(bam.Name);
+    if ( git == waiting.end() ) {
+      struct MateGroup tmp;
+      tmp.seen[0] = tmp.seen[1] = 0;
+      tmp.expected[0] = tmp.expected[1] = 0;
+      git = waiting.insert( pair <string, struct MateGroup> (bam.Name, tmp) ).first;
+      bytes += sizeof(struct MateGroup) + 2*bam.Name.size() + 64;
+    }
+    struct MateGroup &group = git->second;
+    group.seen[m] += 1;
+    if ( parts > group.expected[m] ) group.expected[m] = parts;
+    if ( bam.IsPaired() == true && group.expected[1-m] == 0 ) group.expected[1-m] = 1;
+    if ( passed == true ) {
+      group.recs.resize(group.recs.size() + 1);
+      frag_record(bam, info, group.recs.back());
+      group.recs.back().rank = rank_of(bam);
+      bytes += sizeof(struct FragRecord) + bam.Name.size();
+    }
+
+    if ( group.seen[0] >= group.expected[0] && group.seen[1] >= group.expected[1] ) {   // complete
+      done.swap(group.recs);
+      stable_sort(done.begin(), done.end(), frag_rank_less);
+      bytes -= sizeof(struct MateGroup) + 2*bam.Name.size() + 64 + done.size()*(sizeof(struct FragRecord) + bam.Name.size());
+      waiting.erase(git);
+      return true;
+    }
+
+    if ( bytes > cap && !waiting.empty() ) spill();
+    return false;
+
+  }
+
+  void Remaining(vector < vector <struct FragRecord> > &groups) {   // names never completed (mate missing from the bam)
+    groups.clear();
+    unordered_map <string, struct MateGroup>::iterator git = waiting.begin();
+    for (; git != waiting.end(); ++git) {
+      groups.push_back(vector <struct FragRecord> ());
+      groups.back().swap((git->second).recs);
+      stable_sort(groups.back().begin(), groups.back().end(), frag_rank_less);
+    }
+    waiting.clear();
+    bytes = 0;
+  }
+
+  size_t Buckets() {
+    return buckets.size();
+  }
+
+  void LoadBucket(size_t b, vector < vector <struct FragRecord> > &groups) {
+    groups.clear();
+    if ( buckets[b] == NULL ) return;
+    buckets[b]->close();
+    delete buckets[b];
+    buckets[b] = NULL;
+    string file = bucket_file(b);
+    ifstream in(file.c_str());
+    unordered_map <string, size_t> index;
+    struct FragRecord rec;
+    while ( read_frag(in, rec) ) {
+      unordered_map <string, size_t>::iterator iit = index.find(rec.name);
+      if ( iit == index.end() ) {
+        iit = index.insert( pair <string, size_t> (rec.name, groups.size()) ).first;
+        groups.push_back(vector <struct FragRecord> ());
+      }
+      groups[iit->second].push_back(rec);
+    }
+    in.close();
+    remove(file.c_str());
+    for (size_t i = 0; i < groups.size(); i++) stable_sort(groups[i].begin(), groups[i].end(), frag_rank_less);
+  }
+
+ private:
+  static const size_t nbuckets = 64;
+  size_t cap;
+  size_t bytes;                    // of the waiting names, held against the cap
+  bool spilled;
+  string prefix;
+  unordered_map <string, struct MateGroup> waiting;
+  unordered_set <size_t> spilled_names;
+  vector <ofstream *> buckets;
+
+  size_t name_hash(const string &name) {
+    return std::hash<string>()(name);
+  }
+
+  unsigned int rank_of(const BamAlignment &bam) {
+    unsigned int m = ( bam.IsPaired() == true && bam.IsFirstMate() == false ) ? 1 : 0;
+    return (m << 2) | ((bam.AlignmentFlag & 0x100) ? 2 : 0) | ((bam.AlignmentFlag & 0x800) ? 1 : 0);
+  }
+
+  string bucket_file(size_t b) {
+    stringstream ss;
+    ss << prefix << b;
+    return ss.str();
+  }
+
+  ofstream &bucket(const string &name) {
+    size_t b = (name_hash(name) >> 7) % nbuckets;   // the low bits pick the unordered_map slot
+    if ( buckets.empty() ) buckets.assign(nbuckets, (ofstream *)NULL);
+    if ( buckets[b] == NULL ) {
+      buckets[b] = new ofstream(bucket_file(b).c_str());
+      if ( ! buckets[b]->is_open() ) {
+        cerr << "mate cache ERROR: could not open spill file " << bucket_file(b) << endl;
+        exit(1);
+      }
+    }
+    return *buckets[b];
+  }
+
+  void spill() {
+    if ( spilled == false ) cerr << "mate cache: over " << cap/1048576 << " MB, waiting names are spilled to " << prefix << "*" << endl;
+    unordered_map <string, struct MateGroup>::iterator git = waiting.begin();
+    for (; git != waiting.end(); ++git) {
+      spilled_names.insert(name_hash(git->first));
+      ofstream &out = bucket(git->first);
+      vector <struct FragRecord>::iterator rit = (git->second).recs.begin();
+      for (; rit != (git->second).recs.end(); ++rit) write_frag(out, *rit);
+    }
+    waiting.clear();
+    bytes = 0;                                       // the spilled name set (16 bytes a name) is not held against the cap,
+    spilled = true;                                  // else once it alone is over it every new name would spill again
+  }
+
+};
+
 
 int main (int argc, char *argv[]) {
  
   struct parameters *param = 0;
   param = interface(param, argc, argv);
 
+  // duplication sketches of several runs (lanes) merged, no bam input
+  string dupSketch = param->dupSketch;
+  string sketchMerge = param->sketchMerge;
+  if ( sketchMerge != "" ) {
+    DupSketches merged;
+    vector <string> files;
+    splitstring(sketchMerge, files, ",");
+    for (size_t i = 0; i < files.size(); i++) {
+      if ( !merged.Load(files[i]) ) {
+        cerr << "Could not read the sketch file " << files[i] << endl;
+        exit(1);
+      }
+    }
+    merged.Report(cout);
+    if ( dupSketch != "" && !merged.Save(dupSketch) ) {
+      cerr << "Could not write the sketch file " << dupSketch << endl;
+      exit(1);
+    }
+    exit(0);
+  }
+
   //-------------------------------------------------------------------------------------------------------+
   // BAM input (file or filenames?)                                                                        |
   //-------------------------------------------------------------------------------------------------------+
@@ -98,7 +756,10 @@ int main (int argc, char *argv[]) {
   int filecount=0;
   vector <string> fnames;
 
-  if (strchr(fof,' ')!=NULL) {
+  if (strcmp(fof,"-")==0) {      // SAM text or BAM on stdin, e.g. straight from the aligner
+    fnames.push_back(fof);
+    filecount++;
+  } else if (strchr(fof,' ')!=NULL) {
     char *ptr;
     ptr=strtok(fof," ");
     while (ptr!=NULL) {
@@ -156,695 +817,352 @@ int main (int argc, char *argv[]) {
 
   unsigned int maxIntron = param->maxIntron;   // maximum intron length
 
-  //bam input and generate index if not yet
+  // type == "s" or type == "p" ?
+  string type = param->type;
+
+  // the per-record types can run as a reader / classifier / writer pipeline
+  int threads = param->threads;
+  bool per_record = ( type == "fixflag" || type == "xeno" || type == "multiMis" );
+  bool pipeline = ( threads > 1 && per_record == true );
+
+  // raw records (written back unchanged but for the flag): the per-record types on a single bam, and
+  // any type on stdin, where SAM text (bwa mem) or BAM (samtools view -u) is told by the first byte
+  bool streamInput = ( fnames.size() == 1 && fnames[0] == "-" );
+  bool passthrough = ( streamInput == true || (per_record == true && fnames.size() == 1) );
   BamMultiReader reader;
-  reader.Open(fnames);                         // the mapping bam file is opened 
+  BgzfReader rawreader;
+  SamReader samreader;
+  RawReader *rawinput = NULL;
+  if ( streamInput == true ) {
+    int first = getc(stdin);
+    ungetc(first, stdin);
+    if ( first == 0x1f ) {
+      if ( rawreader.Open(fnames[0]) ) rawinput = &rawreader;
+    } else {
+      if ( samreader.Open(fnames[0]) ) rawinput = &samreader;
+    }
+  } else {
+    reader.Open(fnames);                       // the mapping bam file is opened 
+    if ( passthrough == true && rawreader.Open(fnames[0]) ) rawinput = &rawreader;
+  }
+  if ( passthrough == true && rawinput == NULL ) {
+    cerr << "Could not read the raw records of " << fnames[0] << endl;
+    exit(1);
+  }
+  struct RecordSource source = {&reader, rawinput, fnames[0], streamInput};
 
   // get header & reference information
-  string header = reader.GetHeaderText();
-  RefVector refs = reader.GetReferenceData();
+  string header = (streamInput == true) ? rawinput->GetHeaderText() : reader.GetHeaderText();
+  RefVector refs = (streamInput == true) ? rawinput->GetReferenceData() : reader.GetReferenceData();
 
   // attempt to open BamWriter
   BamWriter writer;
+  BgzfWriter mtwriter;                           // own BGZF writer: raw records, compression level, parallel blocks
+  string mouseBam = param->mouseWriter;
+  string ambiguousBam = param->ambiguousWriter;
+  bool split = ( type == "xeno" && (mouseBam != "" || ambiguousBam != "") );
+  bool bgzf = ( pipeline == true || passthrough == true || split == true || param->clevel != -1 );
+  mtwriter.SetCompressionLevel(param->clevel);
   string outputBam = param->writer;
   if ( outputBam != "" ) {
-    if ( !writer.Open(param->writer, header, refs) ) {
+    int wthreads = (split == true && threads < 2) ? 2 : threads;   // the split writers get a compression thread each
+    bool opened = (bgzf == true) ? mtwriter.Open(param->writer, header, refs, wthreads) : writer.Open(param->writer, header, refs);
+    if ( !opened ) {
+      cerr << "Could not open output BAM file" << endl;
+      exit(0);
+    }
+  }
+
+  // xeno split: whole fragments to the human (--writer), mouse and ambiguous bams in the same pass
+  XenoRouter router;
+  XenoRouter *xeno_split = NULL;
+  BgzfWriter mousewriter, ambiguouswriter;
+  if ( split == true ) {
+    if ( string(param->sorting) == "coordinate" ) {
+      cerr << "the xeno split needs name grouped input (not --sorting coordinate)" << endl;
+      exit(1);
+    }
+    int wthreads = (threads > 1) ? threads : 2;
+    mousewriter.SetCompressionLevel(param->clevel);
+    ambiguouswriter.SetCompressionLevel(param->clevel);
+    if ( (mouseBam != "" && !mousewriter.Open(mouseBam, header, refs, wthreads))
+         || (ambiguousBam != "" && !ambiguouswriter.Open(ambiguousBam, header, refs, wthreads)) ) {
       cerr << "Could not open output BAM file" << endl;
       exit(0);
     }
+    if ( outputBam != "" ) router.SetWriter(XenoRouter::HUMAN, &mtwriter);
+    if ( mouseBam != "" ) router.SetWriter(XenoRouter::MOUSE, &mousewriter);
+    if ( ambiguousBam != "" ) router.SetWriter(XenoRouter::AMBIGUOUS, &ambiguouswriter);
+    xeno_split = &router;
   }
 
   // attempt to write unmapped reads
-  ofstream unmapped_f;
+  LineWriter unmapped_f;
   string unmapped = param->unmapped;
+  LineWriter *unmapped_out = NULL;
   if ( unmapped != "") {
-    unmapped_f.open(param->unmapped);
+    unmapped_f.Open(unmapped);
+    unmapped_out = &unmapped_f;
   }
 
   // attempt to write arp reads
-  ofstream arp_f;
+  LineWriter arp_f;
   string arp = param->arp;
+  LineWriter *arp_out = NULL;
   if ( arp != "" ) {
-    arp_f.open(param->arp);
+    arp_f.Open(arp);
+    arp_out = &arp_f;
   }
 
   // attemp to write breakpoints
-  ofstream bp_f;
+  LineWriter bp_f;
   string bp_file = param->breakpoint;
+  LineWriter *bp_out = NULL;
   if ( bp_file != "" ) {
-    bp_f.open(param->breakpoint);
+    bp_f.Open(bp_file);
+    bp_out = &bp_f;
   }
 
-  // statistics
-  struct RseqSTATS BAMSTATS = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-
-  map <string, struct Alignment> fragment; // map for fragment
-
-  // type == "s" or type == "p" ?
-  string type = param->type;
-  
-  string old_frag = "SRP";
+  // breakpoints clustered on the fly (one row per candidate junction)
+  LineWriter bpc_f;
+  string bpc_file = param->bpClusters;
+  BreakpointClusters clusters(param->bpTolerance, refs);
+  BreakpointClusters *bp_clusters = NULL;
+  vector <struct BreakpointHit> hits;
+  vector <struct BreakpointHit> *bp_hits = NULL;
+  if ( bpc_file != "" ) {
+    bpc_f.Open(bpc_file);
+    clusters.SetOutput(&bpc_f);
+    bp_clusters = &clusters;
+    bp_hits = &hits;
+  }
 
-  BamAlignment bam;
-  while ( reader.GetNextAlignment(bam) ) {
-
-    BamAlignment cBAM;
-
-    unsigned int unique = 0;
-    string XS = "SRP";
-    bool jc = false;
-    bool chimeric = false;
-    string cliptype = "N";
-    bool hoe = true;                               //true is head
-    string mateStatus = "p";                       //'w' hints breakpoints
-    unsigned int breakpoint = 0;
-    string chrom = "SRP";
-    string strand = "+";
-    unsigned int alignmentStart = 0;
-    unsigned int alignmentEnd = 0;
-    unsigned int cigarEnd;
-    vector <int> blockLengths;
-    vector <int> blockStarts;
-    string mateChr = "SRP";
-    unsigned int matePos = 0;
-    map<unsigned int, unsigned int> insertions;       // for insertions                                        
-    unsigned int softClip = 0;                        // for soft clipping            
-    bool whetherWrite = false;    
-    if ( outputBam != "" ) {
-      whetherWrite = true;
+  // FASTQ of chosen categories (name grouped input)
+  FastqEmitter fastq;
+  FastqEmitter *fastq_out = NULL;
+  string fastqPrefix = param->fastq;
+  if ( fastqPrefix != "" ) {
+    if ( string(param->sorting) == "coordinate" ) {
+      cerr << "fastq output needs name grouped input (not --sorting coordinate)" << endl;
+      exit(1);
     }
-    if (readlen == 0) {
-      readlen = bam.Length;
+    if ( !fastq.Open(fastqPrefix, param->fastqCategories, param->fastqLayout, param->fastqCompress, threads) ) {
+      cerr << "Could not open the fastq output " << fastqPrefix << endl;
+      exit(1);
     }
+    fastq_out = &fastq;
+  }
 
-    //cerr << bam.Name << "endl";
-    
-    ++BAMSTATS.num_Reads;
+  // statistics, per read group or input file if asked
+  StatsGroups groupStats;
+  groupStats.SetGroupBy(param->groupby);
+  string statsFormat = param->statsFormat;
+
+  // duplication estimate from the fragment signatures (no marked duplicates needed)
+  DupSketches sketches;
+  DupSketches *dup_sketches = NULL;
+  if ( dupSketch != "" ) {
+    sketches.SetHeader(header);
+    dup_sketches = &sketches;
+  }
 
-    if ( bam.IsMapped() == true || bam.IsMateMapped() == true ) {  // either this mate or the other mate is mapped
+  struct Alignment frag = {"SRP", 0, 0, "SRP", 0, 0, 0, false};  // the current fragment (input is sorted by read name)
 
-      ++BAMSTATS.num_Mapped;
-      if (bam.IsDuplicate() == true) {
-        ++BAMSTATS.num_Duplicates;
-        continue;                                  // skip duplicated reads
-      }
+  string old_frag = "SRP";
 
-      if ( bam.HasTag("NH") ) {
-        bam.GetTag("NH", unique);                   // rnaseq aligners, such as gsnap and tophat
-      } else {
-        if (bam.MapQuality > 10) {                  // other aligner
-          unique = 1;
-        }
-      }
+  // coordinate sorted input: the fragment level gets the records of a name together from the mate cache
+  string sorting = param->sorting;
+  bool sortedInput = ( sorting == "coordinate" );
+  bool coordinate = ( sortedInput == true && (type == "p" || type == "s") );
+  MateCache mates(param->cacheMB, param->spillDir);
+  vector <struct FragRecord> group;
+  vector < vector <struct FragRecord> > groups;
+
+  // decide which char data the records will need: the types with a fragment level need names (and tags for the
+  // mate cache) of every record, the per-record types only decode tags/bases where a counter depends on them
+  bool fragment_level = ( per_record == false );
+  count_mismatches = ( type == "multiMis" );
+  string genome = param->genome;
+  if ( count_mismatches == true && genome != "" ) {
+    ref_mismatch = new RefMismatch;
+    if ( !ref_mismatch->Open(genome) ) {
+      cerr << "Could not open the genome fasta " << genome << endl;
+      exit(1);
+    }
+  }
+  bool chrRefs = false, nonChrRefs = false;
+  RefVector::iterator refit = refs.begin();
+  for (; refit != refs.end(); ++refit) {
+    if ( (refit->RefName).substr(0,3) == "chr" ) chrRefs = true;
+    else                                        nonChrRefs = true;
+  }
+  tags_XA = ( chrRefs == true && nonChrRefs == true );
+  BamAlignment probe;                             // NH tags: written by the aligner on all mapped records or on none
+  for (unsigned int n = 0; n < 100000 && streamInput == false && reader.GetNextAlignment(probe); n++) {
+    if ( probe.IsMapped() == true ) {
+      tags_NH = probe.HasTag("NH");
+      break;
+    }
+  }
+  if ( streamInput == false ) reader.Rewind();
 
+  // the record and fragment handlers of the mode, chosen here instead of comparing the type on every record
+  bool writing = ( outputBam != "" );
+  RecordStatsFn record_fn = record_stats_for(type, (bp_out != NULL || bp_hits != NULL));
+  FragmentStatsFn fragment_fn = (type == "s") ? fragment_stats<false> : fragment_stats<true>;
 
-      blockStarts.push_back(0);
-      ParseCigar(bam.CigarData, blockStarts, blockLengths, cigarEnd, jc, chimeric, hoe, cliptype, cliplen, insertions, softClip); 
+  if ( pipeline == true ) {
+    record_pipeline(source, refs, mtwriter, writing, cliplen, maxIntron, record_fn, bp_out, bp_clusters, sortedInput, unmapped_out, fastq_out, xeno_split, groupStats, dup_sketches, threads);
+  }
 
-      chrom  = refs.at(bam.RefID).RefName;          // chromosome
-      if (bam.IsReverseStrand()) strand = "-";      // strand -
-      alignmentStart = bam.Position+1;              // start
-      alignmentEnd   = bam.GetEndPosition();        // end
+  BamAlignment bam;
+  string raw;
+  while ( pipeline == false && next_record(source, bam, raw) ) {
 
-      //        for xenograft counting             //
-      //unsigned int num_xenoPair;                 //for human and mouse merged pair
-      //unsigned int num_xenoMulti;                //for reads mapping to both mouse and human
-      //unsigned int num_mouse;                    //for mouse reads
-      //unsigned int num_human;                    //for human reads
-      bool isMouse = false;
-      if ( chrom.substr(0,3) == "chr" ) {
-        isMouse = true;
-      }
+    struct RecordInfo info;
+    struct CharData cd = {false, (passthrough == true) ? &raw : NULL};
+    if ( fragment_level == true ) char_data(bam, cd);
+    if (readlen == 0) {
+      readlen = bam.Length;
+    }
 
-      mateChr = refs.at(bam.MateRefID).RefName;
-      bool isMateMouse = false;
-      if ( mateChr.substr(0,3) == "chr" ) {
-        isMateMouse = true;
-      }
+    //cerr << bam.Name << "endl";
 
-      if ( isMouse == true || isMateMouse == true) {
-        whetherWrite = false;
-        ++BAMSTATS.num_mouse;
+    info.group = groupStats.Group(bam, cd, source);
+    if ( dup_sketches != NULL ) {                    // before record_stats fixes any flag
+      char_data(bam, cd);
+      sketches.Add(bam);
+    }
+    bool passed = record_fn(bam, cd, refs, groupStats[info.group], info, writing, cliplen, maxIntron, bp_out, bp_hits, unmapped_out);
+    if ( fastq_out != NULL ) {
+      char_data(bam, cd);
+      fastq.Add(bam, info.xenoMulti);
+    }
+    if ( bp_hits != NULL ) {
+      if ( sortedInput == true ) clusters.Advance(bam.RefID, bam.Position);
+      for (size_t h = 0; h < hits.size(); h++) clusters.Add(hits[h]);
+      hits.clear();
+    }
+    if ( xeno_split != NULL ) {                      // whole fragments to the split bams
+      if ( info.xenoClass & XENO_ROUTED ) {
+        if ( passthrough == true ) {
+          raw_patch_flag(raw, bam.AlignmentFlag);
+          router.Add(raw.data() + 32, raw, info.xenoClass);
+        } else {
+          char_data(bam, cd);
+          string record;
+          bam_encode(bam, record);
+          router.Add(bam.Name.c_str(), record.substr(4), info.xenoClass);
+        }
+      }
+    } else if ( info.write == true ) {               // write mapped tags to a new bam
+      if ( passthrough == true ) {
+        raw_patch_flag(raw, bam.AlignmentFlag);
+        mtwriter.SaveRaw(raw);
+      } else if ( bgzf == true ) {
+        char_data(bam, cd);
+        mtwriter.SaveAlignment(bam);
       } else {
-        ++BAMSTATS.num_human;
+        writer.SaveAlignment(bam);
       }
+    }
 
-      string XA;
-      bool isMultiMouse = false;
-      bool isMultiHuman = false;
-      if ( bam.HasTag("XA") ) {
-        bam.GetTag("XA", XA);                   // get alternative mapping location
-        vector <string> otherMappings;
-        splitstring(XA, otherMappings, ";");
-        vector<string>::iterator omiter = otherMappings.begin();
-        vector<string>::iterator omiterEnd = otherMappings.end();
-        for (; omiter != omiterEnd; ++omiter) {
-          if ((*omiter).substr(0,3) == "chr") {
-            isMultiMouse = true;
-          } else {
-            isMultiHuman = true;
-          }
-        }
-        if ((isMouse == true && isMultiHuman == true) || (isMouse == false && isMultiMouse == true)) {
-          ++BAMSTATS.num_xenoMulti;
-          whetherWrite = false;
-        }
-        //cerr << bam.Name << "\t" << XA << "\t" << isMouse << "\t" << isMultiMouse << endl;
-      }  //  with XA tag
-
-      if (bam.IsMapped() == true && bam.IsMateMapped() == true) {   // both ends mapped
-          mateChr = refs.at(bam.MateRefID).RefName;
-          matePos = bam.MatePosition;
-          int mateDistance = matePos-alignmentStart;
-          if (mateChr == chrom && abs(mateDistance) < maxIntron) {
-            if (bam.IsProperPair() == false) {
-              bam.SetIsProperPair(true);
-              //cout << bam.IsProperPair() << "\t" << bam.AlignmentFlag << "\n";
-            }
-          }
-   
-          if ( isMouse != isMateMouse ) {     // xenopair
-            ++BAMSTATS.num_xenoPair;
-          }
-      }   //both ends mapped
-
-      if (whetherWrite == true) {
-        writer.SaveAlignment(bam);                    // write mapped tags to a new bam
+    if ( coordinate == true ) {                      // every record counts towards its name's completion, passed or not
+      if ( mates.Add(bam, info, passed, group) == true ) {
+        vector <struct FragRecord>::iterator git = group.begin();
+        for (; git != group.end(); ++git) fragment_fn(*git, frag, old_frag, groupStats[git->group], refs, maxIntron, arp_out);
       }
+      continue;
+    }
 
-      if ( bam.IsMapped() == false ) {                // skip the one with only mate mappable
-        continue;
-      }
+    if ( passed == false ) continue;
 
-      if ( unique == 1 ) {                            // check breakpoint reads
+    if ( per_record == true ) {   //just to fix flag
+       continue;
+    }
 
-        ++BAMSTATS.num_Unique;
+    struct FragRecord rec;
+    frag_record(bam, info, rec);
+    fragment_fn(rec, frag, old_frag, groupStats[rec.group], refs, maxIntron, arp_out);
 
-        //processing MD string, calculate num of mismatches 
-        string MD;
-        bam.GetTag("MD", MD);
 
-        unsigned int num_mismatches = 0; 
-        num_mismatches += insertions.size();
-        map<unsigned int, unsigned int>::iterator inserit_index = insertions.begin();
+  }  //  read a bam
 
-        unsigned int cuPos = alignmentStart;
-        unsigned int cuPosRead = softClip + 1;
+  if ( coordinate == true ) {                     // names left in memory, then the spilled ones bucket by bucket
+    mates.Remaining(groups);
+    for (size_t b = 0; ; b++) {
+      vector < vector <struct FragRecord> >::iterator git = groups.begin();
+      for (; git != groups.end(); ++git) {
+        vector <struct FragRecord>::iterator rit = git->begin();
+        for (; rit != git->end(); ++rit) fragment_fn(*rit, frag, old_frag, groupStats[rit->group], refs, maxIntron, arp_out);
+      }
+      if ( b >= mates.Buckets() ) break;
+      mates.LoadBucket(b, groups);
+    }
+  }
+      
+  if ( bp_clusters != NULL ) clusters.Flush();
+  if ( xeno_split != NULL ) {
+    router.Flush();
+    cerr << "xeno split fragments: human " << router.fragments[XenoRouter::HUMAN] << ", mouse " << router.fragments[XenoRouter::MOUSE]
+         << ", ambiguous " << router.fragments[XenoRouter::AMBIGUOUS] << endl;
+  }
+  fastq.Close();
+  if ( dup_sketches != NULL ) {
+    if ( !sketches.Save(dupSketch) ) {
+      cerr << "Could not write the sketch file " << dupSketch << endl;
+      exit(1);
+    }
+    sketches.Report(cerr);
+  }
 
-        regex rgx( "([0-9]+)([ACGTacgt]|\\^[ACGTacgt]+)" );
-        int subs[] = {1,2};
-        sregex_token_iterator rit ( MD.begin(), MD.end(), rgx, subs );
-        sregex_token_iterator rend;
+  reader.Close();
+  rawreader.Close();
+  samreader.Close();
+  writer.Close();
+  mtwriter.Close();
+  mousewriter.Close();
+  ambiguouswriter.Close();
+  arp_f.Close();
+  bp_f.Close();
+  bpc_f.Close();
+  unmapped_f.Close();
+
+  if ( fastq.ToStdout() == true ) cout.rdbuf(cerr.rdbuf());   // the fastq has stdout, the stats go to stderr
+  if ( statsFormat == "json" || statsFormat == "tsv" ) {
+    print_groups(groupStats, statsFormat);
+  } else {
+    struct RseqSTATS BAMSTATS;
+    groupStats.Total(BAMSTATS);
+    print_stats(BAMSTATS);
+  }
 
-        //cerr << bam.Name << "\t";
+  return 0;
+} //main
 
-        while ( rit != rend ) {
+inline string int2str(unsigned int &i){
+  return uint_text(i);
+}
 
-          unsigned int incre = atoi((*rit).str().c_str());                  //number 1                                               
-          cuPos += incre;                                                   //number 1
-          cuPosRead += incre;
+inline void splitstring(const string &str, vector<string> &elements, const string &delimiter) {
+  string::size_type lastPos = str.find_first_not_of(delimiter, 0);
+  string::size_type pos     = str.find_first_of(delimiter, lastPos);
 
-          if (blockStarts.size() > 1) {   //judge which block the mutation locate
-            vector <int>::iterator bliter2 = blockLengths.begin();
-            vector <int>::iterator bSiter2 = blockStarts.begin();
-            unsigned int culength = 0;
-            while (bliter2 != blockLengths.end() && bSiter2 != blockStarts.end()) {
-              if (cuPosRead <= (culength + *bliter2)) {
-                cuPos += (*bSiter2 - culength);
-                break;
-              }
-              culength += *bliter2;
-              bliter2++;
-              bSiter2++;
-            }
-          } //multi blocks especially useful for RNA-seq junction reads 
-
-          map<unsigned int, unsigned int>::iterator inserit = inserit_index;
-          while ( inserit != insertions.end() ) {
-            if ( inserit->first < cuPosRead ) {
-              cuPosRead += inserit->second;
-              inserit++;
-              inserit_index = inserit;
-            } else {
-              inserit_index = inserit;
-              break;
-            }
-          }
+  while (string::npos != pos || string::npos != lastPos) {
+    elements.push_back(str.substr(lastPos, pos - lastPos));
+    lastPos = str.find_first_not_of(delimiter, pos);
+    pos = str.find_first_of(delimiter, lastPos);
+  }
+}
 
-          ++rit;                                            //round 1 addition
 
-          if (((*rit).str())[0] == '^') {                   //variant 2 
-            incre = (*rit).length() - 1;                    //variant 2
-            cuPos += incre;                                 //variant 2
-            ++num_mismatches;
+inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, vector<int> &blockLengths, unsigned int &alignmentEnd, bool &jc, bool &chimeric, bool &hoe, string &cliptype, unsigned int &cliplen, map<unsigned int, unsigned int> &insertions, unsigned int &softClip) {
 
-          } else if ((*rit).length() == 1) {                // single base nucleotide change
-            //check whether it is "N" or not 
-            //cerr << cuPosRead << "\t";
-            string baseInReadPre = (bam.QueryBases).substr( cuPosRead-1, 1 );
-            if (baseInReadPre != "N") {
-              ++num_mismatches;
-            }
-            cuPos += 1;
-            cuPosRead += 1;
-          } else {
-            cerr << "wired thing happened in the MD string of " << bam.Name << endl;
-            exit(1);
-          }
+  int currPosition = 0;
+  int blockLength  = 0;
 
-          ++rit;                                           
-        } //loop for all MD characters 
-        //cerr << endl;
-
-        if (num_mismatches >= 2) {      //multi mismatches
-          ++BAMSTATS.num_multiMis;
-        }
-
-        if (chimeric == true) {
-
-          if (type == "p") {
-            if ( bam.IsMateMapped() == true){
-              mateChr = refs.at(bam.MateRefID).RefName;
-              matePos = bam.MatePosition;
-              int mateDistance = matePos-alignmentStart;
-              if (mateChr != chrom || abs(mateDistance) > maxIntron) 
-                mateStatus = "w";
-            }
-          }
-
-          if (hoe  == false) {
-            breakpoint =  alignmentStart;
-          }
-          else if (hoe == true) {
-            vector<int>::iterator bsiter = blockStarts.end();
-            vector<int>::iterator bliter = blockLengths.end();
-            breakpoint = alignmentStart + *(bsiter-1) + *(bliter-1);
-          }
-          if ( bp_file != "" ) {
-            bp_f << chrom << "\t" << breakpoint << "\t" << bam.Name << "\t" << mateStatus << "\t" << cliptype << endl;
-          }
-        }
-
-      } // check breakpoint reads
-
-    } else {
-      ++BAMSTATS.num_Unmapped;
-      if ( unmapped != "" ) {
-        unmapped_f << bam.Name << endl;
-      }
-    }
-
-    if (type == "fixflag" || type == "xeno" || type == "multiMis") {   //just to fix flag
-       continue;
-    }
-
-    if (type == "s") {  //single-end
-      if ( bam.Name != old_frag ) {  // new frag
-
-        ++BAMSTATS.num_Reads;
-        if ( bam.IsMapped() ) { //mapped
-          ++BAMSTATS.num_Mapped;
-          if ( unique == 1 ) ++BAMSTATS.num_Unique;
-          else               ++BAMSTATS.num_Multi;
-        } else { //unmapped
-           ++BAMSTATS.num_Unmapped;
-        }
-        if ( bam.IsDuplicate() ) ++BAMSTATS.num_Duplicates;
-        if (  bam.IsFailedQC() ) ++BAMSTATS.num_FailedQC;
-        if (jc == true)          ++BAMSTATS.num_spliced;
-
-        old_frag = bam.Name; // reset old frag
-      } else {  // IT IS AN OLD FRAGMENT!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-      }
-    } else { // paired-end
-      unsigned int mate = 1;
-      if ( bam.IsFirstMate() == false ) mate = 2;           // second mate
-
-      if ( bam.Name != old_frag ) {  // new frag
-
-        if (old_frag != "SRP") {
-          fragment.erase(old_frag);    // remove old_frag
-        }
-
-        if ( bam.IsMapped() == false && bam.IsMateMapped() == false ) {  // unmapped
-          ++BAMSTATS.num_Reads;
-          ++BAMSTATS.num_Unmapped;
-          struct Alignment tmp = {"UM", 0, 0, "UM", 0, 0, 1, jc, cBAM, cBAM};
-          fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-        } // unmapped
-        else if ( bam.IsMapped() == false && bam.IsMateMapped() == true ) {  // one end is not mappable
-          if (mate == 1){
-            struct Alignment tmp = {"UM", 0, 0, "SRP", 0, 0, 5, jc, bam, cBAM};
-            fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-          }
-          else {
-            struct Alignment tmp = {"SRP", 0, 0, "UM", 0, 0, 5, jc, cBAM, bam};
-            fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-          }
-        } // undecided one end not mappable
-        else if ( bam.IsMapped() == true && bam.IsMateMapped() == false ) {  // one other end is not mappable
-
-          if (unique > 1) {  // one end multiple mapped, the other end not mappable
-            ++BAMSTATS.num_Reads;
-            ++BAMSTATS.num_Mapped;
-            ++BAMSTATS.num_Multi;
-            if (mate == 1) {
-              struct Alignment tmp = {"MM", 0, 0, "UM", 0, 0, 2, jc, cBAM, cBAM};
-              fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-            }
-            else {
-              struct Alignment tmp = {"UM", 0, 0, "MM", 0, 0, 2, jc, cBAM, cBAM};
-              fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-            }
-          } // one end multiple mapped, the other end not mappable
-          else { // Singletons (it should be output here, since TopHat does not output the alignment of other mate)
-            ++BAMSTATS.num_Reads;
-            ++BAMSTATS.num_Mapped;
-            ++BAMSTATS.num_Unique;
-            ++BAMSTATS.num_Singletons;
-            ++BAMSTATS.num_WrongPair;
-            ++BAMSTATS.num_WrongPair_dis;
-            if (jc == true) ++BAMSTATS.num_spliced;
-            if (mate == 1) {
-              struct Alignment tmp = {chrom, alignmentStart, alignmentEnd, "UM", 0, 0, 3, jc, bam, cBAM};
-              fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-            }
-            else {
-              struct Alignment tmp = {"UM", 0, 0, chrom, alignmentStart, alignmentEnd, 3, jc, cBAM, bam};
-              fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-            }
-            if ( arp != "" ) arp_f << bam.Name << endl;       // write arp
-          } // Singletons
-
-        } //one another end is not mappable
-
-        else {  // both ends mapped
-          if ( unique == 1 ) {  // current end is uniquelly mapped
-            if (mate == 1) {
-              struct Alignment tmp = {chrom, alignmentStart, alignmentEnd, refs.at(bam.MateRefID).RefName, (bam.MatePosition+1), 0, 6, jc, bam, cBAM};
-              fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-            }
-            else {
-              struct Alignment tmp = {refs.at(bam.MateRefID).RefName, (bam.MatePosition+1), 0, chrom, alignmentStart, alignmentEnd, 7, jc, cBAM, bam};
-              fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-            }
-          } // current unique
-          else {  // current end is not unique
-            if (mate == 1) {
-              if ( bam.IsPrimaryAlignment() == true ){
-                struct Alignment tmp = {chrom, alignmentStart, alignmentEnd, refs.at(bam.MateRefID).RefName, (bam.MatePosition+1), 0, 8, jc, bam, cBAM};
-                fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-              }
-              else {
-                struct Alignment tmp = {"SRP", 0, 0, "SRP", 0, 0, 8, jc, cBAM, cBAM};
-                fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-              }
-            }
-            else { // mate 2
-              if ( bam.IsPrimaryAlignment() == true ){
-                struct Alignment tmp = {refs.at(bam.MateRefID).RefName, (bam.MatePosition+1), 0, chrom, alignmentStart, alignmentEnd, 9, jc, cBAM, bam};
-                fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-              }
-              else {
-                struct Alignment tmp = {"SRP", 0, 0, "SRP", 0, 0, 9, jc, cBAM, cBAM};
-                fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
-              }
-            }
-          } // current multi
-        } // both ends mapped;
-
-        old_frag = bam.Name; // reset old frag
-
-      } // a new frag;
-
-      else {  // IT IS AN OLD FRAGMENT!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-
-        if (fragment[bam.Name].cate == 5) { // one end mapped the other end not, but the mapped end is not decided;
-          if ( unique > 1 ) {  // one end multiple mapped, the other end not mappable
-            ++BAMSTATS.num_Reads;
-            ++BAMSTATS.num_Mapped;
-            ++BAMSTATS.num_Multi;
-            if (mate == 1){
-              fragment[bam.Name].chr1 = "MM";          
-            }
-            else {
-              fragment[bam.Name].chr2 = "MM";
-            }
-            fragment[bam.Name].cate = 2;
-          } // one end multiple mapped, the other end not mappable
-          else { // Singletons
-            ++BAMSTATS.num_Reads;
-            ++BAMSTATS.num_Mapped;
-            ++BAMSTATS.num_Unique;
-            ++BAMSTATS.num_Singletons;
-            ++BAMSTATS.num_WrongPair;
-            ++BAMSTATS.num_WrongPair_dis;
-            if (jc == true) ++BAMSTATS.num_spliced;
-            if (mate == 1){
-              fragment[bam.Name].chr1 = chrom;
-              fragment[bam.Name].start1 = alignmentStart;
-              fragment[bam.Name].end1 = alignmentEnd;
-              fragment[bam.Name].junction = jc;
-              fragment[bam.Name].mate1 = bam;
-              if ( arp != "" ) arp_f << bam.Name << endl;       // write arp
-            }
-            else {
-              fragment[bam.Name].chr2 = chrom;
-              fragment[bam.Name].start2 = alignmentStart;
-              fragment[bam.Name].end2 = alignmentEnd;
-              fragment[bam.Name].junction = jc;
-              fragment[bam.Name].mate2 = bam;
-              if ( arp != "" ) arp_f << bam.Name << endl;       // write arp
-            }
-            fragment[bam.Name].cate = 3;
-          } // Singletons
-        } //cate == 5
-
-        else if (fragment[bam.Name].cate == 6) { // mate 1 is unique
-          if (mate == 1) {
-            if (bam.CigarData.size() == 1){
-              cerr << "mate1 unique inconsistency, exit\n"; cerr << "problem reads: " << bam.Name << endl; cerr << "cigar: " << bam.CigarData.size() << endl; exit(0);
-            }
-            else { //print out the current alignment
-              //writer.SaveAlignment(bam);                          // write
-              if ( arp != "" ) {
-                arp_f << bam.Name << endl;
-              }
-              continue;
-            }
-          } 
-          if (unique == 1) { // both ends are unique VERY GOOD
-            ++BAMSTATS.num_Reads;
-            ++BAMSTATS.num_Mapped;
-            ++BAMSTATS.num_Unique;
-            if ( bam.IsDuplicate() ) ++BAMSTATS.num_Duplicates;
-            if (  bam.IsFailedQC() ) ++BAMSTATS.num_FailedQC;
-            if ( bam.IsProperPair()) ++BAMSTATS.num_ProperPair;
-            else                     ++BAMSTATS.num_WrongPair;
-            if (jc == true || fragment[bam.Name].junction == true) ++BAMSTATS.num_spliced;
-            fragment[bam.Name].end2 = alignmentEnd;
-            fragment[bam.Name].cate = 4;  //unique
-            fragment[bam.Name].mate2 = bam;
-
-            int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
-            if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > maxIntron) ) {
-              ++BAMSTATS.num_WrongPair_dis;
-              if ( arp != "" ) {
-                arp_f << bam.Name << endl;
-              }
-            } else {
-              ++BAMSTATS.num_ProperPair_dis;
-            }
-
-          } // both ends are unique
-          else { // the mate 2 is multi, try to figure out the "primary" record
-            if ( bam.IsPrimaryAlignment() == true ) { // if this is a primary result
-              ++BAMSTATS.num_Reads;
-              ++BAMSTATS.num_Mapped;
-              ++BAMSTATS.num_UniqueHalf;
-              fragment[bam.Name].chr2   = chrom;
-              fragment[bam.Name].start2 = alignmentStart;
-              fragment[bam.Name].end2   = alignmentEnd;
-              fragment[bam.Name].cate   = 10;
-              fragment[bam.Name].mate2 = bam;
-
-              int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
-              if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > maxIntron) ) {
-                if ( arp != "" ) {
-                  arp_f << bam.Name << endl;
-                }
-              }
-            }
-          }
-        } // cate == 6         
-        else if (fragment[bam.Name].cate == 7) { // mate 2 is unique
-          if (mate == 2) {
-            if (bam.CigarData.size() == 1){
-              cerr << "mate2 unique inconsistency, exit\n"; cerr << "problem reads: " << bam.Name << endl; cerr << "cigar: " << bam.CigarData.size() << endl; exit(0);
-            }
-            else { //print out the current alignment
-              //writer.SaveAlignment(bam);                          // write
-              if ( arp != "" ) {
-                arp_f << bam.Name << endl;
-              }
-              continue;
-            }
-          }
-          if (unique == 1) { // both ends are unique VERY GOOD
-            ++BAMSTATS.num_Reads;
-            ++BAMSTATS.num_Mapped;
-            ++BAMSTATS.num_Unique;
-            if ( bam.IsDuplicate() ) ++BAMSTATS.num_Duplicates;
-            if (  bam.IsFailedQC() ) ++BAMSTATS.num_FailedQC;
-            if ( bam.IsProperPair()) ++BAMSTATS.num_ProperPair;
-            else                     ++BAMSTATS.num_WrongPair;
-            if (jc == true || fragment[bam.Name].junction == true) ++BAMSTATS.num_spliced;
-            fragment[bam.Name].end1 = alignmentEnd;
-            fragment[bam.Name].cate = 4;  //unique
-            fragment[bam.Name].mate1 = bam;
-
-            int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
-            if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > maxIntron) ){ 
-              if ( arp != "" ) {
-                arp_f << bam.Name << endl;
-              }
-              ++BAMSTATS.num_WrongPair_dis;
-            } else {
-              ++BAMSTATS.num_ProperPair_dis;
-            }
-          } // both ends are unique
-          else { // the mate 1 is multi
-            if ( bam.IsPrimaryAlignment() == true ) { // if this is a primary result
-              ++BAMSTATS.num_Reads;
-              ++BAMSTATS.num_Mapped;
-              ++BAMSTATS.num_UniqueHalf;
-              fragment[bam.Name].chr1   = chrom;
-              fragment[bam.Name].start1 = alignmentStart;
-              fragment[bam.Name].end1   = alignmentEnd;
-              fragment[bam.Name].cate   = 10;
-              fragment[bam.Name].mate1 = bam;
-              if ( arp != "" ) {
-                int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
-                if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > maxIntron) ) 
-                  arp_f << bam.Name << endl;
-              }
-            }
-          }
-        } // cate == 7
-        else if (fragment[bam.Name].cate == 8) {   // mate 1 is multi
-          if ( fragment[bam.Name].chr1 == "SRP" ){  // meaning it is multi, but the primary is not decided
-            if ( mate == 1 ){
-              if ( bam.IsPrimaryAlignment() == true ){
-                fragment[bam.Name].chr1   = chrom;
-                fragment[bam.Name].start1 = alignmentStart;
-                fragment[bam.Name].end1   = alignmentEnd;
-                fragment[bam.Name].mate1  = bam;
-              }
-            } 
-          }  // the primary is not decided
-
-          if ( mate == 2 ) {     // check mate 2
-            if ( unique == 1 ) { // if mate 2 is unique
-              ++BAMSTATS.num_Reads;
-              ++BAMSTATS.num_Mapped;
-              ++BAMSTATS.num_UniqueHalf;
-              fragment[bam.Name].chr2   = chrom;
-              fragment[bam.Name].start2 = alignmentStart;
-              fragment[bam.Name].end2   = alignmentEnd;
-              fragment[bam.Name].cate   = 10;
-              fragment[bam.Name].mate2  = bam;
-              if ( arp != "" ) {
-                int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
-                if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > maxIntron) ) 
-                  arp_f << bam.Name << endl;
-              }
-            }
-            else { // if mate 2 is multi
-              ++BAMSTATS.num_Reads;
-              ++BAMSTATS.num_Mapped;
-              ++BAMSTATS.num_Multi;
-              fragment[bam.Name].cate = 2;
-            }
-          } // check mate 2  
-        } // cate == 8
-        else if (fragment[bam.Name].cate == 9) { // mate 2 is multi
-          if ( fragment[bam.Name].chr2 == "SRP" ) {  // meaning it is multi, but the primary is not decided
-            if ( mate == 2 ){
-              if ( bam.IsPrimaryAlignment() == true ){
-                fragment[bam.Name].chr2   = chrom;
-                fragment[bam.Name].start2 = alignmentStart;
-                fragment[bam.Name].end2   = alignmentEnd;
-                fragment[bam.Name].mate2  = bam;
-              }
-            } 
-          }  // the primary is not decided
-
-          if ( mate == 1 ) {     // check mate 1
-            if ( unique == 1 ) { // if mate 1 is unique
-              ++BAMSTATS.num_Reads;
-              ++BAMSTATS.num_Mapped;
-              ++BAMSTATS.num_UniqueHalf;
-              fragment[bam.Name].chr1   = chrom;
-              fragment[bam.Name].start1 = alignmentStart;
-              fragment[bam.Name].end1   = alignmentEnd;
-              fragment[bam.Name].cate   = 10;
-              fragment[bam.Name].mate1  = bam;
-              if ( arp != "" ) {
-                int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
-                if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > maxIntron) ) 
-                  arp_f << bam.Name << endl;
-              }
-            }
-            else { // if mate 1 is multi
-              ++BAMSTATS.num_Reads;
-              ++BAMSTATS.num_Mapped;
-              ++BAMSTATS.num_Multi;
-              fragment[bam.Name].cate = 2;
-            }
-          } // check mate 1 
-
-        } // cate == 9
-
-      } // old fragment
-    } // paired-end
-
-  }  //  read a bam
-      
-  reader.Close();
-  writer.Close();
-  arp_f.close();
-
-  print_stats(BAMSTATS);
-
-  return 0;
-} //main
-
-inline string int2str(unsigned int &i){
-  string s;
-  stringstream ss(s);
-  ss << i;
-  return ss.str();
-}
-
-inline void splitstring(const string &str, vector<string> &elements, const string &delimiter) {
-  string::size_type lastPos = str.find_first_not_of(delimiter, 0);
-  string::size_type pos     = str.find_first_of(delimiter, lastPos);
-
-  while (string::npos != pos || string::npos != lastPos) {
-    elements.push_back(str.substr(lastPos, pos - lastPos));
-    lastPos = str.find_first_not_of(delimiter, pos);
-    pos = str.find_first_of(delimiter, lastPos);
-  }
-}
-
-
-inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, vector<int> &blockLengths, unsigned int &alignmentEnd, bool &jc, bool &chimeric, bool &hoe, string &cliptype, unsigned int &cliplen, map<unsigned int, unsigned int> &insertions, unsigned int &softClip) {
-
-  int currPosition = 0;
-  int blockLength  = 0;
-
-  unsigned int insertSize;
-  unsigned int insertPos;
+  unsigned int insertSize;
+  unsigned int insertPos;
 
 
   //  Rip through the CIGAR ops and figure out if there is more
@@ -919,7 +1237,8 @@ inline void print_stats(struct RseqSTATS &rstats) {
   cout << "Unique:        " << rstats.num_Unique     << endl;
   cout << "Uniquehalf:    " << rstats.num_UniqueHalf << endl;
   cout << "duplicates:    " << rstats.num_Duplicates << endl;
-  cout << "multiMis:      " << rstats.num_multiMis   << endl;
+  if ( count_mismatches == true ) cout << "multiMis:      " << rstats.num_multiMis   << endl;
+  else                            cout << "multiMis:      " << "NA" << endl;
   cout << "failed_QC:     " << rstats.num_FailedQC   << endl;
   cout << "singletons:    " << rstats.num_Singletons << endl;
   cout << "ProperPair:    " << rstats.num_ProperPair << endl;
@@ -933,3 +1252,856 @@ inline void print_stats(struct RseqSTATS &rstats) {
   cout << "mouseReads:    " << rstats.num_mouse      << endl;
   cout << "humanReads:    " << rstats.num_human      << endl;
 }
+
+
+inline void print_groups(const StatsGroups &groups, const string &format) {
+
+  // the totals and every group, as json or as a tsv table (one row per group, the totals last)
+  struct RseqSTATS total;
+  groups.Total(total);
+  size_t nfields = sizeof(stats_fields) / sizeof(stats_fields[0]);
+  string by = (groups.GroupBy() == "") ? "none" : groups.GroupBy();
+
+  if ( format == "tsv" ) {
+    cout << "group";
+    for (size_t f = 0; f < nfields; f++) cout << "\t" << stats_fields[f].name;
+    cout << endl;
+    for (size_t g = 0; g <= groups.names.size(); g++) {
+      const struct RseqSTATS &st = (g < groups.names.size()) ? groups.stats[g] : total;
+      cout << ((g < groups.names.size()) ? groups.names[g] : "total");
+      for (size_t f = 0; f < nfields; f++) {
+        if ( stats_fields[f].count == &RseqSTATS::num_multiMis && count_mismatches == false ) cout << "\tNA";
+        else cout << "\t" << st.*(stats_fields[f].count);
+      }
+      cout << endl;
+    }
+    return;
+  }
+
+  cout << "{\n  \"groupby\": \"" << by << "\",\n  \"groups\": {";
+  for (size_t g = 0; g <= groups.names.size(); g++) {
+    const struct RseqSTATS &st = (g < groups.names.size()) ? groups.stats[g] : total;
+    if ( g == groups.names.size() ) cout << "\n  },\n  \"total\": {";
+    else {
+      string name;
+      for (size_t i = 0; i < groups.names[g].size(); i++) {    // RG ids are plain text, escape quotes and backslashes
+        if ( groups.names[g][i] == '"' || groups.names[g][i] == '\\' ) name += '\\';
+        name += groups.names[g][i];
+      }
+      cout << ((g > 0) ? "," : "") << "\n    \"" << name << "\": {";
+    }
+    for (size_t f = 0; f < nfields; f++) {
+      cout << ((f > 0) ? ", " : "") << "\"" << stats_fields[f].name << "\": ";
+      if ( stats_fields[f].count == &RseqSTATS::num_multiMis && count_mismatches == false ) cout << "null";
+      else cout << st.*(stats_fields[f].count);
+    }
+    cout << "}";
+  }
+  cout << "\n}" << endl;
+
+}
+
+
+template <bool Paired, bool MultiMis, bool Breakpoints>
+inline bool record_stats(BamAlignment &bam, struct CharData &cd, const RefVector &refs, struct RseqSTATS &stats, struct RecordInfo &info, bool writing, unsigned int cliplen, unsigned int maxIntron, LineWriter *bp_out, vector <struct BreakpointHit> *bp_hits, LineWriter *unmapped_out) {
+
+  // per-record part of the stats (counters, xeno decision, flag fix, mismatches and breakpoints);
+  // returns false for the records that are not passed on to the fragment level (duplicates, mate-only).
+  // one instance per mode: the mate status of paired-end breakpoints, the mismatch count of multiMis
+  // and the breakpoints themselves are compiled in only where they are used
+
+  string XS = "SRP";
+  bool chimeric = false;
+  string cliptype = "N";
+  bool hoe = true;                               //true is head
+  string mateStatus = "p";                       //'w' hints breakpoints
+  unsigned int breakpoint = 0;
+  string strand = "+";
+  unsigned int cigarEnd;
+  vector <int> blockLengths;
+  vector <int> blockStarts;
+  string mateChr = "SRP";
+  unsigned int matePos = 0;
+  map<unsigned int, unsigned int> insertions;       // for insertions                                        
+  unsigned int softClip = 0;                        // for soft clipping            
+  unsigned int &unique = info.unique;
+  bool &jc = info.jc;
+  string &chrom = info.chrom;
+  unsigned int &alignmentStart = info.alignmentStart;
+  unsigned int &alignmentEnd = info.alignmentEnd;
+  unique = 0;
+  jc = false;
+  chrom = "SRP";
+  alignmentStart = 0;
+  alignmentEnd = 0;
+  bool whetherWrite = writing;
+  info.write = false;
+  info.xenoMulti = false;
+  info.xenoClass = 0;
+
+  ++stats.num_Reads;
+
+  if ( bam.IsMapped() == true || bam.IsMateMapped() == true ) {  // either this mate or the other mate is mapped
+
+    ++stats.num_Mapped;
+    if (bam.IsDuplicate() == true) {
+      ++stats.num_Duplicates;
+      return false;                              // skip duplicated reads
+    }
+
+    if ( tags_NH == true ) char_data(bam, cd);
+    if ( tags_NH == true && bam.HasTag("NH") ) {
+      bam.GetTag("NH", unique);                   // rnaseq aligners, such as gsnap and tophat
+    } else {
+      if (bam.MapQuality > 10) {                  // other aligner
+        unique = 1;
+      }
+    }
+
+
+    blockStarts.push_back(0);
+    ParseCigar(bam.CigarData, blockStarts, blockLengths, cigarEnd, jc, chimeric, hoe, cliptype, cliplen, insertions, softClip); 
+
+    chrom  = refs.at(bam.RefID).RefName;          // chromosome
+    if (bam.IsReverseStrand()) strand = "-";      // strand -
+    alignmentStart = bam.Position+1;              // start
+    alignmentEnd   = bam.GetEndPosition();        // end
+
+    //        for xenograft counting             //
+    //unsigned int num_xenoPair;                 //for human and mouse merged pair
+    //unsigned int num_xenoMulti;                //for reads mapping to both mouse and human
+    //unsigned int num_mouse;                    //for mouse reads
+    //unsigned int num_human;                    //for human reads
+    bool isMouse = false;
+    if ( chrom.substr(0,3) == "chr" ) {
+      isMouse = true;
+    }
+
+    mateChr = refs.at(bam.MateRefID).RefName;
+    bool isMateMouse = false;
+    if ( mateChr.substr(0,3) == "chr" ) {
+      isMateMouse = true;
+    }
+
+    if ( isMouse == true || isMateMouse == true) {
+      whetherWrite = false;
+      ++stats.num_mouse;
+    } else {
+      ++stats.num_human;
+    }
+    info.xenoClass = XENO_ROUTED | (isMouse ? XENO_MOUSE : 0);
+
+    string XA;
+    bool isMultiMouse = false;
+    bool isMultiHuman = false;
+    if ( tags_XA == true ) char_data(bam, cd);
+    if ( tags_XA == true && bam.HasTag("XA") ) {
+      bam.GetTag("XA", XA);                   // get alternative mapping location
+      vector <string> otherMappings;
+      splitstring(XA, otherMappings, ";");
+      vector<string>::iterator omiter = otherMappings.begin();
+      vector<string>::iterator omiterEnd = otherMappings.end();
+      for (; omiter != omiterEnd; ++omiter) {
+        if ((*omiter).substr(0,3) == "chr") {
+          isMultiMouse = true;
+        } else {
+          isMultiHuman = true;
+        }
+      }
+      if ((isMouse == true && isMultiHuman == true) || (isMouse == false && isMultiMouse == true)) {
+        ++stats.num_xenoMulti;
+        info.xenoMulti = true;
+        info.xenoClass |= XENO_MULTI;
+        whetherWrite = false;
+      }
+      //cerr << bam.Name << "\t" << XA << "\t" << isMouse << "\t" << isMultiMouse << endl;
+    }  //  with XA tag
+
+    if (bam.IsMapped() == true && bam.IsMateMapped() == true) {   // both ends mapped
+        mateChr = refs.at(bam.MateRefID).RefName;
+        matePos = bam.MatePosition;
+        int mateDistance = matePos-alignmentStart;
+        if (mateChr == chrom && abs(mateDistance) < maxIntron) {
+          if (bam.IsProperPair() == false) {
+            bam.SetIsProperPair(true);
+            //cout << bam.IsProperPair() << "\t" << bam.AlignmentFlag << "\n";
+          }
+        }
+ 
+        if ( isMouse != isMateMouse ) {     // xenopair
+          ++stats.num_xenoPair;
+          info.xenoClass |= XENO_PAIR;
+        }
+    }   //both ends mapped
+
+    if (whetherWrite == true) {
+      info.write = true;                            // write mapped tags to a new bam
+    }
+
+    if ( bam.IsMapped() == false ) {                // skip the one with only mate mappable
+      return false;
+    }
+
+    if ( unique == 1 ) {                            // check breakpoint reads
+
+      ++stats.num_Unique;
+
+      if ( MultiMis == true ) {
+
+        char_data(bam, cd);
+        //mismatch and deletion events, against the reference or from the MD string
+        vector <struct MismatchEvent> events;
+        mismatch_events(ref_mismatch, bam, refs.at(bam.RefID).RefName, events);
+
+        unsigned int num_mismatches = 0; 
+        num_mismatches += insertions.size();
+        for (size_t e = 0; e < events.size(); e++) {
+          if ( events[e].type == 'D' ) {
+            ++num_mismatches;
+          } else if ( bam.QueryBases[events[e].readPos - 1] != 'N' ) {   // single base nucleotide change, not an N
+            ++num_mismatches;
+          }
+        }
+
+        if (num_mismatches >= 2) {      //multi mismatches
+          ++stats.num_multiMis;
+        }
+
+      } // mismatches
+
+      if (Breakpoints == true && chimeric == true) {
+
+        if (Paired == true) {
+          if ( bam.IsMateMapped() == true){
+            mateChr = refs.at(bam.MateRefID).RefName;
+            matePos = bam.MatePosition;
+            int mateDistance = matePos-alignmentStart;
+            if (mateChr != chrom || abs(mateDistance) > maxIntron) 
+              mateStatus = "w";
+          }
+        }
+
+        if (hoe  == false) {
+          breakpoint =  alignmentStart;
+        }
+        else if (hoe == true) {
+          vector<int>::iterator bsiter = blockStarts.end();
+          vector<int>::iterator bliter = blockLengths.end();
+          breakpoint = alignmentStart + *(bsiter-1) + *(bliter-1);
+        }
+        if ( bp_out != NULL ) {
+          char_data(bam, cd);
+          *bp_out << chrom << "\t" << breakpoint << "\t" << bam.Name << "\t" << mateStatus << "\t" << cliptype << "\n";
+        }
+        if ( bp_hits != NULL ) {
+          struct BreakpointHit hit = {bam.RefID, breakpoint, (mateStatus == "w"), cliptype[0], hoe};
+          bp_hits->push_back(hit);
+        }
+      }
+
+    } // check breakpoint reads
+
+  } else {
+    ++stats.num_Unmapped;
+    if ( unmapped_out != NULL ) {
+      char_data(bam, cd);
+      *unmapped_out << bam.Name << '\n';
+    }
+  }
+
+  return true;
+
+}
+
+
+inline RecordStatsFn record_stats_for(const string &type, bool breakpoints) {
+
+  // the record_stats of a mode, chosen once before the records are read
+  if ( type == "p" )        return (breakpoints == true) ? record_stats<true, false, true> : record_stats<true, false, false>;
+  if ( type == "multiMis" ) return (breakpoints == true) ? record_stats<false, true, true> : record_stats<false, true, false>;
+  return (breakpoints == true) ? record_stats<false, false, true> : record_stats<false, false, false>;
+
+}
+
+
+inline void add_stats(struct RseqSTATS &total, const struct RseqSTATS &part) {
+  total.num_Reads          += part.num_Reads;
+  total.num_Duplicates     += part.num_Duplicates;
+  total.num_FailedQC       += part.num_FailedQC;
+  total.num_Mapped         += part.num_Mapped;
+  total.num_Unique         += part.num_Unique;
+  total.num_spliced        += part.num_spliced;
+  total.num_Singletons     += part.num_Singletons;
+  total.num_ProperPair     += part.num_ProperPair;
+  total.num_WrongPair      += part.num_WrongPair;
+  total.num_ProperPair_dis += part.num_ProperPair_dis;
+  total.num_WrongPair_dis  += part.num_WrongPair_dis;
+  total.num_xenoPair       += part.num_xenoPair;
+  total.num_xenoMulti      += part.num_xenoMulti;
+  total.num_mouse          += part.num_mouse;
+  total.num_human          += part.num_human;
+  total.num_Multi          += part.num_Multi;
+  total.num_Unmapped       += part.num_Unmapped;
+  total.num_UniqueHalf     += part.num_UniqueHalf;
+  total.num_multiMis       += part.num_multiMis;
+}
+
+
+inline void record_pipeline(struct RecordSource &source, const RefVector &refs, BgzfWriter &writer, bool writing, unsigned int cliplen, unsigned int maxIntron, RecordStatsFn record_fn, LineWriter *bp_out, class BreakpointClusters *clusters, bool sortedInput, LineWriter *unmapped_out, class FastqEmitter *fastq, class XenoRouter *router, class StatsGroups &groupStats, class DupSketches *sketches, int threads) {
+
+  // one reader thread cuts the input into batches of core records, the workers run record_stats on whole
+  // batches, and this thread writes the batches back in input order (bounded number in flight)
+  const size_t batch_reads = 4096;
+  const size_t max_batches = 4 * threads;
+  deque < std::shared_ptr<struct RecordBatch> > inflight;     // batches in input order
+  deque < std::shared_ptr<struct RecordBatch> > todo;         // batches waiting for a worker
+  bool reading = true;
+  mutex mtx;
+  condition_variable space_cv, todo_cv, done_cv;
+
+  thread reader_t([&]() {
+    std::shared_ptr<struct RecordBatch> batch(new RecordBatch);
+    while ( true ) {
+      batch->reads.resize(batch->reads.size() + 1);
+      batch->raws.resize(batch->reads.size());
+      if ( !next_record(source, batch->reads.back(), batch->raws.back()) ) {
+        batch->reads.pop_back();
+        batch->raws.pop_back();
+        break;
+      }
+      if ( batch->reads.size() < batch_reads ) continue;
+      std::shared_ptr<struct RecordBatch> next(new RecordBatch);
+      source.probeNH = false;                          // tags_NH is fixed before the workers see a batch
+      {
+        unique_lock<mutex> lock(mtx);
+        while ( inflight.size() >= max_batches ) space_cv.wait(lock);
+        batch->done = false;
+        inflight.push_back(batch);
+        todo.push_back(batch);
+      }
+      todo_cv.notify_one();
+      batch = next;
+    }
+    unique_lock<mutex> lock(mtx);
+    if ( !batch->reads.empty() ) {
+      batch->done = false;
+      inflight.push_back(batch);
+      todo.push_back(batch);
+    }
+    reading = false;
+    todo_cv.notify_all();
+    done_cv.notify_all();
+  });
+
+  vector <thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.push_back(thread([&]() {
+      while ( true ) {
+        std::shared_ptr<struct RecordBatch> batch;
+        {
+          unique_lock<mutex> lock(mtx);
+          while ( todo.empty() && reading == true ) todo_cv.wait(lock);
+          if ( todo.empty() ) return;
+          batch = todo.front();
+          todo.pop_front();
+        }
+        batch->groups.SetGroupBy(groupStats.GroupBy());
+        batch->write.assign(batch->reads.size(), false);
+        batch->xenoMulti.assign(batch->reads.size(), false);
+        batch->xenoClass.assign(batch->reads.size(), 0);
+        if ( sketches != NULL ) batch->sketches.Configure(*sketches);
+        LineWriter bp_ss, unmapped_ss;                       // not opened: the batch text
+        vector <BamAlignment>::iterator rit = batch->reads.begin();
+        for (size_t i = 0; rit != batch->reads.end(); ++rit, ++i) {
+          struct RecordInfo info;
+          struct CharData cd = {false, (source.raw != NULL) ? &batch->raws[i] : NULL};
+          info.group = batch->groups.Group(*rit, cd, source);
+          if ( sketches != NULL ) {
+            char_data(*rit, cd);
+            batch->sketches.Add(*rit);
+          }
+          record_fn(*rit, cd, refs, batch->groups[info.group], info, writing, cliplen, maxIntron,
+                    (bp_out == NULL) ? NULL : &bp_ss, (clusters == NULL) ? NULL : &batch->bp_hits,
+                    (unmapped_out == NULL) ? NULL : &unmapped_ss);
+          batch->write[i] = info.write;
+          batch->xenoMulti[i] = info.xenoMulti;
+          batch->xenoClass[i] = info.xenoClass;
+          if ( fastq != NULL ) char_data(*rit, cd);
+          if ( router != NULL ) batch->write[i] = ( (info.xenoClass & XENO_ROUTED) != 0 );
+          if ( batch->write[i] == false ) continue;
+          if ( source.raw != NULL ) raw_patch_flag(batch->raws[i], rit->AlignmentFlag);   // passthrough
+          else                      char_data(*rit, cd);    // BgzfWriter serializes the decoded fields
+        }
+        bp_ss.Take(batch->breakpoints);
+        unmapped_ss.Take(batch->unmapped);
+        {
+          lock_guard<mutex> lock(mtx);
+          batch->done = true;
+        }
+        done_cv.notify_all();
+      }
+    }));
+  }
+
+  while ( true ) {                                     // ordered writer
+    std::shared_ptr<struct RecordBatch> batch;
+    {
+      unique_lock<mutex> lock(mtx);
+      while ( (inflight.empty() && reading == true) || (!inflight.empty() && inflight.front()->done == false) ) done_cv.wait(lock);
+      if ( inflight.empty() ) break;
+      batch = inflight.front();
+      inflight.pop_front();
+    }
+    space_cv.notify_one();
+    for (size_t i = 0; i < batch->reads.size(); i++) {
+      if ( fastq != NULL ) fastq->Add(batch->reads[i], batch->xenoMulti[i]);
+      if ( batch->write[i] == false ) continue;
+      if ( router != NULL ) {
+        if ( source.raw != NULL ) {
+          router->Add(batch->raws[i].data() + 32, batch->raws[i], batch->xenoClass[i]);
+        } else {
+          string record;
+          bam_encode(batch->reads[i], record);
+          router->Add(batch->reads[i].Name.c_str(), record.substr(4), batch->xenoClass[i]);
+        }
+        continue;
+      }
+      if ( source.raw != NULL ) writer.SaveRaw(batch->raws[i]);
+      else                      writer.SaveAlignment(batch->reads[i]);
+    }
+    if ( bp_out != NULL ) *bp_out << batch->breakpoints;
+    if ( clusters != NULL ) {
+      if ( sortedInput == true ) clusters->Advance(batch->reads[0].RefID, batch->reads[0].Position);
+      for (size_t h = 0; h < batch->bp_hits.size(); h++) clusters->Add(batch->bp_hits[h]);
+    }
+    if ( unmapped_out != NULL ) *unmapped_out << batch->unmapped;
+    groupStats.Merge(batch->groups);
+    if ( sketches != NULL ) sketches->Merge(batch->sketches);
+  }
+
+  reader_t.join();
+  for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+}
+
+
+template <bool Paired>
+inline void fragment_stats(const struct FragRecord &rec, struct Alignment &frag, string &old_frag, struct RseqSTATS &BAMSTATS, const RefVector &refs, unsigned int maxIntron, LineWriter *arp_out) {
+
+  // fragment level counting, the records of a read name are expected one after the other (single-end or paired-end instance)
+  const unsigned int &unique = rec.unique;
+  const bool &jc = rec.jc;
+  string chrom = (rec.refID >= 0) ? refs.at(rec.refID).RefName : "SRP";
+  const unsigned int &alignmentStart = rec.alignmentStart;
+  const unsigned int &alignmentEnd = rec.alignmentEnd;
+
+  if (Paired == false) {  //single-end
+    if ( rec.name != old_frag ) {  // new frag
+
+      ++BAMSTATS.num_Reads;
+      if ( rec.mapped ) { //mapped
+        ++BAMSTATS.num_Mapped;
+        if ( unique == 1 ) ++BAMSTATS.num_Unique;
+        else               ++BAMSTATS.num_Multi;
+      } else { //unmapped
+         ++BAMSTATS.num_Unmapped;
+      }
+      if ( rec.duplicate ) ++BAMSTATS.num_Duplicates;
+      if (  rec.failedQC ) ++BAMSTATS.num_FailedQC;
+      if (jc == true)          ++BAMSTATS.num_spliced;
+
+      old_frag = rec.name; // reset old frag
+    } else {  // IT IS AN OLD FRAGMENT!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+    }
+  } else { // paired-end
+    unsigned int mate = 1;
+    if ( rec.first == false ) mate = 2;           // second mate
+
+    if ( rec.name != old_frag ) {  // new frag
+
+      if ( rec.mapped == false && rec.mateMapped == false ) {  // unmapped
+        ++BAMSTATS.num_Reads;
+        ++BAMSTATS.num_Unmapped;
+        struct Alignment tmp = {"UM", 0, 0, "UM", 0, 0, 1, jc};
+        frag = tmp;
+      } // unmapped
+      else if ( rec.mapped == false && rec.mateMapped == true ) {  // one end is not mappable
+        if (mate == 1){
+          struct Alignment tmp = {"UM", 0, 0, "SRP", 0, 0, 5, jc};
+          frag = tmp;
+        }
+        else {
+          struct Alignment tmp = {"SRP", 0, 0, "UM", 0, 0, 5, jc};
+          frag = tmp;
+        }
+      } // undecided one end not mappable
+      else if ( rec.mapped == true && rec.mateMapped == false ) {  // one other end is not mappable
+
+        if (unique > 1) {  // one end multiple mapped, the other end not mappable
+          ++BAMSTATS.num_Reads;
+          ++BAMSTATS.num_Mapped;
+          ++BAMSTATS.num_Multi;
+          if (mate == 1) {
+            struct Alignment tmp = {"MM", 0, 0, "UM", 0, 0, 2, jc};
+            frag = tmp;
+          }
+          else {
+            struct Alignment tmp = {"UM", 0, 0, "MM", 0, 0, 2, jc};
+            frag = tmp;
+          }
+        } // one end multiple mapped, the other end not mappable
+        else { // Singletons (it should be output here, since TopHat does not output the alignment of other mate)
+          ++BAMSTATS.num_Reads;
+          ++BAMSTATS.num_Mapped;
+          ++BAMSTATS.num_Unique;
+          ++BAMSTATS.num_Singletons;
+          ++BAMSTATS.num_WrongPair;
+          ++BAMSTATS.num_WrongPair_dis;
+          if (jc == true) ++BAMSTATS.num_spliced;
+          if (mate == 1) {
+            struct Alignment tmp = {chrom, alignmentStart, alignmentEnd, "UM", 0, 0, 3, jc};
+            frag = tmp;
+          }
+          else {
+            struct Alignment tmp = {"UM", 0, 0, chrom, alignmentStart, alignmentEnd, 3, jc};
+            frag = tmp;
+          }
+          if ( arp_out != NULL ) *arp_out << rec.name << '\n';       // write arp
+        } // Singletons
+
+      } //one another end is not mappable
+
+      else {  // both ends mapped
+        if ( unique == 1 ) {  // current end is uniquelly mapped
+          if (mate == 1) {
+            struct Alignment tmp = {chrom, alignmentStart, alignmentEnd, refs.at(rec.mateRefID).RefName, (unsigned int)(rec.matePosition+1), 0, 6, jc};
+            frag = tmp;
+          }
+          else {
+            struct Alignment tmp = {refs.at(rec.mateRefID).RefName, (unsigned int)(rec.matePosition+1), 0, chrom, alignmentStart, alignmentEnd, 7, jc};
+            frag = tmp;
+          }
+        } // current unique
+        else {  // current end is not unique
+          if (mate == 1) {
+            if ( rec.primary == true ){
+              struct Alignment tmp = {chrom, alignmentStart, alignmentEnd, refs.at(rec.mateRefID).RefName, (unsigned int)(rec.matePosition+1), 0, 8, jc};
+              frag = tmp;
+            }
+            else {
+              struct Alignment tmp = {"SRP", 0, 0, "SRP", 0, 0, 8, jc};
+              frag = tmp;
+            }
+          }
+          else { // mate 2
+            if ( rec.primary == true ){
+              struct Alignment tmp = {refs.at(rec.mateRefID).RefName, (unsigned int)(rec.matePosition+1), 0, chrom, alignmentStart, alignmentEnd, 9, jc};
+              frag = tmp;
+            }
+            else {
+              struct Alignment tmp = {"SRP", 0, 0, "SRP", 0, 0, 9, jc};
+              frag = tmp;
+            }
+          }
+        } // current multi
+      } // both ends mapped;
+
+      old_frag = rec.name; // reset old frag
+
+    } // a new frag;
+
+    else {  // IT IS AN OLD FRAGMENT!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+
+      if (frag.cate == 5) { // one end mapped the other end not, but the mapped end is not decided;
+        if ( unique > 1 ) {  // one end multiple mapped, the other end not mappable
+          ++BAMSTATS.num_Reads;
+          ++BAMSTATS.num_Mapped;
+          ++BAMSTATS.num_Multi;
+          if (mate == 1){
+            frag.chr1 = "MM";          
+          }
+          else {
+            frag.chr2 = "MM";
+          }
+          frag.cate = 2;
+        } // one end multiple mapped, the other end not mappable
+        else { // Singletons
+          ++BAMSTATS.num_Reads;
+          ++BAMSTATS.num_Mapped;
+          ++BAMSTATS.num_Unique;
+          ++BAMSTATS.num_Singletons;
+          ++BAMSTATS.num_WrongPair;
+          ++BAMSTATS.num_WrongPair_dis;
+          if (jc == true) ++BAMSTATS.num_spliced;
+          if (mate == 1){
+            frag.chr1 = chrom;
+            frag.start1 = alignmentStart;
+            frag.end1 = alignmentEnd;
+            frag.junction = jc;
+            if ( arp_out != NULL ) *arp_out << rec.name << '\n';       // write arp
+          }
+          else {
+            frag.chr2 = chrom;
+            frag.start2 = alignmentStart;
+            frag.end2 = alignmentEnd;
+            frag.junction = jc;
+            if ( arp_out != NULL ) *arp_out << rec.name << '\n';       // write arp
+          }
+          frag.cate = 3;
+        } // Singletons
+      } //cate == 5
+
+      else if (frag.cate == 6) { // mate 1 is unique
+        if (mate == 1) {
+          if (rec.oneCigar == true){
+            cerr << "mate1 unique inconsistency, exit\n"; cerr << "problem reads: " << rec.name << endl; cerr << "cigar: " << 1 << endl; exit(0);
+          }
+          else { //print out the current alignment
+            //writer.SaveAlignment(bam);                          // write
+            if ( arp_out != NULL ) {
+              *arp_out << rec.name << '\n';
+            }
+            return;
+          }
+        } 
+        if (unique == 1) { // both ends are unique VERY GOOD
+          ++BAMSTATS.num_Reads;
+          ++BAMSTATS.num_Mapped;
+          ++BAMSTATS.num_Unique;
+          if ( rec.duplicate ) ++BAMSTATS.num_Duplicates;
+          if (  rec.failedQC ) ++BAMSTATS.num_FailedQC;
+          if ( rec.properPair) ++BAMSTATS.num_ProperPair;
+          else                     ++BAMSTATS.num_WrongPair;
+          if (jc == true || frag.junction == true) ++BAMSTATS.num_spliced;
+          frag.end2 = alignmentEnd;
+          frag.cate = 4;  //unique
+
+          int dis = frag.start1 - frag.start2;
+          if ( (frag.chr1 != frag.chr2) || (abs(dis) > maxIntron) ) {
+            ++BAMSTATS.num_WrongPair_dis;
+            if ( arp_out != NULL ) {
+              *arp_out << rec.name << '\n';
+            }
+          } else {
+            ++BAMSTATS.num_ProperPair_dis;
+          }
+
+        } // both ends are unique
+        else { // the mate 2 is multi, try to figure out the "primary" record
+          if ( rec.primary == true ) { // if this is a primary result
+            ++BAMSTATS.num_Reads;
+            ++BAMSTATS.num_Mapped;
+            ++BAMSTATS.num_UniqueHalf;
+            frag.chr2   = chrom;
+            frag.start2 = alignmentStart;
+            frag.end2   = alignmentEnd;
+            frag.cate   = 10;
+
+            int dis = frag.start1 - frag.start2;
+            if ( (frag.chr1 != frag.chr2) || (abs(dis) > maxIntron) ) {
+              if ( arp_out != NULL ) {
+                *arp_out << rec.name << '\n';
+              }
+            }
+          }
+        }
+      } // cate == 6         
+      else if (frag.cate == 7) { // mate 2 is unique
+        if (mate == 2) {
+          if (rec.oneCigar == true){
+            cerr << "mate2 unique inconsistency, exit\n"; cerr << "problem reads: " << rec.name << endl; cerr << "cigar: " << 1 << endl; exit(0);
+          }
+          else { //print out the current alignment
+            //writer.SaveAlignment(bam);                          // write
+            if ( arp_out != NULL ) {
+              *arp_out << rec.name << '\n';
+            }
+            return;
+          }
+        }
+        if (unique == 1) { // both ends are unique VERY GOOD
+          ++BAMSTATS.num_Reads;
+          ++BAMSTATS.num_Mapped;
+          ++BAMSTATS.num_Unique;
+          if ( rec.duplicate ) ++BAMSTATS.num_Duplicates;
+          if (  rec.failedQC ) ++BAMSTATS.num_FailedQC;
+          if ( rec.properPair) ++BAMSTATS.num_ProperPair;
+          else                     ++BAMSTATS.num_WrongPair;
+          if (jc == true || frag.junction == true) ++BAMSTATS.num_spliced;
+          frag.end1 = alignmentEnd;
+          frag.cate = 4;  //unique
+
+          int dis = frag.start1 - frag.start2;
+          if ( (frag.chr1 != frag.chr2) || (abs(dis) > maxIntron) ){ 
+            if ( arp_out != NULL ) {
+              *arp_out << rec.name << '\n';
+            }
+            ++BAMSTATS.num_WrongPair_dis;
+          } else {
+            ++BAMSTATS.num_ProperPair_dis;
+          }
+        } // both ends are unique
+        else { // the mate 1 is multi
+          if ( rec.primary == true ) { // if this is a primary result
+            ++BAMSTATS.num_Reads;
+            ++BAMSTATS.num_Mapped;
+            ++BAMSTATS.num_UniqueHalf;
+            frag.chr1   = chrom;
+            frag.start1 = alignmentStart;
+            frag.end1   = alignmentEnd;
+            frag.cate   = 10;
+            if ( arp_out != NULL ) {
+              int dis = frag.start1 - frag.start2;
+              if ( (frag.chr1 != frag.chr2) || (abs(dis) > maxIntron) ) 
+                *arp_out << rec.name << '\n';
+            }
+          }
+        }
+      } // cate == 7
+      else if (frag.cate == 8) {   // mate 1 is multi
+        if ( frag.chr1 == "SRP" ){  // meaning it is multi, but the primary is not decided
+          if ( mate == 1 ){
+            if ( rec.primary == true ){
+              frag.chr1   = chrom;
+              frag.start1 = alignmentStart;
+              frag.end1   = alignmentEnd;
+            }
+          } 
+        }  // the primary is not decided
+
+        if ( mate == 2 ) {     // check mate 2
+          if ( unique == 1 ) { // if mate 2 is unique
+            ++BAMSTATS.num_Reads;
+            ++BAMSTATS.num_Mapped;
+            ++BAMSTATS.num_UniqueHalf;
+            frag.chr2   = chrom;
+            frag.start2 = alignmentStart;
+            frag.end2   = alignmentEnd;
+            frag.cate   = 10;
+            if ( arp_out != NULL ) {
+              int dis = frag.start1 - frag.start2;
+              if ( (frag.chr1 != frag.chr2) || (abs(dis) > maxIntron) ) 
+                *arp_out << rec.name << '\n';
+            }
+          }
+          else { // if mate 2 is multi
+            ++BAMSTATS.num_Reads;
+            ++BAMSTATS.num_Mapped;
+            ++BAMSTATS.num_Multi;
+            frag.cate = 2;
+          }
+        } // check mate 2  
+      } // cate == 8
+      else if (frag.cate == 9) { // mate 2 is multi
+        if ( frag.chr2 == "SRP" ) {  // meaning it is multi, but the primary is not decided
+          if ( mate == 2 ){
+            if ( rec.primary == true ){
+              frag.chr2   = chrom;
+              frag.start2 = alignmentStart;
+              frag.end2   = alignmentEnd;
+            }
+          } 
+        }  // the primary is not decided
+
+        if ( mate == 1 ) {     // check mate 1
+          if ( unique == 1 ) { // if mate 1 is unique
+            ++BAMSTATS.num_Reads;
+            ++BAMSTATS.num_Mapped;
+            ++BAMSTATS.num_UniqueHalf;
+            frag.chr1   = chrom;
+            frag.start1 = alignmentStart;
+            frag.end1   = alignmentEnd;
+            frag.cate   = 10;
+            if ( arp_out != NULL ) {
+              int dis = frag.start1 - frag.start2;
+              if ( (frag.chr1 != frag.chr2) || (abs(dis) > maxIntron) ) 
+                *arp_out << rec.name << '\n';
+            }
+          }
+          else { // if mate 1 is multi
+            ++BAMSTATS.num_Reads;
+            ++BAMSTATS.num_Mapped;
+            ++BAMSTATS.num_Multi;
+            frag.cate = 2;
+          }
+        } // check mate 1 
+
+      } // cate == 9
+
+    } // old fragment
+  } // paired-end
+
+}
+
+
+inline void frag_record(const BamAlignment &bam, const struct RecordInfo &info, struct FragRecord &rec) {
+  rec.name = bam.Name;
+  rec.group = info.group;
+  rec.first = bam.IsFirstMate();
+  rec.mapped = bam.IsMapped();
+  rec.mateMapped = bam.IsMateMapped();
+  rec.primary = bam.IsPrimaryAlignment();
+  rec.duplicate = bam.IsDuplicate();
+  rec.failedQC = bam.IsFailedQC();
+  rec.properPair = bam.IsProperPair();
+  rec.oneCigar = (bam.CigarData.size() == 1);
+  rec.jc = info.jc;
+  rec.unique = info.unique;
+  rec.refID = (info.chrom == "SRP") ? -1 : bam.RefID;
+  rec.alignmentStart = info.alignmentStart;
+  rec.alignmentEnd = info.alignmentEnd;
+  rec.mateRefID = bam.MateRefID;
+  rec.matePosition = bam.MatePosition;
+}
+
+
+inline bool frag_rank_less(const struct FragRecord &a, const struct FragRecord &b) {
+  return a.rank < b.rank;
+}
+
+
+inline void write_frag(ostream &out, const struct FragRecord &rec) {
+  out << rec.name << "\t" << rec.group << "\t" << rec.first << rec.mapped << rec.mateMapped << rec.primary << rec.duplicate << rec.failedQC
+      << rec.properPair << rec.oneCigar << rec.jc << "\t" << rec.unique << "\t" << rec.refID << "\t" << rec.alignmentStart
+      << "\t" << rec.alignmentEnd << "\t" << rec.mateRefID << "\t" << rec.matePosition << "\t" << rec.rank << "\n";
+}
+
+
+inline bool read_frag(istream &in, struct FragRecord &rec) {
+  string bits;
+  if ( !(in >> rec.name >> rec.group >> bits >> rec.unique >> rec.refID >> rec.alignmentStart >> rec.alignmentEnd
+         >> rec.mateRefID >> rec.matePosition >> rec.rank) || bits.size() != 9 ) return false;
+  rec.first = (bits[0] == '1');
+  rec.mapped = (bits[1] == '1');
+  rec.mateMapped = (bits[2] == '1');
+  rec.primary = (bits[3] == '1');
+  rec.duplicate = (bits[4] == '1');
+  rec.failedQC = (bits[5] == '1');
+  rec.properPair = (bits[6] == '1');
+  rec.oneCigar = (bits[7] == '1');
+  rec.jc = (bits[8] == '1');
+  return true;
+}
+
+
+inline void char_data(BamAlignment &bam, struct CharData &cd) {
+  if ( cd.decoded == false ) {
+    if ( cd.raw != NULL ) raw_char(*cd.raw, bam);
+    else                  bam.BuildCharData();
+    cd.decoded = true;
+  }
+}
+
+
+inline bool next_record(struct RecordSource &source, BamAlignment &bam, string &raw) {
+  if ( source.raw == NULL ) return source.multi->GetNextAlignmentCore(bam);
+  if ( !source.raw->Next(raw) ) return false;
+  raw_core(raw, bam);
+  if ( source.probeNH == true && bam.IsMapped() == true ) {
+    BamAlignment tags;
+    raw_char(raw, tags);
+    tags_NH = tags.HasTag("NH");
+    source.probeNH = false;
+  }
+  return true;
+}
@@ -14,6 +14,24 @@ struct parameters {
   char* breakpoint;
   unsigned int readlength;
   unsigned int maxIntron;
+  unsigned int threads;
+  char* sorting;
+  char* spillDir;
+  unsigned int cacheMB;
+  int clevel;
+  char* groupby;
+  char* statsFormat;
+  char* bpClusters;
+  unsigned int bpTolerance;
+  char* fastq;
+  char* fastqCategories;
+  char* fastqLayout;
+  char* fastqCompress;
+  char* mouseWriter;
+  char* ambiguousWriter;
+  char* dupSketch;
+  char* sketchMerge;
+  char* genome;
 };
 
 struct parameters* interface(struct parameters* param,int argc, char *argv[]);
@@ -41,6 +59,38 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   param->unmapped = new char; 
   param->arp = new char;
   param->breakpoint = new char;
+  param->threads = 1;
+  param->sorting = new char;
+  param->spillDir = new char;
+  *param->sorting = '\0';
+  *param->spillDir = '\0';
+  param->cacheMB = 4096;
+  param->clevel = -1;
+  param->groupby = new char;
+  param->statsFormat = new char;
+  *param->groupby = '\0';
+  *param->statsFormat = '\0';
+  param->bpClusters = new char;
+  *param->bpClusters = '\0';
+  param->bpTolerance = 10;
+  param->fastq = new char;
+  param->fastqCategories = new char;
+  param->fastqLayout = new char;
+  param->fastqCompress = new char;
+  *param->fastq = '\0';
+  *param->fastqCategories = '\0';
+  *param->fastqLayout = '\0';
+  *param->fastqCompress = '\0';
+  param->mouseWriter = new char;
+  param->ambiguousWriter = new char;
+  *param->mouseWriter = '\0';
+  *param->ambiguousWriter = '\0';
+  param->dupSketch = new char;
+  param->sketchMerge = new char;
+  *param->dupSketch = '\0';
+  *param->sketchMerge = '\0';
+  param->genome = new char;
+  *param->genome = '\0';
 
   const struct option long_options[] ={
     {"mapping",1,0,'m'},
@@ -52,6 +102,24 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     {"breakpoint",1,0,'b'},
     {"readlength",1,0,'l'},
     {"maxIntron",1,0,'i'},
+    {"threads",1,0,'n'},
+    {"sorting",1,0,'s'},
+    {"cacheMB",1,0,'c'},
+    {"spillDir",1,0,'d'},
+    {"compression-level",1,0,'z'},
+    {"groupby",1,0,'g'},
+    {"statsFormat",1,0,'f'},
+    {"bpClusters",1,0,'k'},
+    {"bpTolerance",1,0,'r'},
+    {"fastq",1,0,'q'},
+    {"fastqCategories",1,0,'e'},
+    {"fastqLayout",1,0,'y'},
+    {"fastqCompress",1,0,'j'},
+    {"mouseWriter",1,0,'o'},
+    {"ambiguousWriter",1,0,'v'},
+    {"dupSketch",1,0,'x'},
+    {"sketchMerge",1,0,'S'},
+    {"genome",1,0,'G'},
     {"help",0,0,'h'},
     {0, 0, 0, 0}
   };
@@ -60,7 +128,7 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   while (1){
 
     int option_index = 0;
-    c = getopt_long_only (argc, argv,"hm:t:p:w:u:a:b:l:i:",long_options, &option_index);
+    c = getopt_long_only (argc, argv,"hm:t:p:w:u:a:b:l:i:n:s:c:d:z:g:f:k:r:q:e:y:j:o:v:x:S:G:",long_options, &option_index);
 
     if (c == -1){
       break;
@@ -96,6 +164,60 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     case 'i':
       param->maxIntron = atoi(optarg);
       break;
+    case 'n':
+      param->threads = atoi(optarg);
+      break;
+    case 's':
+      param->sorting = optarg;
+      break;
+    case 'c':
+      param->cacheMB = atoi(optarg);
+      break;
+    case 'd':
+      param->spillDir = optarg;
+      break;
+    case 'z':
+      param->clevel = atoi(optarg);
+      break;
+    case 'g':
+      param->groupby = optarg;
+      break;
+    case 'f':
+      param->statsFormat = optarg;
+      break;
+    case 'k':
+      param->bpClusters = optarg;
+      break;
+    case 'r':
+      param->bpTolerance = atoi(optarg);
+      break;
+    case 'q':
+      param->fastq = optarg;
+      break;
+    case 'e':
+      param->fastqCategories = optarg;
+      break;
+    case 'y':
+      param->fastqLayout = optarg;
+      break;
+    case 'j':
+      param->fastqCompress = optarg;
+      break;
+    case 'o':
+      param->mouseWriter = optarg;
+      break;
+    case 'v':
+      param->ambiguousWriter = optarg;
+      break;
+    case 'x':
+      param->dupSketch = optarg;
+      break;
+    case 'S':
+      param->sketchMerge = optarg;
+      break;
+    case 'G':
+      param->genome = optarg;
+      break;
     case 'h':
       help = 1;
       break;
@@ -123,15 +245,42 @@ void usage()
   fprintf(stdout, "\n");
   fprintf(stdout, "Usage: %s options [inputfile] \n\n", program_name);
   fprintf(stdout, "-h --help        print the help message\n");
-  fprintf(stdout, "-m --mapping     mapping_file (bam file)\n");
+  fprintf(stdout, "-m --mapping     mapping_file (bam file), a file of filenames, or - for SAM text / BAM on stdin (name grouped,\n");
+  fprintf(stdout, "                 e.g. straight from bwa mem).\n");
   fprintf(stdout, "-p --pileup      <forget it, currently it is no use> yes: allow pileup, no: skip redundant reads \n");
   fprintf(stdout, "-w --writer      the bam output name (for mapped ailgnments).\n");
+  fprintf(stdout, "-o --mouseWriter     xeno: bam for the mouse fragments; with it or -v the fragments (name grouped input) are\n");
+  fprintf(stdout, "                     split in one pass, --writer then gets the human ones.\n");
+  fprintf(stdout, "-v --ambiguousWriter xeno: bam for the fragments with hits in both species.\n");
   fprintf(stdout, "-u --unmapped    write the unmapped tag names into this file.\n");
+  fprintf(stdout, "-q --fastq       prefix of the fastq output (name grouped input; - is stdout, the stats then go to stderr).\n");
+  fprintf(stdout, "-e --fastqCategories  comma separated: all, unmapped, singleton, xenoMulti, wrongPair (default unmapped).\n");
+  fprintf(stdout, "-y --fastqLayout (interleaved) prefix.fq or (paired) prefix_1.fq and prefix_2.fq (default interleaved).\n");
+  fprintf(stdout, "-j --fastqCompress  (none) or (bgzf), also accepted as (gzip): BGZF blocks, readable by any gzip reader (default none).\n");
   fprintf(stdout, "-a --arp         filename of the arp read name (for fusion assembly use, default not write).\n");
-  fprintf(stdout, "-b --breakpoint  the file for output of potential breakpoint.\n");
+  fprintf(stdout, "-b --breakpoint  the file for output of potential breakpoint (one line per clipped read).\n");
+  fprintf(stdout, "-k --bpClusters  the file for the breakpoints clustered on the fly: one row per candidate junction with the\n");
+  fprintf(stdout, "                 supporting reads, discordant mates and clip types (written as the stream goes for coordinate sorted input).\n");
+  fprintf(stdout, "-r --bpTolerance breakpoints closer than this are merged into one junction (default 10).\n");
   fprintf(stdout, "-l --readlength  the length of the reads.\n");
   fprintf(stdout, "-i --maxIntron   the maximum intron length (for breakpoints).\n");
-  fprintf(stdout, "-t --type        (p)aired-end or (s)ingle-end or just to (fixflag, multiMis).\n");
+  fprintf(stdout, "-t --type        (p)aired-end or (s)ingle-end or just to (fixflag, multiMis, xeno).\n");
+  fprintf(stdout, "-n --threads     threads for the per-record types (fixflag, multiMis, xeno): reading, classifying and bam compression\n");
+  fprintf(stdout, "                 run in a pipeline, output order and counts are the same as with one thread (default 1).\n");
+  fprintf(stdout, "-s --sorting     (name) or (coordinate) sorted input. For coordinate sorted input the records of a read name are\n");
+  fprintf(stdout, "                 held in a mate cache until the fragment is complete (types p and s).\n");
+  fprintf(stdout, "-c --cacheMB     memory cap of the mate cache in MB, beyond it the waiting records are spilled to disk (default 4096).\n");
+  fprintf(stdout, "-d --spillDir    directory for the spilled mate records (default: the current directory).\n");
+  fprintf(stdout, "-z --compression-level  deflate level (0-9) of the output bam, 0 writes uncompressed blocks for piping (default zlib's 6).\n");
+  fprintf(stdout, "                 with a single input bam the per-record types copy the raw records and only patch the flag.\n");
+  fprintf(stdout, "-g --groupby     count the stats per (rg) read group or per input (file) of a file of filenames, in the same pass.\n");
+  fprintf(stdout, "-f --statsFormat (text) the total as before, (json) or (tsv) the groups and the total (default text).\n");
+  fprintf(stdout, "-x --dupSketch   write the duplication sketches (one 16 KB HyperLogLog per library, of the fragments' 5' ends) to this\n");
+  fprintf(stdout, "                 file, the estimated unique fragments, duplication rate and projected library size go to stderr.\n");
+  fprintf(stdout, "                 no duplicate marking needed, any sorting.\n");
+  fprintf(stdout, "-S --sketchMerge comma separated sketch files (e.g. of the lanes): merged, reported on stdout and, with --dupSketch,\n");
+  fprintf(stdout, "                 written there; no bam is read.\n");
+  fprintf(stdout, "-G --genome      reference fasta (multiMis): the mismatches are counted against it, no MD tag (calmd) needed.\n");
   fprintf(stdout, "\n");
 }
 
@@ -145,5 +294,19 @@ void delete_param(struct parameters* param)
   delete(param->unmapped);
   delete(param->arp);
   delete(param->breakpoint);
+  delete(param->sorting);
+  delete(param->spillDir);
+  delete(param->groupby);
+  delete(param->statsFormat);
+  delete(param->bpClusters);
+  delete(param->fastq);
+  delete(param->fastqCategories);
+  delete(param->fastqLayout);
+  delete(param->fastqCompress);
+  delete(param->mouseWriter);
+  delete(param->ambiguousWriter);
+  delete(param->dupSketch);
+  delete(param->genome);
+  delete(param->sketchMerge);
   delete(param);
 }
@@ -0,0 +1,236 @@
+/*****************************************************************************
+
+  bgzf_reader.h
+  raw BAM record reader (BGZF blocks inflated here, no BamTools decoding)
+
+  records come out as their raw bytes (block_size stripped), raw_core()
+  fills the core fields of a BamAlignment and raw_char() the name, bases,
+  qualities and tags, so a record can be passed through unchanged or with
+  a patched flag. little-endian hosts only (as the rest of the tools).
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef BGZF_READER_H
+#define BGZF_READER_H
+
+#include <api/BamAlignment.h>
+#include <api/BamAux.h>
+#include <zlib.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace BamTools;
+using namespace std;
+
+
+class RawReader {        // a source of raw BAM records (BGZF here, SAM text in sam_reader.h)
+
+ public:
+  virtual ~RawReader() {}
+  virtual bool Next(string &raw) = 0;
+  virtual const string &GetHeaderText() const = 0;
+  virtual const RefVector &GetReferenceData() const = 0;
+
+};
+
+
+class BgzfReader : public RawReader {
+
+ public:
+  BgzfReader() : in_f(NULL), pos(0) {}
+  ~BgzfReader() { Close(); }
+
+  bool Open(const string &filename) {
+    in_f = (filename == "-") ? stdin : fopen(filename.c_str(), "rb");
+    if ( in_f == NULL ) return false;
+    char magic[4];
+    if ( !Read(magic, 4) || memcmp(magic, "BAM\1", 4) != 0 ) return false;
+    int32_t len;
+    if ( !Read(&len, 4) ) return false;
+    header.resize(len);
+    if ( len > 0 && !Read(&header[0], len) ) return false;
+    header = header.c_str();                           // the text may be NUL padded
+    int32_t nref;
+    if ( !Read(&nref, 4) ) return false;
+    for (int32_t i = 0; i < nref; i++) {
+      string name;
+      int32_t reflen;
+      if ( !Read(&len, 4) ) return false;
+      name.resize(len);
+      if ( !Read(&name[0], len) || !Read(&reflen, 4) ) return false;
+      refs.push_back(RefData(name.c_str(), reflen));
+    }
+    return true;
+  }
+
+  void Close() {
+    if ( in_f != NULL && in_f != stdin ) fclose(in_f);
+    in_f = NULL;
+  }
+
+  const string &GetHeaderText() const {
+    return header;
+  }
+
+  const RefVector &GetReferenceData() const {
+    return refs;
+  }
+
+  bool Next(string &raw) {                             // the next record without its block_size
+    int32_t block_size;
+    if ( !Read(&block_size, 4) ) return false;
+    raw.resize(block_size);
+    if ( !Read(&raw[0], block_size) ) {
+      cerr << "bgzf ERROR: truncated bam record" << endl;
+      exit(1);
+    }
+    return true;
+  }
+
+ private:
+  FILE *in_f;
+  string block;                                        // current inflated block
+  size_t pos;
+  string packed;
+  string header;
+  RefVector refs;
+
+  bool Read(void *dest, size_t len) {
+    char *out = (char *)dest;
+    while ( len > 0 ) {
+      if ( pos == block.size() && !load_block() ) return false;
+      size_t take = block.size() - pos;
+      if ( take > len ) take = len;
+      memcpy(out, &block[pos], take);
+      pos += take;
+      out += take;
+      len -= take;
+    }
+    return true;
+  }
+
+  bool load_block() {                                  // false at the end of the stream
+    do {
+      unsigned char head[12];
+      if ( fread(head, 1, 12, in_f) != 12 ) return false;
+      if ( head[0] != 0x1f || head[1] != 0x8b || !(head[3] & 4) ) {
+        cerr << "bgzf ERROR: not a BGZF block" << endl;
+        exit(1);
+      }
+      unsigned short xlen = head[10] | (head[11] << 8);
+      string extra(xlen, '\0');
+      if ( fread(&extra[0], 1, xlen, in_f) != xlen ) return false;
+      size_t bsize = 0;
+      for (size_t i = 0; i + 4 <= extra.size(); ) {   // the BC subfield holds the block size
+        unsigned short slen = (unsigned char)extra[i+2] | ((unsigned char)extra[i+3] << 8);
+        if ( extra[i] == 'B' && extra[i+1] == 'C' && slen == 2 ) {
+          bsize = ((unsigned char)extra[i+4] | ((unsigned char)extra[i+5] << 8)) + 1;
+        }
+        i += 4 + slen;
+      }
+      if ( bsize == 0 ) {
+        cerr << "bgzf ERROR: block size missing" << endl;
+        exit(1);
+      }
+      size_t rest = bsize - 12 - xlen;
+      packed.resize(rest);
+      if ( fread(&packed[0], 1, rest, in_f) != rest ) {
+        cerr << "bgzf ERROR: truncated block" << endl;
+        exit(1);
+      }
+      uint32_t isize;
+      memcpy(&isize, &packed[rest - 4], 4);
+      block.resize(isize);
+      pos = 0;
+      if ( isize == 0 ) continue;                      // empty (EOF marker) block
+      z_stream zs;
+      memset(&zs, 0, sizeof(zs));
+      inflateInit2(&zs, -15);
+      zs.next_in = (Bytef *)packed.data();
+      zs.avail_in = rest - 8;
+      zs.next_out = (Bytef *)&block[0];
+      zs.avail_out = isize;
+      int status = inflate(&zs, Z_FINISH);
+      inflateEnd(&zs);
+      if ( status != Z_STREAM_END ) {
+        cerr << "bgzf ERROR: block inflation failed" << endl;
+        exit(1);
+      }
+    } while ( block.empty() );
+    return true;
+  }
+
+};
+
+
+inline void raw_core(const string &raw, BamAlignment &bam) {
+
+  // core fields of a raw record (same as GetNextAlignmentCore)
+  static const char *cigar_ops = "MIDNSHP=X";
+  const char *p = raw.data();
+  int32_t i32;
+  uint16_t u16;
+  memcpy(&i32, p, 4);      bam.RefID = i32;
+  memcpy(&i32, p + 4, 4);  bam.Position = i32;
+  bam.MapQuality = (unsigned char)p[9];
+  memcpy(&u16, p + 10, 2); bam.Bin = u16;
+  uint16_t ncigar;
+  memcpy(&ncigar, p + 12, 2);
+  memcpy(&u16, p + 14, 2); bam.AlignmentFlag = u16;
+  memcpy(&i32, p + 16, 4); bam.Length = i32;
+  memcpy(&i32, p + 20, 4); bam.MateRefID = i32;
+  memcpy(&i32, p + 24, 4); bam.MatePosition = i32;
+  memcpy(&i32, p + 28, 4); bam.InsertSize = i32;
+  const char *cigar = p + 32 + (unsigned char)p[8];
+  bam.CigarData.clear();
+  for (uint16_t i = 0; i < ncigar; i++) {
+    uint32_t op;
+    memcpy(&op, cigar + 4*i, 4);
+    bam.CigarData.push_back(CigarOp(cigar_ops[(op & 0xf) < 9 ? (op & 0xf) : 0], op >> 4));
+  }
+
+}
+
+
+inline void raw_char(const string &raw, BamAlignment &bam) {
+
+  // name, bases, qualities and tags of a raw record (as BuildCharData, without the padded AlignedBases)
+  static const char *seq_codes = "=ACMGRSVTWYHKDBN";
+  const char *p = raw.data();
+  unsigned int lname = (unsigned char)p[8];
+  uint16_t ncigar;
+  memcpy(&ncigar, p + 12, 2);
+  int32_t lseq;
+  memcpy(&lseq, p + 16, 4);
+  bam.Name.assign(p + 32, lname - 1);
+  const unsigned char *seq = (const unsigned char *)(p + 32 + lname + 4*ncigar);
+  bam.QueryBases.resize(lseq);
+  for (int32_t i = 0; i < lseq; i++) {
+    bam.QueryBases[i] = seq_codes[(i & 1) ? (seq[i >> 1] & 0xf) : (seq[i >> 1] >> 4)];
+  }
+  const unsigned char *qual = seq + (lseq + 1)/2;
+  if ( lseq > 0 && qual[0] == 0xff ) {
+    bam.Qualities = "*";
+  } else {
+    bam.Qualities.resize(lseq);
+    for (int32_t i = 0; i < lseq; i++) bam.Qualities[i] = (char)(qual[i] + 33);
+  }
+  const char *tags = (const char *)(qual + lseq);
+  bam.TagData.assign(tags, p + raw.size() - tags);
+
+}
+
+
+inline void raw_patch_flag(string &raw, uint32_t flag) {   // flag field in place
+  uint16_t u16 = flag;
+  memcpy(&raw[14], &u16, 2);
+}
+
+#endif
@@ -0,0 +1,318 @@
+/*****************************************************************************
+
+  bgzf_writer.h
+  BAM writer with the BGZF blocks deflated on several threads
+  (same Open/SaveAlignment/Close calls as BamTools::BamWriter)
+
+  records are serialized here and cut into 0xff00 byte blocks, the blocks
+  are compressed by a small thread pool and written strictly in order.
+  little-endian hosts only (as the rest of the tools).
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef BGZF_WRITER_H
+#define BGZF_WRITER_H
+
+#include <api/BamAlignment.h>
+#include <api/BamAux.h>
+#include <zlib.h>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+using namespace BamTools;
+using namespace std;
+
+const size_t bgzf_block_data = 0xff00;            // uncompressed bytes per block (as htslib)
+const unsigned char bgzf_eof[28] = {0x1f,0x8b,0x08,0x04,0,0,0,0,0,0xff,0x06,0,0x42,0x43,0x02,0,0x1b,0,0x03,0,0,0,0,0,0,0,0,0};
+
+
+inline void put_int32(string &out, int v) {
+  out.append((const char *)&v, 4);
+}
+
+inline void put_uint16(string &out, unsigned short v) {
+  out.append((const char *)&v, 2);
+}
+
+
+inline bool bgzf_deflate(const string &raw, string &packed, int level) {
+
+  packed.resize(compressBound(raw.size()) + 26);
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if ( deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK ) return false;
+  zs.next_in = (Bytef *)raw.data();
+  zs.avail_in = raw.size();
+  zs.next_out = (Bytef *)&packed[18];
+  zs.avail_out = packed.size() - 26;
+  int status = deflate(&zs, Z_FINISH);
+  deflateEnd(&zs);
+  if ( status != Z_STREAM_END ) return false;
+
+  size_t total = 18 + zs.total_out + 8;
+  if ( total > 65536 ) return false;
+  const unsigned char head[16] = {0x1f,0x8b,0x08,0x04,0,0,0,0,0,0xff,0x06,0,0x42,0x43,0x02,0};
+  memcpy(&packed[0], head, 16);
+  unsigned short bsize = total - 1;
+  memcpy(&packed[16], &bsize, 2);
+  unsigned int crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)raw.data(), raw.size());
+  unsigned int isize = raw.size();
+  memcpy(&packed[18 + zs.total_out], &crc, 4);
+  memcpy(&packed[22 + zs.total_out], &isize, 4);
+  packed.resize(total);
+  return true;
+
+}
+
+
+inline unsigned short reg2bin(int beg, int end) {   // UCSC binning as in the SAM specification
+  --end;
+  if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
+  if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
+  if (beg>>20 == end>>20) return ((1<<9)-1)/7 + (beg>>20);
+  if (beg>>23 == end>>23) return ((1<<6)-1)/7 + (beg>>23);
+  if (beg>>26 == end>>26) return ((1<<3)-1)/7 + (beg>>26);
+  return 0;
+}
+
+
+inline void bam_encode(const BamAlignment &bam, string &out) {
+
+  // one BAM record (block_size included) from a fully decoded alignment
+  static const char *cigar_ops = "MIDNSHP=X";
+  static const char *seq_codes = "=ACMGRSVTWYHKDBN";
+
+  size_t lseq = (bam.QueryBases == "*") ? 0 : bam.QueryBases.size();
+  size_t start = out.size();
+  put_int32(out, 0);                                   // block_size, filled in below
+  put_int32(out, bam.RefID);
+  put_int32(out, bam.Position);
+  out.push_back((char)(bam.Name.size() + 1));
+  out.push_back((char)bam.MapQuality);
+  int end = bam.Position + 1;
+  if ( bam.IsMapped() == true && bam.Position >= 0 ) {
+    int aend = bam.GetEndPosition();
+    if ( aend > bam.Position ) end = aend;
+  }
+  put_uint16(out, (bam.Position < 0) ? 4680 : reg2bin(bam.Position, end));
+  put_uint16(out, bam.CigarData.size());
+  put_uint16(out, bam.AlignmentFlag);
+  put_int32(out, lseq);
+  put_int32(out, bam.MateRefID);
+  put_int32(out, bam.MatePosition);
+  put_int32(out, bam.InsertSize);
+  out.append(bam.Name);
+  out.push_back('\0');
+
+  vector<CigarOp>::const_iterator cigItr = bam.CigarData.begin();
+  for (; cigItr != bam.CigarData.end(); ++cigItr) {
+    const char *op = strchr(cigar_ops, cigItr->Type);
+    put_int32(out, (int)((cigItr->Length << 4) | (op == NULL ? 0 : op - cigar_ops)));
+  }
+
+  for (size_t i = 0; i < lseq; i += 2) {
+    const char *hi = strchr(seq_codes, toupper(bam.QueryBases[i]));
+    unsigned char code = (hi == NULL ? 15 : hi - seq_codes) << 4;
+    if ( i + 1 < lseq ) {
+      const char *lo = strchr(seq_codes, toupper(bam.QueryBases[i+1]));
+      code |= (lo == NULL ? 15 : lo - seq_codes);
+    }
+    out.push_back((char)code);
+  }
+  if ( bam.Qualities.size() == lseq && bam.Qualities != "*" ) {
+    for (size_t i = 0; i < lseq; i++) out.push_back((char)(bam.Qualities[i] - 33));
+  } else {
+    out.append(lseq, (char)0xff);
+  }
+  out.append(bam.TagData);
+
+  int block_size = out.size() - start - 4;
+  memcpy(&out[start], &block_size, 4);
+
+}
+
+
+class BgzfWriter {
+
+ public:
+  BgzfWriter() : out_f(NULL), level(Z_DEFAULT_COMPRESSION), nthreads(1), stopping(false), blocks(0) {}
+  ~BgzfWriter() { Close(); }
+
+  bool Open(const string &filename, int threads) {  // plain BGZF stream (bgzip compatible), "-" is stdout
+    out_f = (filename == "-") ? stdout : fopen(filename.c_str(), "wb");
+    if ( out_f == NULL ) return false;
+    nthreads = (threads > 1) ? threads : 1;
+    stopping = false;
+    blocks = 0;
+    for (int i = 1; i < nthreads; i++) {             // the calling thread takes part when only one is asked
+      workers.push_back(thread(&BgzfWriter::work, this));
+    }
+    return true;
+  }
+
+  bool Open(const string &filename, const string &header, const RefVector &refs, int threads) {
+    if ( !Open(filename, threads) ) return false;
+    string head("BAM\1", 4);
+    put_int32(head, header.size());
+    head.append(header);
+    put_int32(head, refs.size());
+    RefVector::const_iterator rit = refs.begin();
+    for (; rit != refs.end(); ++rit) {
+      put_int32(head, rit->RefName.size() + 1);
+      head.append(rit->RefName);
+      head.push_back('\0');
+      put_int32(head, rit->RefLength);
+    }
+    Write(head.data(), head.size());
+    flush_block();                                   // the header ends a block, as samtools does
+    return true;
+  }
+
+  void SetCompressionLevel(int clevel) {
+    level = clevel;
+  }
+
+  void SaveAlignment(const BamAlignment &bam) {
+    record.clear();
+    bam_encode(bam, record);
+    Write(record.data(), record.size());
+  }
+
+  void SaveRaw(const string &raw) {                  // a raw record as read by BgzfReader
+    int block_size = raw.size();
+    Write((const char *)&block_size, 4);
+    Write(raw.data(), raw.size());
+  }
+
+  void Write(const char *data, size_t len) {
+    while ( len > 0 ) {
+      size_t room = bgzf_block_data - current.size();
+      size_t take = (len < room) ? len : room;
+      current.append(data, take);
+      data += take;
+      len -= take;
+      if ( current.size() == bgzf_block_data ) flush_block();
+    }
+  }
+
+  void Tell(uint64_t &block, size_t &offset) const {   // where the next byte goes: its block (counted from 0) and offset in it
+    block = blocks;
+    offset = current.size();
+  }
+
+  void Close() {
+    if ( out_f == NULL ) return;
+    flush_block();
+    drain(0);
+    {
+      lock_guard<mutex> lock(mtx);
+      stopping = true;
+    }
+    job_cv.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    workers.clear();
+    fwrite(bgzf_eof, 1, sizeof(bgzf_eof), out_f);
+    if ( out_f == stdout ) fflush(out_f);
+    else                   fclose(out_f);
+    out_f = NULL;
+  }
+
+ private:
+  struct block {
+    string raw;
+    string packed;
+    bool done;
+  };
+
+  FILE *out_f;
+  int level;
+  int nthreads;
+  bool stopping;
+  uint64_t blocks;                                   // blocks cut so far
+  string current;                                    // block being filled
+  string record;                                     // serialization buffer
+  deque < std::shared_ptr<block> > pending;               // blocks in output order
+  deque < std::shared_ptr<block> > jobs;                  // blocks waiting for a worker
+  vector <thread> workers;
+  mutex mtx;
+  condition_variable job_cv;
+  condition_variable done_cv;
+
+  void flush_block() {
+    if ( current.empty() ) return;
+    ++blocks;
+    std::shared_ptr<block> blk(new block);
+    blk->raw.swap(current);
+    blk->done = false;
+    if ( nthreads == 1 ) {
+      compress(*blk);
+      fwrite(blk->packed.data(), 1, blk->packed.size(), out_f);
+      return;
+    }
+    {
+      lock_guard<mutex> lock(mtx);
+      pending.push_back(blk);
+      jobs.push_back(blk);
+    }
+    job_cv.notify_one();
+    drain(4 * nthreads);                             // bounded: at most a few blocks per thread in flight
+  }
+
+  void drain(size_t keep) {                          // write finished blocks in order, wait while too many are queued
+    unique_lock<mutex> lock(mtx);
+    while ( !pending.empty() ) {
+      if ( pending.front()->done == false ) {
+        if ( pending.size() <= keep ) break;
+        done_cv.wait(lock);
+        continue;
+      }
+      std::shared_ptr<block> blk = pending.front();
+      pending.pop_front();
+      lock.unlock();
+      fwrite(blk->packed.data(), 1, blk->packed.size(), out_f);
+      lock.lock();
+    }
+  }
+
+  void compress(block &blk) {
+    if ( bgzf_deflate(blk.raw, blk.packed, level) == false ) {
+      cerr << "bgzf ERROR: block compression failed" << endl;
+      exit(1);
+    }
+    string().swap(blk.raw);
+  }
+
+  void work() {
+    while ( true ) {
+      std::shared_ptr<block> blk;
+      {
+        unique_lock<mutex> lock(mtx);
+        while ( jobs.empty() && stopping == false ) job_cv.wait(lock);
+        if ( jobs.empty() ) return;
+        blk = jobs.front();
+        jobs.pop_front();
+      }
+      compress(*blk);
+      {
+        lock_guard<mutex> lock(mtx);
+        blk->done = true;
+      }
+      done_cv.notify_all();
+    }
+  }
+
+};
+
+#endif
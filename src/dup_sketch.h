@@ -0,0 +1,287 @@
+/*****************************************************************************
+
+  dup_sketch.h
+  duplication estimate without marked duplicates (HyperLogLog sketches)
+
+  every primary fragment is reduced to a signature (chromosome, unclipped
+  5' position and strand of both ends, the mate end from its MC tag when
+  present, else its leftmost position) and hashed into a HyperLogLog
+  sketch of its library (LB of the read group, or the read group id).
+  a sketch is 2^14 one-byte registers (16 KB) whatever the input size;
+  the distinct signatures are the unique fragments, the projected
+  library size is Picard's Lander-Waterman estimate from the fragment and
+  unique counts. sketches of several lanes merge by register maximum.
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef DUP_SKETCH_H
+#define DUP_SKETCH_H
+
+#include <api/BamAlignment.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+using namespace BamTools;
+using namespace std;
+
+const unsigned int hll_bits = 14;
+
+
+class HllSketch {
+
+ public:
+  HllSketch() : registers(1 << hll_bits, 0) {}
+
+  void Add(uint64_t hash) {
+    uint32_t r = hash >> (64 - hll_bits);                    // the register from the leading bits
+    uint64_t rest = hash << hll_bits;
+    unsigned char rank = (rest == 0) ? (64 - hll_bits + 1) : __builtin_clzll(rest) + 1;
+    if ( rank > registers[r] ) registers[r] = rank;
+  }
+
+  void Merge(const HllSketch &part) {
+    for (size_t r = 0; r < registers.size(); r++) {
+      if ( part.registers[r] > registers[r] ) registers[r] = part.registers[r];
+    }
+  }
+
+  double Estimate() const {                                  // linear counting while registers are still empty
+    double m = registers.size();
+    double sum = 0;
+    unsigned int zeros = 0;
+    for (size_t r = 0; r < registers.size(); r++) {
+      sum += ldexp(1.0, -registers[r]);
+      if ( registers[r] == 0 ) ++zeros;
+    }
+    double e = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+    if ( e <= 2.5 * m && zeros > 0 ) e = m * log(m / zeros);
+    return e;
+  }
+
+  vector <unsigned char> registers;
+
+};
+
+
+class DupSketches {
+
+  // one sketch and the fragment count per library, in the order the libraries first appear
+
+ public:
+  DupSketches() : last(0) {}
+
+  void SetHeader(const string &header) {                     // read group id -> library (LB)
+    istringstream lines(header);
+    string line;
+    while ( getline(lines, line) ) {
+      if ( line.compare(0, 4, "@RG\t") != 0 ) continue;
+      string id, lb;
+      istringstream fields(line);
+      string field;
+      while ( getline(fields, field, '\t') ) {
+        if ( field.compare(0, 3, "ID:") == 0 ) id = field.substr(3);
+        if ( field.compare(0, 3, "LB:") == 0 ) lb = field.substr(3);
+      }
+      if ( id != "" ) libraries[id] = (lb != "") ? lb : id;
+    }
+  }
+
+  void Configure(const DupSketches &like) {                  // same libraries, no counts (a batch of the pipeline)
+    libraries = like.libraries;
+  }
+
+  void Add(const BamAlignment &bam) {                        // tags decoded (RG, MC)
+
+    // primary mapped records, a pair once (from its leftmost end, the first mate on a tie)
+    if ( bam.IsMapped() == false || bam.IsPrimaryAlignment() == false || (bam.AlignmentFlag & 0x800) || bam.IsFailedQC() ) return;
+    bool pair = ( bam.IsPaired() == true && bam.IsMateMapped() == true );
+    if ( pair == true ) {
+      if ( bam.MateRefID < bam.RefID || (bam.MateRefID == bam.RefID && bam.MatePosition < bam.Position) ) return;
+      if ( bam.MateRefID == bam.RefID && bam.MatePosition == bam.Position && bam.IsFirstMate() == false ) return;
+    }
+
+    uint64_t sig = mix(((uint64_t)(uint32_t)(bam.RefID + 1) << 33) | ((uint64_t)(uint32_t)FivePrime(bam.Position, bam.CigarData, bam.IsReverseStrand()) << 1) | bam.IsReverseStrand());
+    if ( pair == true ) {
+      string mc;
+      int mate5 = bam.MatePosition;
+      if ( bam.GetTag("MC", mc) ) {
+        vector <CigarOp> cigar;
+        CigarText(mc, cigar);
+        mate5 = FivePrime(bam.MatePosition, cigar, bam.IsMateReverseStrand());
+      }
+      sig = mix(sig ^ (((uint64_t)(uint32_t)(bam.MateRefID + 1) << 33) | ((uint64_t)(uint32_t)mate5 << 1) | bam.IsMateReverseStrand()));
+    }
+
+    string rg;
+    string lib = "all";
+    if ( !libraries.empty() && bam.GetTag("RG", rg) ) {
+      map <string, string>::const_iterator it = libraries.find(rg);
+      lib = (it != libraries.end()) ? it->second : rg;
+    }
+    unsigned int l = Find(lib);
+    sketches[l].Add(sig);
+    ++fragments[l];
+
+  }
+
+  void Merge(const DupSketches &part) {
+    for (size_t l = 0; l < part.names.size(); l++) {
+      unsigned int g = Find(part.names[l]);
+      sketches[g].Merge(part.sketches[l]);
+      fragments[g] += part.fragments[l];
+    }
+  }
+
+  bool Save(const string &file) const {                      // one line per library: name, fragments, bits, hex registers
+    ofstream out_f(file.c_str());
+    if ( !out_f.is_open() ) return false;
+    static const char *hex = "0123456789abcdef";
+    for (size_t l = 0; l < names.size(); l++) {
+      string regs;
+      regs.reserve(2 * sketches[l].registers.size());
+      for (size_t r = 0; r < sketches[l].registers.size(); r++) {
+        regs += hex[sketches[l].registers[r] >> 4];
+        regs += hex[sketches[l].registers[r] & 0xf];
+      }
+      out_f << names[l] << "\t" << fragments[l] << "\t" << hll_bits << "\t" << regs << "\n";
+    }
+    out_f.close();
+    return !out_f.fail();
+  }
+
+  bool Load(const string &file) {                            // merged into what is there
+    ifstream in_f(file.c_str());
+    if ( !in_f.is_open() ) return false;
+    string name, regs;
+    unsigned long long count;
+    unsigned int bits;
+    while ( in_f >> name >> count >> bits >> regs ) {
+      if ( bits != hll_bits || regs.size() != 2 * ((size_t)1 << hll_bits) ) {
+        cerr << "sketch ERROR: " << file << " was written with other sketch parameters" << endl;
+        exit(1);
+      }
+      HllSketch part;
+      for (size_t r = 0; r < part.registers.size(); r++) part.registers[r] = strtoul(regs.substr(2*r, 2).c_str(), NULL, 16);
+      unsigned int l = Find(name);
+      sketches[l].Merge(part);
+      fragments[l] += count;
+    }
+    return true;
+  }
+
+  void Report(ostream &out) const {
+    out << "library\tfragments\tuniqueEst\tduplicationRate\tprojectedSize" << endl;
+    for (size_t l = 0; l <= names.size(); l++) {
+      unsigned long long n = 0;
+      double unique = 0;
+      if ( l < names.size() ) {
+        n = fragments[l];
+        unique = sketches[l].Estimate();
+      } else {                                               // all libraries together
+        HllSketch all;
+        for (size_t g = 0; g < names.size(); g++) {
+          all.Merge(sketches[g]);
+          n += fragments[g];
+        }
+        unique = all.Estimate();
+      }
+      if ( unique > n ) unique = n;
+      double size = LibrarySize(n, unique);
+      out << ((l < names.size()) ? names[l] : "total") << "\t" << n << "\t" << (unsigned long long)(unique + 0.5) << "\t"
+          << fixed << setprecision(4) << ((n > 0) ? 1 - unique / n : 0) << "\t";
+      if ( size > 0 ) out << (unsigned long long)(size + 0.5) << endl;
+      else            out << "NA" << endl;
+      out.unsetf(ios::floatfield);
+    }
+  }
+
+  static double LibrarySize(double n, double c) {           // Picard's estimateLibrarySize: c/x - 1 + exp(-n/x) = 0
+    if ( c <= 0 || c >= n || f(c, c, n) < 0 ) return 0;
+    double m = 1.0, M = 100.0;
+    while ( f(M * c, c, n) > 0 ) M *= 10.0;
+    for (int i = 0; i < 40; i++) {
+      double r = (m + M) / 2.0;
+      double u = f(r * c, c, n);
+      if ( u == 0 ) break;
+      else if ( u > 0 ) m = r;
+      else              M = r;
+    }
+    return c * (m + M) / 2.0;
+  }
+
+  static int FivePrime(int position, const vector <CigarOp> &cigar, bool reverse) {   // unclipped 5' end, 0-based
+    if ( cigar.empty() ) return position;
+    if ( reverse == false ) {
+      int clip = 0;
+      for (size_t i = 0; i < cigar.size() && (cigar[i].Type == 'S' || cigar[i].Type == 'H'); i++) clip += cigar[i].Length;
+      return position - clip;
+    }
+    int end = position - 1;
+    for (size_t i = 0; i < cigar.size(); i++) {
+      char t = cigar[i].Type;
+      if ( t == 'M' || t == 'D' || t == 'N' || t == '=' || t == 'X' ) end += cigar[i].Length;
+    }
+    for (size_t i = cigar.size(); i > 0 && (cigar[i-1].Type == 'S' || cigar[i-1].Type == 'H'); i--) end += cigar[i-1].Length;
+    return end;
+  }
+
+  static void CigarText(const string &text, vector <CigarOp> &cigar) {
+    char *p = (char *)text.c_str();
+    while ( *p != '\0' ) {
+      unsigned int len = strtoul(p, &p, 10);
+      if ( *p == '\0' ) break;
+      cigar.push_back(CigarOp(*p, len));
+      ++p;
+    }
+  }
+
+  vector <string> names;
+
+ private:
+  map <string, string> libraries;
+  map <string, unsigned int> index;
+  vector <HllSketch> sketches;
+  vector <unsigned long long> fragments;
+  unsigned int last;
+
+  unsigned int Find(const string &name) {
+    if ( !names.empty() && names[last] == name ) return last;
+    map <string, unsigned int>::iterator it = index.find(name);
+    if ( it == index.end() ) {
+      it = index.insert( pair <string, unsigned int> (name, names.size()) ).first;
+      names.push_back(name);
+      sketches.push_back(HllSketch());
+      fragments.push_back(0);
+    }
+    last = it->second;
+    return last;
+  }
+
+  static double f(double x, double c, double n) {
+    return c / x - 1 + exp(-n / x);
+  }
+
+  static uint64_t mix(uint64_t x) {                          // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+};
+
+#endif
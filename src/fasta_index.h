@@ -0,0 +1,170 @@
+/*****************************************************************************
+
+  fasta_index.h
+  random access to a reference FASTA through its samtools .fai index
+
+  the FASTA is mapped into memory (nothing is loaded up front), a window is
+  cut by computing the byte offset of its first base from the .fai line
+  geometry, so only the pages around the requested windows are ever read.
+  without a .fai next to the FASTA the index is built by one scan of the map.
+  chromosome names are looked up with a leading "chr" stripped (as the
+  variant tables and the old perl loader do).
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef FASTA_INDEX_H
+#define FASTA_INDEX_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+
+class FastaIndex {
+
+ public:
+  FastaIndex() : data(NULL), size(0), fd(-1) {}
+  ~FastaIndex() { Close(); }
+
+  bool Open(const string &fasta) {
+    fd = open(fasta.c_str(), O_RDONLY);
+    if ( fd < 0 ) return false;
+    struct stat st;
+    if ( fstat(fd, &st) != 0 || st.st_size == 0 ) return false;
+    size = st.st_size;
+    void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( m == MAP_FAILED ) {
+      data = NULL;
+      return false;
+    }
+    data = (const char *)m;
+    madvise(m, size, MADV_RANDOM);                     // a few thousand small windows, no read ahead
+    if ( load_fai(fasta + ".fai") ) return true;
+    cerr << "fasta: no " << fasta << ".fai, indexing the fasta" << endl;
+    return build_fai();
+  }
+
+  void Close() {
+    if ( data != NULL ) munmap((void *)data, size);
+    if ( fd >= 0 ) close(fd);
+    data = NULL;
+    fd = -1;
+  }
+
+  bool Fetch(const string &chr, long start, long len, string &seq) {   // 0-based window, clipped to the chromosome, upper case
+    seq.clear();
+    unordered_map <string, entry>::const_iterator it = index.find(strip_chr(chr));
+    if ( it == index.end() ) return false;
+    const entry &e = it->second;
+    if ( start < 0 ) {
+      len += start;
+      start = 0;
+    }
+    if ( start + len > e.length ) len = e.length - start;
+    if ( len <= 0 ) return true;
+    seq.reserve(len);
+    long line = start / e.linebases;
+    long col = start % e.linebases;
+    while ( (long)seq.size() < len ) {
+      size_t at = e.offset + line * e.linewidth + col;
+      long take = e.linebases - col;
+      if ( take > len - (long)seq.size() ) take = len - seq.size();
+      if ( at + take > size ) break;
+      for (long i = 0; i < take; i++) seq.push_back(toupper(data[at + i]));
+      ++line;
+      col = 0;
+    }
+    return true;
+  }
+
+  void Sequential() {                                  // whole chromosomes are read (index building)
+    if ( data != NULL ) madvise((void *)data, size, MADV_SEQUENTIAL);
+  }
+
+  long Length(const string &chr) const {               // 0 when not in the index
+    unordered_map <string, entry>::const_iterator it = index.find(strip_chr(chr));
+    return (it == index.end()) ? 0 : it->second.length;
+  }
+
+  void Chromosomes(vector <string> &names) const {     // stripped names, in no particular order
+    unordered_map <string, entry>::const_iterator it = index.begin();
+    for (; it != index.end(); ++it) names.push_back(it->first);
+  }
+
+ private:
+  struct entry {
+    long length;
+    size_t offset;
+    long linebases;
+    long linewidth;
+  };
+
+  const char *data;
+  size_t size;
+  int fd;
+  unordered_map <string, entry> index;
+
+  static string strip_chr(const string &name) {
+    return (name.compare(0, 3, "chr") == 0) ? name.substr(3) : name;
+  }
+
+  bool load_fai(const string &fai) {
+    ifstream fai_f(fai.c_str());
+    if ( !fai_f.is_open() ) return false;
+    string name;
+    entry e;
+    while ( fai_f >> name >> e.length >> e.offset >> e.linebases >> e.linewidth ) {
+      index[strip_chr(name)] = e;
+    }
+    return !index.empty();
+  }
+
+  bool build_fai() {                                   // same numbers samtools faidx writes
+    size_t p = 0;
+    string name;
+    entry e = {0, 0, 0, 0};
+    while ( p < size ) {
+      const char *nl = (const char *)memchr(data + p, '\n', size - p);
+      size_t end = (nl == NULL) ? size : nl - data;
+      if ( data[p] == '>' ) {
+        if ( name != "" ) index[strip_chr(name)] = e;
+        size_t q = p + 1;
+        while ( q < end && !isspace(data[q]) ) ++q;
+        name.assign(data + p + 1, q - p - 1);
+        e.length = 0;
+        e.offset = end + 1;
+        e.linebases = 0;
+        e.linewidth = 0;
+      } else if ( name != "" ) {
+        long bases = end - p;
+        if ( bases > 0 && data[end - 1] == '\r' ) --bases;
+        if ( e.linebases == 0 ) {
+          e.linebases = bases;
+          e.linewidth = end + 1 - p;
+        }
+        e.length += bases;
+      }
+      p = end + 1;
+    }
+    if ( name != "" ) index[strip_chr(name)] = e;
+    return !index.empty();
+  }
+
+};
+
+#endif
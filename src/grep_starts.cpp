@@ -23,10 +23,18 @@ using namespace BamTools;
 #include <vector>
 #include <deque>
 #include <set>
+#include <map>
 #include <string>
 #include <cstring>
 #include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "grep_starts.h"
+#include "line_writer.h"
 using namespace std;
 
 struct region {  // a bed file containing gene annotations
@@ -46,10 +54,43 @@ struct region {  // a bed file containing gene annotations
   // results storing here
   unsigned int tags;  // storing position and count of tags relative to a gene
   unsigned int starts;
+  vector <unsigned int> sampleStarts;  // starts per sample column (matrix mode)
 };
 
 
 unsigned int read_length = 0;
+const unsigned int max_insert = 1000;            // same cut as the samtools | awk insert size pipeline
+map <string, vector <unsigned long> > insert_hist; // proper pair TLEN histogram per read group
+unsigned int matrix_cols = 0;                    // number of sample columns (matrix mode)
+
+// library complexity: reads sharing a (chrom, start, strand, mate-start) signature are
+// contiguous in a coordinate sorted bam, so only the signatures of the current start are kept
+map <unsigned long long, unsigned int> sig_counts;   // signature (strand, mate) -> reads at the current start
+int sig_ref = -1;
+int sig_pos = -1;
+map <unsigned int, unsigned long> count_of_counts;   // times a signature is seen -> number of signatures
+
+struct wigchrom {   // one chromosome of a fixedStep wiggle track
+  unsigned int start;
+  unsigned int step;
+  vector <float> values;
+};
+
+struct cbin {       // a counted region bin kept for gc and mappability correction
+  unsigned int chrid;
+  unsigned int start;
+  unsigned int end;
+  unsigned int reads;
+  float gc;
+  float mappability;
+};
+
+map <string, struct wigchrom> gc_track;
+map <string, struct wigchrom> map_track;
+bool correct_bins = false;
+vector <struct cbin> cbins;
+vector <string> cbin_chrs;
+LineWriter region_out;                           // the region counts (stdout)
 
 inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, vector<int> &blockEnds, unsigned int &alignmentEnd);
 inline void splitstring(const string &str, vector<string> &elements, const string &delimiter);
@@ -57,6 +98,20 @@ inline void eatline(const string &str, deque <struct region> &region_ref, bool &
 inline string int2str(unsigned int &i);
 inline string float2str(float &f);
 inline void gene_processing(struct region &gene);
+inline void insert_processing(const string &insert_file);
+inline void complexity_flush();
+inline void complexity_processing(const string &complexity_file);
+inline double library_size(double reads, double distinct);
+inline string chr_key(const string &chr);
+inline void load_wig(const char *wig_file, map <string, struct wigchrom> &track);
+inline float wig_value(map <string, struct wigchrom> &track, const string &chr, unsigned int start);
+inline double quantile(vector <double> values, double prob);
+inline void local_linear(const vector <double> &x, const vector <double> &y, double span, vector <double> &fit);
+inline double interpolate(const vector <double> &x, const vector <double> &fit, double xo);
+inline void correction_processing(const string &corrected_file);
+inline bool sample_region(unsigned long index, unsigned int seed, float fraction);
+inline void ratio_estimate(const vector <double> &num, const vector <double> &den, double f, double &est, double &half);
+inline void sample_processing(ifstream &region_f, BamMultiReader &reader, struct parameters *param, bool &withChr);
 
 int main ( int argc, char *argv[] ) { 
 
@@ -135,6 +190,47 @@ int main ( int argc, char *argv[] ) {
   if ( ! reader.LocateIndexes() )     // opens any existing index files that match our BAM files
     reader.CreateIndexes();         // creates index files for BAM files that still lack one
 
+  // matrix mode: one column per input file or per read group of the merged header
+  string matrix = param->matrix;
+  map <string, unsigned int> matrix_index;
+  vector <string> matrix_names;
+  if ( matrix == "file" ) {
+    for (fit = fnames.begin(); fit != fnames.end(); fit++) {
+      string sample = (*fit).substr((*fit).find_last_of('/') + 1);
+      if ( sample.size() > 4 && sample.substr(sample.size() - 4) == ".bam" ) {
+        sample = sample.substr(0, sample.size() - 4);
+      }
+      matrix_index.insert( pair <string, unsigned int> (*fit, matrix_names.size()) );
+      matrix_names.push_back(sample);
+    }
+  } else if ( matrix == "rg" ) {
+    SamHeader samheader = reader.GetHeader();
+    SamReadGroupDictionary::ConstIterator rgit = samheader.ReadGroups.ConstBegin();
+    for (; rgit != samheader.ReadGroups.ConstEnd(); rgit++) {
+      matrix_index.insert( pair <string, unsigned int> (rgit->ID, matrix_names.size()) );
+      matrix_names.push_back(rgit->ID);
+    }
+    if ( matrix_names.empty() ) {
+      cerr << "matrix mode ERROR: no read groups in the bam header" << endl;
+      exit(1);
+    }
+  } else if ( matrix != "" ) {
+    cerr << "matrix mode ERROR: --matrix should be file or rg" << endl;
+    exit(1);
+  }
+  matrix_cols = matrix_names.size();
+  unsigned long matrix_skipped = 0;           // reads whose sample column is not known
+
+  region_out.OpenStdout();
+  if ( matrix_cols > 0 ) {
+    region_out << "#chr\tstart\tend\ttags\tstarts";
+    vector <string>::iterator mit = matrix_names.begin();
+    for (; mit != matrix_names.end(); mit++) {
+      region_out << "\t" << *mit;
+    }
+    region_out << '\n';
+  }
+
 
   //should decide which chromosome
   string line;
@@ -144,6 +240,31 @@ int main ( int argc, char *argv[] ) {
   if (param->chr == 1){
     startwithChr = true;
   }
+  string insert = param->insert;
+  string complexity = param->complexity;
+  string corrected = param->corrected;
+  if ( corrected != "" ) {                       // gc and mappability tracks are loaded once for all bins
+    string gcWig = param->gcWig;
+    string mapWig = param->mapWig;
+    if ( gcWig == "" || mapWig == "" ) {
+      cerr << "correction ERROR: --corrected needs both --gcWig and --mapWig" << endl;
+      exit(1);
+    }
+    load_wig(param->gcWig, gc_track);
+    load_wig(param->mapWig, map_track);
+    correct_bins = true;
+  }
+
+  if ( param->sampleFraction > 0 ) {             // fast estimate from a sample of regions, no region counts
+    if ( param->sampleFraction > 1 ) {
+      cerr << "sampling ERROR: --sample-fraction should be within (0,1]" << endl;
+      exit(1);
+    }
+    sample_processing(region_f, reader, param, startwithChr);
+    reader.Close();
+    region_f.close();
+    return 0;
+  }
 
   //regions for the input of region file
   deque <struct region> regions;
@@ -196,8 +317,36 @@ int main ( int argc, char *argv[] ) {
     while (reader.GetNextAlignment(bam)) {
 
       if ( bam.IsMapped() == false ) continue;              // skip unaligned reads
+
+      if ( complexity != "" && bam.IsPrimaryAlignment() == true && (bam.IsPaired() == false || bam.IsFirstMate() == true) ) {
+        if ( bam.Position != sig_pos || bam.RefID != sig_ref ) {   // a new start, the old signatures are complete
+          complexity_flush();
+          sig_ref = bam.RefID;
+          sig_pos = bam.Position;
+        }
+        unsigned long long signature = 0;                           // one read per fragment, duplicates included
+        if ( bam.IsPaired() == true && bam.IsMateMapped() == true ) {
+          signature = ((unsigned long long)(bam.MateRefID + 1) << 33) | ((unsigned long long)(bam.MatePosition + 1) << 1);
+        }
+        if ( bam.IsReverseStrand() ) signature |= 1;
+        sig_counts[signature] += 1;
+      }
       if ( bam.IsDuplicate() == true ) continue;            // skip PCR duplicates
 
+      if ( insert != "" && bam.IsProperPair() == true ) {   // insert size of proper pairs, counted once per pair (TLEN > 0)
+        if ( bam.InsertSize > 0 && (unsigned int)bam.InsertSize < max_insert ) {
+          string rg = "all";
+          if ( param->insertRG == 1 && bam.GetTag("RG", rg) == false ) {
+            rg = "none";
+          }
+          map <string, vector <unsigned long> >::iterator hit = insert_hist.find(rg);
+          if ( hit == insert_hist.end() ) {
+            hit = insert_hist.insert( pair <string, vector <unsigned long> > (rg, vector <unsigned long> (max_insert, 0)) ).first;
+          }
+          (hit->second)[bam.InsertSize] += 1;
+        }
+      }
+
       unsigned int unique = 0;
       //if ( bam.HasTag("NH") ) {
       // bam.GetTag("NH", unique);                   // uniqueness
@@ -225,6 +374,22 @@ int main ( int argc, char *argv[] ) {
         read_length = bam.Length;
       }
 
+      int col = -1;                                    // sample column in matrix mode
+      if ( matrix_cols > 0 ) {
+        map <string, unsigned int>::iterator mcit = matrix_index.end();
+        if ( matrix == "file" ) {
+          mcit = matrix_index.find(bam.Filename);
+        } else {
+          string rg;
+          if ( bam.GetTag("RG", rg) ) mcit = matrix_index.find(rg);
+        }
+        if ( mcit != matrix_index.end() ) {
+          col = mcit->second;
+        } else {
+          matrix_skipped += 1;
+        }
+      }
+
       string chrom = refs.at(bam.RefID).RefName;
       string strand = "+";
       if (bam.IsReverseStrand()) strand = "-";
@@ -269,6 +434,7 @@ int main ( int argc, char *argv[] ) {
 
            if (alignmentStart >= iter->start && alignmentStart <= iter->end) {
              iter->starts += 1;
+             if (col >= 0) (iter->sampleStarts)[col] += 1;
            }
 
         }  // overlapping take action!
@@ -305,6 +471,10 @@ int main ( int argc, char *argv[] ) {
       getline(region_f, line);
       if ( region_f.eof() ){
         cerr << "finished: end of region file, zone 5" << endl;
+        if (matrix_skipped > 0) cerr << "matrix mode: " << matrix_skipped << " reads without a known sample column" << endl;
+        insert_processing(insert);
+        complexity_processing(complexity);
+        correction_processing(corrected);
         exit(0);
       }
       eatline(line, regions, startwithChr);
@@ -321,24 +491,22 @@ int main ( int argc, char *argv[] ) {
   regions.clear();
   reader.Close();
   region_f.close();
+  if (matrix_skipped > 0) cerr << "matrix mode: " << matrix_skipped << " reads without a known sample column" << endl;
+  insert_processing(insert);
+  complexity_processing(complexity);
+  correction_processing(corrected);
   return 0;
 
 } //main
 
 
 inline string int2str(unsigned int &i){
-  string s;
-  stringstream ss(s);
-  ss << i;
-  return ss.str();
+  return uint_text(i);
 }
 
 
 inline string float2str(float &f){
-  string s;
-  stringstream ss(s);
-  ss << f;
-  return ss.str();
+  return float_text(f);
 }
 
 
@@ -366,6 +534,7 @@ inline void eatline(const string &str, deque <struct region> &region_ref, bool &
    struct region tmp;
    tmp.tags = 0;
    tmp.starts = 0;
+   tmp.sampleStarts.assign(matrix_cols, 0);
  
    for(i = 1; iter != line_content.end(); iter++, i++){
      switch (i) {
@@ -470,8 +639,490 @@ inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, v
 
 inline void gene_processing(struct region &gene) {
 
-  cout << gene.chro << "\t" << gene.start << "\t" << gene.end << "\t" << gene.tags << "\t" << gene.starts << endl;
+  region_out << gene.chro << "\t" << gene.start << "\t" << gene.end << "\t" << gene.tags << "\t" << gene.starts;
+  vector <unsigned int>::iterator sit = gene.sampleStarts.begin();
+  for (; sit != gene.sampleStarts.end(); sit++) {
+    region_out << "\t" << *sit;
+  }
+  region_out << '\n';
+
+  if ( correct_bins == true ) {
+    if ( cbin_chrs.empty() || cbin_chrs.back() != gene.chro ) {
+      cbin_chrs.push_back(gene.chro);
+    }
+    struct cbin tmp = {(unsigned int)(cbin_chrs.size() - 1), gene.start, gene.end, gene.starts,
+                       wig_value(gc_track, gene.chro, gene.start), wig_value(map_track, gene.chro, gene.start)};
+    cbins.push_back(tmp);
+  }
 
 }
 
 
+
+
+inline void insert_processing(const string &insert_file) {
+
+  if ( insert_file == "" ) return;
+
+  LineWriter insert_f;
+  insert_f.Open(insert_file);
+  insert_f << "readgroup\tinsertSize\tcount\n";
+
+  map <string, vector <unsigned long> >::iterator hit = insert_hist.begin();
+  for (; hit != insert_hist.end(); hit++) {
+    for (unsigned int ins = 1; ins < max_insert; ins++) {
+      if ( (hit->second)[ins] > 0 ) {
+        insert_f << hit->first << "\t" << ins << "\t" << (hit->second)[ins] << "\n";
+      }
+    }
+  }
+  insert_f.Close();
+
+}
+
+
+inline void complexity_flush() {
+
+  map <unsigned long long, unsigned int>::iterator sit = sig_counts.begin();
+  for (; sit != sig_counts.end(); sit++) {
+    count_of_counts[sit->second] += 1;
+  }
+  sig_counts.clear();
+
+}
+
+
+inline double library_size(double reads, double distinct) {  // Lander-Waterman: distinct/X = 1 - exp(-reads/X)
+
+  if ( distinct <= 0 || reads <= distinct ) return 0;         // not estimable (no duplicates)
+
+  double m = 1.0;
+  double M = 100.0;
+  while ( distinct/(M*distinct) - 1 + exp(-reads/(M*distinct)) > 0 ) {
+    M *= 10.0;
+  }
+  for (unsigned int i = 0; i < 40; i++) {                      // bisection on X = r*distinct
+    double r = (m + M)/2.0;
+    double u = distinct/(r*distinct) - 1 + exp(-reads/(r*distinct));
+    if (u == 0) break;
+    else if (u > 0) m = r;
+    else M = r;
+  }
+  return distinct*(m + M)/2.0;
+
+}
+
+
+inline void complexity_processing(const string &complexity_file) {
+
+  if ( complexity_file == "" ) return;
+  complexity_flush();
+
+  double reads = 0;
+  double distinct = 0;
+  string hist_file = complexity_file + ".hist";
+  LineWriter hist_f;
+  hist_f.Open(hist_file);
+  map <unsigned int, unsigned long>::iterator cit = count_of_counts.begin();
+  for (; cit != count_of_counts.end(); cit++) {
+    hist_f << cit->first << "\t" << cit->second << "\n";
+    reads += (double)(cit->first) * (double)(cit->second);
+    distinct += (double)(cit->second);
+  }
+  hist_f.Close();
+
+  double libsize = library_size(reads, distinct);
+
+  LineWriter complexity_f;
+  complexity_f.Open(complexity_file);
+  complexity_f << "#reads: " << (unsigned long)reads << "\tdistinct: " << (unsigned long)distinct << "\testimatedLibrarySize: " << (unsigned long)libsize << "\n";
+  complexity_f << "fraction\treads\tdistinct\n";
+  for (unsigned int i = 1; i <= 10; i++) {              // subsampling: expected distinct signatures at fraction t
+    double t = (double)i/10.0;
+    double expected = 0;
+    for (cit = count_of_counts.begin(); cit != count_of_counts.end(); cit++) {
+      expected += (double)(cit->second) * (1.0 - pow(1.0 - t, (double)(cit->first)));
+    }
+    complexity_f << t << "\t" << (unsigned long)(t*reads) << "\t" << (unsigned long)(expected + 0.5) << "\n";
+  }
+  if ( libsize > 0 ) {                                    // deeper sequencing: Lander-Waterman extrapolation
+    for (unsigned int i = 2; i <= 20; i++) {
+      double t = (double)i/2.0;
+      if ( t <= 1.0 ) continue;
+      double expected = libsize * (1.0 - exp(-t*reads/libsize));
+      complexity_f << t << "\t" << (unsigned long)(t*reads) << "\t" << (unsigned long)(expected + 0.5) << "\n";
+    }
+  }
+  complexity_f.Close();
+
+}
+
+
+inline string chr_key(const string &chr) {   // wig tracks and region files may differ in the chr prefix
+  if ( chr.size() > 3 && (chr.substr(0,3) == "chr" || chr.substr(0,3) == "Chr" || chr.substr(0,3) == "CHR") ) {
+    return chr.substr(3);
+  }
+  return chr;
+}
+
+
+inline void load_wig(const char *wig_file, map <string, struct wigchrom> &track) {
+
+  int fd = open(wig_file, O_RDONLY);
+  if ( fd < 0 ) {
+    cerr << "correction ERROR: could not open wig file " << wig_file << endl;
+    exit(1);
+  }
+  struct stat sb;
+  if ( fstat(fd, &sb) != 0 || sb.st_size == 0 ) {
+    close(fd);
+    cerr << "correction ERROR: empty wig file " << wig_file << endl;
+    exit(1);
+  }
+  char *data = (char *)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if ( data == MAP_FAILED ) {
+    close(fd);
+    cerr << "correction ERROR: could not map wig file " << wig_file << endl;
+    exit(1);
+  }
+  madvise(data, sb.st_size, MADV_SEQUENTIAL);
+
+  const char *p = data;
+  const char *end = data + sb.st_size;
+  struct wigchrom *cur = NULL;
+  char value[64];
+  while ( p < end ) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if ( eol == NULL ) eol = end;
+    if ( *p == 'f' ) {                                   // fixedStep chrom=1 start=1 step=1000 span=1000
+      string header(p, eol - p);
+      vector <string> fields;
+      splitstring(header, fields, " \t\r");
+      string chrom;
+      unsigned int start = 1;
+      unsigned int step = 1;
+      vector <string>::iterator fiter = fields.begin();
+      for (; fiter != fields.end(); fiter++) {
+        if ( (*fiter).substr(0,6) == "chrom=" ) chrom = (*fiter).substr(6);
+        else if ( (*fiter).substr(0,6) == "start=" ) start = atoi((*fiter).substr(6).c_str());
+        else if ( (*fiter).substr(0,5) == "step=" ) step = atoi((*fiter).substr(5).c_str());
+      }
+      cur = &track[chr_key(chrom)];
+      cur->start = start;
+      cur->step = step;
+      cur->values.clear();
+    } else if ( *p == 'v' ) {
+      cerr << "correction ERROR: variableStep wig is not supported " << wig_file << endl;
+      exit(1);
+    } else if ( cur != NULL && eol > p && *p != '#' && *p != 't' ) {
+      size_t len = eol - p;
+      if ( len > sizeof(value) - 1 ) len = sizeof(value) - 1;
+      memcpy(value, p, len);
+      value[len] = '\0';
+      cur->values.push_back(strtof(value, NULL));
+    }
+    p = eol + 1;
+  }
+
+  munmap(data, sb.st_size);
+  close(fd);
+  cerr << "wig track loaded: " << wig_file << " (" << track.size() << " chromosomes)" << endl;
+
+}
+
+
+inline float wig_value(map <string, struct wigchrom> &track, const string &chr, unsigned int start) {
+
+  map <string, struct wigchrom>::iterator wit = track.find(chr_key(chr));
+  if ( wit == track.end() || start < (wit->second).start ) return -1;
+  unsigned int idx = (start - (wit->second).start) / (wit->second).step;
+  if ( idx >= (wit->second).values.size() ) return -1;
+  return (wit->second).values[idx];
+
+}
+
+
+inline double quantile(vector <double> values, double prob) {   // R quantile type 7
+
+  if ( values.empty() ) return 0;
+  sort(values.begin(), values.end());
+  double h = (values.size() - 1) * prob;
+  size_t lo = (size_t)floor(h);
+  size_t hi = (size_t)ceil(h);
+  return values[lo] + (h - lo) * (values[hi] - values[lo]);
+
+}
+
+
+inline void local_linear(const vector <double> &x, const vector <double> &y, double span, vector <double> &fit) {
+
+  // loess (degree 1, tricube weights) evaluated at the points themselves
+  size_t n = x.size();
+  fit.assign(n, 0);
+  size_t q = (size_t)ceil(span * n);
+  if ( q < 2 ) q = 2;
+  if ( q > n ) q = n;
+  vector <double> dist(n);
+
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < n; j++) dist[j] = fabs(x[j] - x[i]);
+    vector <double> sorted(dist);
+    nth_element(sorted.begin(), sorted.begin() + (q - 1), sorted.end());
+    double h = sorted[q - 1];
+    double sw = 0, swx = 0, swy = 0, swxx = 0, swxy = 0;
+    for (size_t j = 0; j < n; j++) {
+      double w;
+      if ( h <= 0 ) w = (dist[j] == 0) ? 1 : 0;
+      else if ( dist[j] >= h ) w = 0;
+      else { double u = dist[j]/h; w = pow(1 - u*u*u, 3); }
+      sw += w; swx += w*x[j]; swy += w*y[j]; swxx += w*x[j]*x[j]; swxy += w*x[j]*y[j];
+    }
+    double denom = sw*swxx - swx*swx;
+    if ( fabs(denom) < 1e-12 ) {
+      fit[i] = swy/sw;
+    } else {
+      double b = (sw*swxy - swx*swy)/denom;
+      fit[i] = (swy - b*swx)/sw + b*x[i];
+    }
+  }
+
+}
+
+
+inline double interpolate(const vector <double> &x, const vector <double> &fit, double xo) {
+
+  if ( x.empty() || xo < x.front() || xo > x.back() ) return NAN;
+  size_t k = lower_bound(x.begin(), x.end(), xo) - x.begin();
+  if ( x[k] == xo || k == 0 ) return fit[k];
+  return fit[k-1] + (fit[k] - fit[k-1]) * (xo - x[k-1]) / (x[k] - x[k-1]);
+
+}
+
+
+inline void correction_processing(const string &corrected_file) {
+
+  // HMMcopy correctReadcount with binned medians in place of the loess/lowess fits on single bins
+  if ( corrected_file == "" ) return;
+
+  size_t n = cbins.size();
+  vector <bool> valid(n, false);
+  vector <double> vreads;
+  vector <double> vgc;
+  for (size_t i = 0; i < n; i++) {
+    if ( cbins[i].reads > 0 && cbins[i].gc >= 0 && cbins[i].mappability >= 0 ) {
+      valid[i] = true;
+      vreads.push_back(cbins[i].reads);
+      vgc.push_back(cbins[i].gc);
+    }
+  }
+  double rlow = quantile(vreads, 0.01);
+  double rhigh = quantile(vreads, 0.99);
+  double glow = quantile(vgc, 0.001);
+  double ghigh = quantile(vgc, 0.999);
+
+  vector < vector <double> > gcreads(1001);          // ideal bins by gc (0.001 steps)
+  for (size_t i = 0; i < n; i++) {
+    if ( valid[i] && cbins[i].mappability > 0.9 && cbins[i].reads >= rlow && cbins[i].reads <= rhigh
+         && cbins[i].gc >= glow && cbins[i].gc <= ghigh ) {
+      gcreads[(int)(cbins[i].gc * 1000 + 0.5)].push_back(cbins[i].reads);
+    }
+  }
+  vector <double> gx;
+  vector <double> gy;
+  for (size_t b = 0; b < gcreads.size(); b++) {
+    if ( gcreads[b].empty() ) continue;
+    gx.push_back(b/1000.0);
+    gy.push_back(quantile(gcreads[b], 0.5));
+  }
+  vector <double> gfit;
+  local_linear(gx, gy, 0.3, gfit);
+
+  vector <double> cor_gc(n, NAN);
+  vector <double> vcor;
+  for (size_t i = 0; i < n; i++) {
+    if ( !valid[i] ) continue;
+    double expected = interpolate(gx, gfit, cbins[i].gc);
+    if ( expected > 0 ) {
+      cor_gc[i] = cbins[i].reads / expected;
+      vcor.push_back(cor_gc[i]);
+    }
+  }
+  double chigh = quantile(vcor, 0.99);
+
+  vector < vector <double> > mapcor(101);            // gc corrected bins by mappability (0.01 steps)
+  for (size_t i = 0; i < n; i++) {
+    if ( !isnan(cor_gc[i]) && cor_gc[i] <= chigh ) {
+      mapcor[(int)(cbins[i].mappability * 100 + 0.5)].push_back(cor_gc[i]);
+    }
+  }
+  vector <double> mx;
+  vector <double> my;
+  for (size_t b = 0; b < mapcor.size(); b++) {
+    if ( mapcor[b].empty() ) continue;
+    mx.push_back(b/100.0);
+    my.push_back(quantile(mapcor[b], 0.5));
+  }
+  vector <double> mfit;
+  local_linear(mx, my, 2.0/3.0, mfit);
+
+  LineWriter corrected_f;
+  corrected_f.Open(corrected_file);
+  corrected_f << "chr\tstart\tend\treads\tgc\tmap\tcor.gc\tcor.map\tcopy\n";
+  for (size_t i = 0; i < n; i++) {
+    corrected_f << cbin_chrs[cbins[i].chrid] << "\t" << cbins[i].start << "\t" << cbins[i].end << "\t" << cbins[i].reads << "\t";
+    if ( cbins[i].gc >= 0 ) corrected_f << cbins[i].gc << "\t";
+    else corrected_f << "NA\t";
+    if ( cbins[i].mappability >= 0 ) corrected_f << cbins[i].mappability << "\t";
+    else corrected_f << "NA\t";
+    double cor_map = NAN;
+    if ( !isnan(cor_gc[i]) ) {
+      double expected = interpolate(mx, mfit, cbins[i].mappability);
+      if ( expected > 0 ) cor_map = cor_gc[i] / expected;
+      corrected_f << cor_gc[i] << "\t";
+    } else {
+      corrected_f << "NA\t";
+    }
+    if ( !isnan(cor_map) && cor_map > 0 ) corrected_f << cor_map << "\t" << log2(cor_map) << "\n";
+    else corrected_f << "NA\tNA\n";
+  }
+  corrected_f.Close();
+
+}
+
+
+inline bool sample_region(unsigned long index, unsigned int seed, float fraction) {
+
+  // splitmix64 of (seed, region index): the same seed always picks the same regions
+  unsigned long long z = ((unsigned long long)seed << 40) + index + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  return (double)(z >> 11) / 9007199254740992.0 < fraction;
+
+}
+
+
+inline void ratio_estimate(const vector <double> &num, const vector <double> &den, double f, double &est, double &half) {
+
+  // ratio estimator sum(num)/sum(den) over the sampled regions, 95% interval from the linearized variance
+  size_t n = num.size();
+  double snum = 0, sden = 0;
+  for (size_t i = 0; i < n; i++) {
+    snum += num[i];
+    sden += den[i];
+  }
+  est = (sden > 0) ? snum/sden : 0;
+  half = 0;
+  if ( n < 2 || sden <= 0 ) return;
+  double ss = 0;
+  for (size_t i = 0; i < n; i++) {
+    double e = num[i] - est*den[i];
+    ss += e*e;
+  }
+  double dbar = sden/n;
+  half = 1.96 * sqrt( (1 - f) * ss / (n - 1) / n ) / dbar;
+
+}
+
+
+inline void sample_processing(ifstream &region_f, BamMultiReader &reader, struct parameters *param, bool &withChr) {
+
+  float fraction = param->sampleFraction;
+  string line;
+  deque <struct region> regions;
+  unsigned long nregions = 0;
+  double target_len = 0;
+  while ( getline(region_f, line) ) {            // all regions are numbered, only the picked ones are kept
+    if ( line == "" ) continue;
+    eatline(line, regions, withChr);
+    target_len += regions.back().end - regions.back().start + 1;
+    if ( sample_region(nregions, param->seed, fraction) == false ) regions.pop_back();
+    nregions++;
+  }
+
+  vector <double> len;                           // per sampled region
+  vector <double> bases;                         // aligned bases within the region
+  vector <double> reads;                         // reads starting within the region
+  vector <double> dups;                          // duplicates starting within the region
+  unsigned long missing = 0;
+
+  deque <struct region>::iterator it = regions.begin();
+  for (; it != regions.end(); it++) {
+
+    int chr_id = reader.GetReferenceID(it->chr);
+    if ( chr_id == -1 ) {
+      missing++;
+      continue;
+    }
+    if ( !reader.SetRegion(chr_id, it->start - 1, chr_id, it->end) ) {
+      cerr << "sampling ERROR: Jump region failed " << it->chr << ":" << it->start << "-" << it->end << endl;
+      reader.Close();
+      exit(1);
+    }
+
+    double rbases = 0, rreads = 0, rdups = 0;
+    BamAlignment bam;
+    while ( reader.GetNextAlignmentCore(bam) ) {   // only the core fields are needed
+
+      if ( bam.IsMapped() == false ) continue;
+      if ( param->unique == 1 && !(bam.MapQuality > 10 || bam.MapQuality == 0) ) continue;
+
+      unsigned int alignmentStart = bam.Position + 1;
+      if ( alignmentStart >= it->start && alignmentStart <= it->end ) {
+        rreads += 1;
+        if ( bam.IsDuplicate() == true ) rdups += 1;
+      }
+      if ( bam.IsDuplicate() == true ) continue;   // coverage of the deduplicated reads
+
+      unsigned int cigarEnd;
+      vector <int> blockLengths;
+      vector <int> blockStarts;
+      blockStarts.push_back(0);
+      ParseCigar(bam.CigarData, blockStarts, blockLengths, cigarEnd);
+      for (size_t b = 0; b < blockLengths.size(); b++) {
+        unsigned int bstart = alignmentStart + blockStarts[b];
+        unsigned int bend = bstart + blockLengths[b] - 1;
+        if ( blockLengths[b] <= 0 || bend < it->start || bstart > it->end ) continue;
+        rbases += min(bend, it->end) - max(bstart, it->start) + 1;
+      }
+
+    }
+
+    len.push_back(it->end - it->start + 1);
+    bases.push_back(rbases);
+    reads.push_back(rreads);
+    dups.push_back(rdups);
+  }
+
+  size_t n = len.size();
+  double f = 0;
+  double sampled_len = 0;
+  for (size_t i = 0; i < n; i++) sampled_len += len[i];
+  if ( target_len > 0 ) f = sampled_len / target_len;
+
+  double cov, cov_half, dup, dup_half, uni, uni_half, rpb, rpb_half;
+  ratio_estimate(bases, len, f, cov, cov_half);
+  ratio_estimate(dups, reads, f, dup, dup_half);
+  ratio_estimate(reads, len, f, rpb, rpb_half);
+
+  vector <double> covered(n, 0);                 // target bases of regions at >= 20% of the mean depth
+  vector <double> zero(n, 0);
+  for (size_t i = 0; i < n; i++) {
+    if ( len[i] > 0 && bases[i]/len[i] >= 0.2*cov ) covered[i] = len[i];
+    if ( bases[i] == 0 ) zero[i] = len[i];
+  }
+  ratio_estimate(covered, len, f, uni, uni_half);
+  double unc, unc_half;
+  ratio_estimate(zero, len, f, unc, unc_half);
+
+  cerr << "sampling: " << n << " of " << nregions << " regions visited (" << missing << " on references not in the bam)" << endl;
+
+  cout << "#regions\t" << nregions << "\tsampled\t" << n << "\tfraction\t" << f << endl;
+  cout << "metric\testimate\tlow95\thigh95" << endl;
+  cout << "mean_coverage\t" << cov << "\t" << max(0.0, cov - cov_half) << "\t" << cov + cov_half << endl;
+  cout << "duplicate_rate\t" << dup << "\t" << max(0.0, dup - dup_half) << "\t" << min(1.0, dup + dup_half) << endl;
+  cout << "pct_target_0.2x_mean\t" << uni << "\t" << max(0.0, uni - uni_half) << "\t" << min(1.0, uni + uni_half) << endl;
+  cout << "pct_target_uncovered\t" << unc << "\t" << max(0.0, unc - unc_half) << "\t" << min(1.0, unc + unc_half) << endl;
+  cout << "reads_in_target\t" << rpb*target_len << "\t" << max(0.0, rpb - rpb_half)*target_len << "\t" << (rpb + rpb_half)*target_len << endl;
+
+}
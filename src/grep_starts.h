@@ -8,8 +8,17 @@ struct parameters {
   char* region_f;
   char* mapping_f;
   char* type;
+  char* insert;
+  char* matrix;
+  char* complexity;
+  char* gcWig;
+  char* mapWig;
+  char* corrected;
   unsigned int unique;
   unsigned int chr;
+  unsigned int insertRG;
+  float sampleFraction;
+  unsigned int seed;
 };
 
 struct parameters* interface(struct parameters* param,int argc, char *argv[]);
@@ -33,6 +42,23 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   param->region_f = new char;
   param->mapping_f = new char;
   param->type = new char;
+  param->insert = new char;
+  param->matrix = new char;
+  param->complexity = new char;
+  param->gcWig = new char;
+  param->mapWig = new char;
+  param->corrected = new char;
+  *param->insert = '\0';
+  *param->matrix = '\0';
+  *param->complexity = '\0';
+  *param->gcWig = '\0';
+  *param->mapWig = '\0';
+  *param->corrected = '\0';
+  param->unique = 0;
+  param->chr = 0;
+  param->insertRG = 0;
+  param->sampleFraction = 0;
+  param->seed = 11;
  
   const struct option long_options[] ={
     {"region",1,0, 'r'},
@@ -40,6 +66,15 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     {"type",1,0,'t'},
     {"unique",0,0,'u'},
     {"chr",0,0,'c'},
+    {"insert",1,0,'i'},
+    {"insertRG",0,0,'g'},
+    {"matrix",1,0,'x'},
+    {"complexity",1,0,'e'},
+    {"gcWig",1,0,'G'},
+    {"mapWig",1,0,'M'},
+    {"corrected",1,0,'o'},
+    {"sample-fraction",1,0,'f'},
+    {"seed",1,0,'s'},
     {"help",0,0,'h'},
     {0, 0, 0, 0}
   };
@@ -47,7 +82,7 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   while (1) {
 
     int option_index = 0;
-    c = getopt_long_only (argc, argv,"hur:m:t:c",long_options, &option_index);
+    c = getopt_long_only (argc, argv,"hugr:m:t:ci:x:e:G:M:o:f:s:",long_options, &option_index);
 
     if (c == -1) {
       break;
@@ -71,6 +106,33 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     case 'c':
       param->chr = 1;
       break;
+    case 'i':
+      param->insert = optarg;
+      break;
+    case 'g':
+      param->insertRG = 1;
+      break;
+    case 'x':
+      param->matrix = optarg;
+      break;
+    case 'e':
+      param->complexity = optarg;
+      break;
+    case 'G':
+      param->gcWig = optarg;
+      break;
+    case 'M':
+      param->mapWig = optarg;
+      break;
+    case 'o':
+      param->corrected = optarg;
+      break;
+    case 'f':
+      param->sampleFraction = atof(optarg);
+      break;
+    case 's':
+      param->seed = atoi(optarg);
+      break;
     case 'h':
       help = 1;
       break;
@@ -102,6 +164,16 @@ void usage()
   fprintf(stdout, "-m --mapping <filename>  mapping_file (RNA-seq bam file, chromosomes and coordinates sorted also)\n");
   fprintf(stdout, "-q --unique              only calculate for uniquely mapped reads (set this when the bam files contain multi-mapping reads).\n");
   fprintf(stdout, "-c --chr                 set when the chromosome names in bam files starting with \'chr\'.\n");
+  fprintf(stdout, "-i --insert  <filename>  write the insert size histogram (proper pairs, 0 < TLEN < 1000) of the counted reads into this file.\n");
+  fprintf(stdout, "-g --insertRG            stratify the insert size histogram by read group (RG tag).\n");
+  fprintf(stdout, "-x --matrix  <file/rg>   matrix mode: append one starts column per input bam file (file) or per header read group (rg) after the total counts.\n");
+  fprintf(stdout, "-e --complexity <filename> write the library complexity extrapolation curve into this file (count-of-counts of read signatures into <filename>.hist).\n");
+  fprintf(stdout, "-G --gcWig   <filename>  gc content wig (fixedStep, same bins as the region file) for read count correction.\n");
+  fprintf(stdout, "-M --mapWig  <filename>  mappability wig (fixedStep, same bins as the region file) for read count correction.\n");
+  fprintf(stdout, "-o --corrected <filename> write gc and mappability corrected counts (HMMcopy style columns) of the region bins into this file.\n");
+  fprintf(stdout, "-f --sample-fraction <f> fast estimate: only visit a random fraction f (0-1) of the regions through the bam index and write\n");
+  fprintf(stdout, "                         extrapolated coverage, duplicate rate and uniformity with 95%% confidence intervals instead of the region counts.\n");
+  fprintf(stdout, "-s --seed    <int>       seed of the region sampling (default 11, the same seed gives the same regions).\n");
   fprintf(stdout, "-t --type    <p/s>       under development\n");
   fprintf(stdout, "\n");
 }
@@ -112,5 +184,11 @@ void delete_param(struct parameters* param)
   delete(param->region_f);
   delete(param->mapping_f);
   delete(param->type);
+  delete(param->insert);
+  delete(param->matrix);
+  delete(param->complexity);
+  delete(param->gcWig);
+  delete(param->mapWig);
+  delete(param->corrected);
   delete(param);
 }
@@ -0,0 +1,248 @@
+/*****************************************************************************
+
+  kmer_index.h
+  genome k-mer occurrence table for the flank uniqueness (paralog) check
+
+  the canonical k-mers (k <= 28, 2 bits a base) of the reference are counted
+  once and written as one sorted array of (k-mer << 8 | count) words behind a
+  bucket table on the leading bases. only k-mers whose hash falls in 1/sample
+  are kept, the same selection is applied to every k-mer looked up, so the
+  file stays a few GB and a lookup touches one or two pages of the map.
+  counts saturate at 255.
+
+  a query k-mer is answered with the occurrences of all its sampled
+  neighbours within a Hamming distance (0, 1 or 2), enumerated at lookup.
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef KMER_INDEX_H
+#define KMER_INDEX_H
+
+#include "fasta_index.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+using namespace std;
+
+const unsigned int kmer_bucket_bits = 20;
+
+
+class KmerIndex {
+
+ public:
+  KmerIndex() : data(NULL), size(0), fd(-1), k(0), sample(1), buckets(NULL), entries(NULL), n(0) {}
+  ~KmerIndex() { Close(); }
+
+  bool Open(const string &file) {
+    fd = open(file.c_str(), O_RDONLY);
+    if ( fd < 0 ) return false;
+    struct stat st;
+    if ( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(head) ) return false;
+    size = st.st_size;
+    void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( m == MAP_FAILED ) return false;
+    data = (const char *)m;
+    head h;
+    memcpy(&h, data, sizeof(h));
+    if ( memcmp(h.magic, "KMX1", 4) != 0 || h.bits != kmer_bucket_bits ) {
+      cerr << "kmer ERROR: " << file << " is not a kmer index" << endl;
+      exit(1);
+    }
+    k = h.k;
+    sample = h.sample;
+    n = h.n;
+    buckets = (const uint64_t *)(data + sizeof(head));
+    entries = buckets + (1 << kmer_bucket_bits) + 1;
+    madvise(m, size, MADV_RANDOM);
+    return true;
+  }
+
+  void Close() {
+    if ( data != NULL ) munmap((void *)data, size);
+    if ( fd >= 0 ) close(fd);
+    data = NULL;
+    fd = -1;
+  }
+
+  unsigned int K() const {
+    return k;
+  }
+
+  unsigned int Sample() const {
+    return sample;
+  }
+
+  bool Sampled(uint64_t canon) const {
+    return sample <= 1 || mix(canon) % sample == 0;
+  }
+
+  unsigned int Count(uint64_t canon) const {           // 0 when absent or not sampled
+    if ( !Sampled(canon) ) return 0;
+    uint64_t b = canon >> (2*k - kmer_bucket_bits);
+    const uint64_t *lo = entries + buckets[b];
+    const uint64_t *hi = entries + buckets[b+1];
+    const uint64_t *it = lower_bound(lo, hi, canon << 8);
+    if ( it != hi && (*it >> 8) == canon ) return *it & 0xff;
+    return 0;
+  }
+
+  unsigned int Neighbours(uint64_t fwd, uint64_t rev, unsigned int maxdist) const {
+
+    // occurrences of the k-mer (forward and reverse complement codes) and of its neighbours up to maxdist
+    // a base change flips the same two bits (xor) in the reverse complement, mirrored
+    unsigned int total = Count(fwd < rev ? fwd : rev);
+    if ( maxdist == 0 ) return total;
+    for (unsigned int i = 0; i < k; i++) {
+      for (uint64_t di = 1; di < 4; di++) {
+        uint64_t f1 = fwd ^ (di << 2*i);
+        uint64_t r1 = rev ^ (di << 2*(k-1-i));
+        total += Count(f1 < r1 ? f1 : r1);
+        if ( maxdist < 2 ) continue;
+        for (unsigned int j = i + 1; j < k; j++) {
+          for (uint64_t dj = 1; dj < 4; dj++) {
+            uint64_t f2 = f1 ^ (dj << 2*j);
+            uint64_t r2 = r1 ^ (dj << 2*(k-1-j));
+            total += Count(f2 < r2 ? f2 : r2);
+          }
+        }
+      }
+    }
+    return total;
+  }
+
+  static unsigned int Distance(uint64_t a, uint64_t b) {   // Hamming distance of two k-mer codes
+    uint64_t x = a ^ b;
+    return __builtin_popcountll((x | (x >> 1)) & 0x5555555555555555ULL);
+  }
+
+  static bool Encode(const char *s, unsigned int kk, uint64_t &fwd, uint64_t &rev) {   // false when the k-mer has an N
+    fwd = 0;
+    rev = 0;
+    for (unsigned int i = 0; i < kk; i++) {
+      int b = Code(s[i]);
+      if ( b < 0 ) return false;
+      fwd = (fwd << 2) | b;
+      rev |= (uint64_t)(3 - b) << 2*i;
+    }
+    return true;
+  }
+
+  static int Code(char base) {                         // -1 for N and the rest
+    switch (base) {
+    case 'A': return 0;
+    case 'C': return 1;
+    case 'G': return 2;
+    case 'T': return 3;
+    default : return -1;
+    }
+  }
+
+  static bool Build(FastaIndex &fasta, const string &file, unsigned int kk, unsigned int ss) {
+
+    // one pass over the chromosomes collecting the sampled canonical k-mers, then sort and count
+    if ( kk < 11 || kk > 28 ) {
+      cerr << "kmer ERROR: k must be within 11 and 28" << endl;
+      exit(1);
+    }
+    KmerIndex probe;
+    probe.k = kk;
+    probe.sample = (ss > 0) ? ss : 1;
+    vector <uint64_t> kmers;
+    vector <string> chroms;
+    fasta.Chromosomes(chroms);
+    sort(chroms.begin(), chroms.end());
+    fasta.Sequential();
+    uint64_t mask = (1ULL << 2*kk) - 1;
+    string seq;
+    for (size_t c = 0; c < chroms.size(); c++) {
+      fasta.Fetch(chroms[c], 0, fasta.Length(chroms[c]), seq);
+      uint64_t fwd = 0, rev = 0;
+      unsigned int valid = 0;
+      for (size_t i = 0; i < seq.size(); i++) {
+        int b = Code(seq[i]);
+        if ( b < 0 ) {
+          valid = 0;
+          continue;
+        }
+        fwd = ((fwd << 2) | b) & mask;
+        rev = (rev >> 2) | ((uint64_t)(3 - b) << 2*(kk-1));
+        if ( ++valid < kk ) continue;
+        uint64_t canon = (fwd < rev) ? fwd : rev;
+        if ( probe.Sampled(canon) ) kmers.push_back(canon);
+      }
+      cerr << "kmer: " << chroms[c] << " done, " << kmers.size() << " sampled kmers" << endl;
+    }
+    string().swap(seq);
+    sort(kmers.begin(), kmers.end());
+
+    size_t m = 0;                                      // collapse into (kmer << 8 | count), in place
+    for (size_t i = 0; i < kmers.size(); ) {
+      size_t j = i;
+      while ( j < kmers.size() && kmers[j] == kmers[i] ) ++j;
+      uint64_t count = (j - i > 255) ? 255 : j - i;
+      kmers[m++] = (kmers[i] << 8) | count;
+      i = j;
+    }
+    kmers.resize(m);
+
+    vector <uint64_t> table((1 << kmer_bucket_bits) + 1, 0);
+    for (size_t i = 0; i < m; i++) table[((kmers[i] >> 8) >> (2*kk - kmer_bucket_bits)) + 1]++;
+    for (size_t b = 1; b < table.size(); b++) table[b] += table[b-1];
+
+    FILE *out_f = fopen(file.c_str(), "wb");
+    if ( out_f == NULL ) return false;
+    head h;
+    memcpy(h.magic, "KMX1", 4);
+    h.k = kk;
+    h.sample = probe.sample;
+    h.bits = kmer_bucket_bits;
+    h.n = m;
+    bool ok = fwrite(&h, sizeof(h), 1, out_f) == 1
+      && fwrite(&table[0], sizeof(uint64_t), table.size(), out_f) == table.size()
+      && (m == 0 || fwrite(&kmers[0], sizeof(uint64_t), m, out_f) == m);
+    return (fclose(out_f) == 0) && ok;
+
+  }
+
+ private:
+  struct head {
+    char magic[4];
+    uint32_t k;
+    uint32_t sample;
+    uint32_t bits;
+    uint64_t n;
+  };
+
+  const char *data;
+  size_t size;
+  int fd;
+  unsigned int k;
+  unsigned int sample;
+  const uint64_t *buckets;
+  const uint64_t *entries;
+  uint64_t n;
+
+  static uint64_t mix(uint64_t x) {                    // splitmix64 finalizer, the sampling hash
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+
+};
+
+#endif
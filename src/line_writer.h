@@ -0,0 +1,179 @@
+/*****************************************************************************
+
+  line_writer.h
+  buffered text output for the tables, bins and read lists of the tools
+
+  lines are collected in a 1 MB user-space buffer and written with one
+  write() whenever it fills, at Flush() (checkpoints) and at Close() (also
+  from the destructor, so a global writer is flushed by exit()). integers
+  are formatted by hand, floating point with snprintf "%.*g", which is
+  what an ostream does with the default format, so the output is byte for
+  byte that of the ofstream/cout code it replaces. a writer that is never
+  opened keeps its text in memory for Take() (the per-batch output of the
+  worker threads).
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef LINE_WRITER_H
+#define LINE_WRITER_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+
+using namespace std;
+
+const size_t line_buffer_size = 1 << 20;
+
+
+struct Precision {       // as setprecision: significant digits of the floating point values that follow
+  int digits;
+  explicit Precision(int d) : digits(d) {}
+};
+
+
+inline char *uint_digits(char *end, unsigned long long v) {   // the digits end at end, returns their start
+  do {
+    *--end = '0' + v % 10;
+    v /= 10;
+  } while ( v != 0 );
+  return end;
+}
+
+inline string uint_text(unsigned long long v) {
+  char buf[24];
+  char *start = uint_digits(buf + sizeof(buf), v);
+  return string(start, buf + sizeof(buf) - start);
+}
+
+inline string float_text(double v, int digits = 6) {          // same text as an ostream's default format
+  char buf[64];
+  int n = snprintf(buf, sizeof(buf), "%.*g", digits, v);
+  return string(buf, n);
+}
+
+
+class LineWriter {
+
+ public:
+  LineWriter() : fd(-1), owned(false), digits(6) {}
+  ~LineWriter() { Close(); }
+
+  void Open(const string &filename) {
+    Close();
+    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if ( fd < 0 ) {
+      cerr << "Could not open output file " << filename << endl;
+      exit(1);
+    }
+    owned = true;
+    buffer.reserve(line_buffer_size);
+  }
+
+  void OpenStdout() {
+    Close();
+    fflush(stdout);
+    fd = 1;
+    owned = false;
+    buffer.reserve(line_buffer_size);
+  }
+
+  bool IsOpen() const {
+    return fd >= 0;
+  }
+
+  void Flush() {
+    if ( fd < 0 || buffer.empty() ) return;
+    const char *p = buffer.data();
+    size_t left = buffer.size();
+    while ( left > 0 ) {
+      ssize_t n = write(fd, p, left);
+      if ( n < 0 && errno == EINTR ) continue;
+      if ( n <= 0 ) {
+        cerr << "write ERROR: " << strerror(errno) << endl;
+        exit(1);
+      }
+      p += n;
+      left -= n;
+    }
+    buffer.clear();
+  }
+
+  void Close() {
+    Flush();
+    if ( owned == true && fd >= 0 ) close(fd);
+    fd = -1;
+    owned = false;
+  }
+
+  void Take(string &text) {                            // the text of a writer that was not opened
+    text.swap(buffer);
+    buffer.clear();
+  }
+
+  LineWriter &operator<<(const string &s) {
+    buffer.append(s);
+    return checkpoint();
+  }
+
+  LineWriter &operator<<(const char *s) {
+    buffer.append(s);
+    return checkpoint();
+  }
+
+  LineWriter &operator<<(char c) {
+    buffer.push_back(c);
+    return checkpoint();
+  }
+
+  template <typename T>
+  typename enable_if<is_integral<T>::value && !is_same<T, char>::value && !is_same<T, bool>::value, LineWriter &>::type
+  operator<<(T v) {
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *start;
+    if ( is_signed<T>::value && v < 0 ) {
+      start = uint_digits(end, 0ULL - (unsigned long long)v);
+      *--start = '-';
+    } else {
+      start = uint_digits(end, (unsigned long long)v);
+    }
+    buffer.append(start, end - start);
+    return checkpoint();
+  }
+
+  LineWriter &operator<<(double v) {
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%.*g", digits, v);
+    buffer.append(buf, n);
+    return checkpoint();
+  }
+
+  LineWriter &operator<<(const Precision &p) {
+    digits = p.digits;
+    return *this;
+  }
+
+ private:
+  int fd;
+  bool owned;
+  int digits;
+  string buffer;
+
+  LineWriter &checkpoint() {
+    if ( fd >= 0 && buffer.size() >= line_buffer_size ) Flush();
+    return *this;
+  }
+
+};
+
+#endif
@@ -31,14 +31,22 @@ using namespace BamTools;
 #include <cstdlib>
 #include <vector>
 #include <deque>
+#include <map>
 #include <set>
 #include <string>
 #include <cstring>
 #include <sstream>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
 #include "mappingFlankingVariants.h"
-#include "boost/regex.hpp"
+#include "fasta_index.h"
+#include "kmer_index.h"
+#include "ref_mismatch.h"
+#include "line_writer.h"
 using namespace std;
-using namespace boost;
 
 
 struct RseqSTATS {
@@ -70,28 +78,99 @@ struct Alignment {
 };
 
 
-struct taginfo {
+struct RecordInfo {              // what record_info() finds out about one record
+  unsigned int unique;
+  bool jc;
+  string chrom;
+  string strand;
+  unsigned int alignmentStart;
+  unsigned int alignmentEnd;
+  map<unsigned int, unsigned int> insertions;
+};
+
+
+struct FlankBatch {              // a batch of whole flanks (all hits of a read name) for one worker
+  vector <BamAlignment> reads;
+  string breakpoints;
+  string unmapped;
+  string hits;
+  map <string, bool> verdicts;
+  struct RseqSTATS stats;
+  bool done;
+};
+
+
+struct taginfo {                 // the hits of one flank (read name chr:pos)
   string name;
-  string chr;
+  string chr;                    // best (first) hit
   string strand;
   unsigned int start;
   unsigned int end;
-  unsigned int times;
+  unsigned int times;            // further hits with at most the edits of the best one
   unsigned int bestmis;
-  string mismatches;
+  unsigned int secondmis;        // fewest edits among the further hits
+  string secondchr;
+  unsigned int secondstart;
+  unsigned int hits;
+  string mismatches;             // read positions of the edits, only kept for the debug dump
 };
 
+class RefMismatch *ref_mismatch = NULL;   // --genome with --mapping: the edits against the reference, else from MD
+
 
 inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, vector<int> &blockEnds, unsigned int &alignmentEnd, bool &jc, bool &chimeric, bool &hoe, string &cliptype, unsigned int &cliplen, map<unsigned int, unsigned int> &insertions, unsigned int &softClip);
 inline void splitstring(const string &str, vector<string> &elements, const string &delimiter);
 inline string int2str(unsigned int i);
 inline void print_stats(struct RseqSTATS &rstats);
+inline void write_flanks(const string &genome, const string &variants, const string &flanks, bool snvCheck, const KmerIndex *kmers, unsigned int maxdist, map<string, bool> &verdicts);
+inline bool flank_paralog(const KmerIndex &kmers, const string &flank, const string &window, long lengthRef, long lengthAlt, unsigned int maxdist);
+inline void record_info(BamAlignment &bam, const RefVector &refs, const string &type, unsigned int cliplen, struct RecordInfo &info, LineWriter *bp_out);
+inline void flank_record(BamAlignment &bam, struct RecordInfo &info, struct taginfo &CUR, string &old_frag, struct RseqSTATS &BAMSTATS, LineWriter *hits_out, map<string, bool> &verdicts);
+inline void flank_pipeline(BamMultiReader &reader, const RefVector &refs, BamWriter &writer, unsigned int cliplen, const string &type, LineWriter *bp_out, LineWriter *unmapped_out, LineWriter *hits_out, map<string, bool> &verdicts, struct RseqSTATS &BAMSTATS, int threads);
+inline void add_stats(struct RseqSTATS &total, const struct RseqSTATS &part);
+inline unsigned int flank_edits(BamAlignment &bam, const string &chrom, map<unsigned int, unsigned int> &insertions, const string &strand, string &positions, bool dumping);
+inline void close_flank(const struct taginfo &cur, LineWriter *hits_f, map<string, bool> &verdicts);
+inline string flank_key(const string &chr, const string &pos);
+inline void write_paralog(const string &variants, const string &paralog, map<string, bool> &verdicts);
 
 int main (int argc, char *argv[]) {
  
   struct parameters *param = 0;
   param = interface(param, argc, argv);
 
+  string variants = param->variants;
+  string genome = param->genome;
+  if ( genome != "" && string(param->mapping_f) == "" ) {   // flank mode: the fasta for the paralog check
+    string buildIndex = param->buildIndex;
+    string kmerIndex = param->kmerIndex;
+    map <string, bool> verdicts;
+    if ( buildIndex != "" ) {                        // once per genome
+      FastaIndex fasta;
+      if ( !fasta.Open(genome) || !KmerIndex::Build(fasta, buildIndex, param->kmer, param->kmerSample) ) {
+        cerr << "Could not build the kmer index " << buildIndex << endl;
+        exit(1);
+      }
+    } else if ( kmerIndex != "" ) {                  // paralog verdicts by lookup, no aligner
+      KmerIndex kmers;
+      if ( !kmers.Open(kmerIndex) ) {
+        cerr << "Could not open the kmer index " << kmerIndex << endl;
+        exit(1);
+      }
+      write_flanks(genome, variants, param->flanks, string(param->type) == "snv", &kmers, param->kmerDistance, verdicts);
+      if ( string(param->paralog) != "" ) write_paralog(variants, param->paralog, verdicts);
+    } else {
+      write_flanks(genome, variants, param->flanks, string(param->type) == "snv", NULL, 0, verdicts);
+    }
+    exit(0);
+  }
+  if ( genome != "" ) {
+    ref_mismatch = new RefMismatch;
+    if ( !ref_mismatch->Open(genome) ) {
+      cerr << "Could not open the genome fasta " << genome << endl;
+      exit(1);
+    }
+  }
+
   //-------------------------------------------------------------------------------------------------------+
   // BAM input (file or filenames?)                                                                        |
   //-------------------------------------------------------------------------------------------------------+
@@ -177,24 +256,24 @@ int main (int argc, char *argv[]) {
 
 
   // attempt to write unmapped reads
-  ofstream unmapped_f;
+  LineWriter unmapped_f;
   string unmapped = param->unmapped;
   if ( unmapped != "") {
-    unmapped_f.open(param->unmapped);
+    unmapped_f.Open(unmapped);
   }
 
   // attempt to write arp reads
-  ofstream arp_f;
+  LineWriter arp_f;
   string arp = param->arp;
   if ( arp != "" ) {
-    arp_f.open(param->arp);
+    arp_f.Open(arp);
   }
 
   // attemp to write breakpoints
-  ofstream bp_f;
+  LineWriter bp_f;
   string bp_file = param->breakpoint;
   if ( bp_file != "" ) {
-    bp_f.open(param->breakpoint);
+    bp_f.Open(bp_file);
   }
 
   // statistics
@@ -203,7 +282,21 @@ int main (int argc, char *argv[]) {
   map <string, struct Alignment> fragment; // map for fragment
 
   // for crispr 
-  struct taginfo CUR = {"SRP","SRP","SRP",0,0,0,0,"none:"};
+  struct taginfo CUR = {"SRP","SRP","SRP",0,0,0,0,UINT_MAX,"SRP",0,0,"none:"};
+
+  // paralog verdicts of the flanks, the per flank lines only as debug output
+  string paralog = param->paralog;
+  string hits = param->hits;
+  map <string, bool> verdicts;
+  LineWriter hits_f;
+  LineWriter *hits_out = NULL;
+  if ( hits != "" && hits != "-" ) {
+    hits_f.Open(hits);
+    hits_out = &hits_f;
+  } else if ( hits == "-" || paralog == "" ) {
+    hits_f.OpenStdout();
+    hits_out = &hits_f;
+  }
 
 
   // type == "s" or type == "p" ?
@@ -211,288 +304,32 @@ int main (int argc, char *argv[]) {
   
   string old_frag = "SRP";
 
+  // single-end flanks on several threads, the loop below then reads nothing
+  int threads = param->threads;
+  bool piped = (type == "s" && threads > 1);
+  if ( piped == true ) {
+    flank_pipeline(reader, refs, writer, cliplen, type, (bp_file != "") ? &bp_f : NULL, (unmapped != "") ? &unmapped_f : NULL,
+                   hits_out, verdicts, BAMSTATS, threads);
+  }
+
   BamAlignment bam;
-  while ( reader.GetNextAlignment(bam) ) {
+  while ( piped == false && reader.GetNextAlignment(bam) ) {
 
     BamAlignment cBAM;
 
-    unsigned int unique = 0;
-    string XS = "SRP";
-    bool jc = false;
-    bool chimeric = false;
-    string cliptype = "N";
-    bool hoe = true;                               //true is head
-    string mateStatus = "p";                       //'w' hints breakpoints
-    unsigned int breakpoint = 0;
-    string chrom = "SRP";
-    string strand = "+";
-    unsigned int alignmentStart = 0;
-    unsigned int alignmentEnd = 0;
-    unsigned int cigarEnd;
-    vector <int> blockLengths;
-    vector <int> blockStarts;
-    string mateChr = "SRP";
-    unsigned int matePos = 0;
-    map<unsigned int, unsigned int> insertions;       // for insertions 
-    unsigned int softClip = 0; 
-
-    
-    if ( bam.IsMapped() == true) {
-
-      writer.SaveAlignment(bam);                    // write mapped tags to a new bam
-
-      bam.GetTag("NH", unique);                     // uniqueness
-
-      blockStarts.push_back(0);
-      ParseCigar(bam.CigarData, blockStarts, blockLengths, cigarEnd, jc, chimeric, hoe, cliptype, cliplen, insertions, softClip); 
-
-      chrom  = refs.at(bam.RefID).RefName;          // chromosome
-      if (bam.IsReverseStrand()) strand = "-";      // strand -
-      alignmentStart = bam.Position+1;              // start
-      alignmentEnd   = bam.GetEndPosition();        // end
-
-      if ( unique == 1 ) {                            // check breakpoint reads
-
-        if (chimeric == true) {
-
-          if (type == "p"){
-            if ( bam.IsMateMapped() == true){
-              mateChr = refs.at(bam.MateRefID).RefName;
-              matePos = bam.MatePosition;
-              int mateDistance = matePos-alignmentStart;
-              if (mateChr != chrom || abs(mateDistance) > 230000) 
-                mateStatus = "w";
-            }
-          }
-
-          if (hoe  == false) {
-            breakpoint =  alignmentStart;
-          }
-          else if (hoe == true) {
-            vector<int>::iterator bsiter = blockStarts.end();
-            vector<int>::iterator bliter = blockLengths.end();
-            breakpoint = alignmentStart + *(bsiter-1) + *(bliter-1);
-          }
-          if ( bp_file != "" ) {
-            bp_f << chrom << "\t" << breakpoint << "\t" << bam.Name << "\t" << mateStatus << "\t" << cliptype << endl;
-          }
-        }
-
-      } // check breakpoint reads
+    struct RecordInfo info;
+    if ( bam.IsMapped() == true ) writer.SaveAlignment(bam);      // write mapped tags to a new bam
+    record_info(bam, refs, type, cliplen, info, (bp_file != "") ? &bp_f : NULL);
+    if ( bam.IsMapped() == false && unmapped != "" ) unmapped_f << bam.Name << '\n';
 
-    } else {
-      if ( unmapped != "" ) {
-        unmapped_f << bam.Name << endl;
-      }
-    }
+    unsigned int &unique = info.unique;
+    bool &jc = info.jc;
+    string &chrom = info.chrom;
+    unsigned int &alignmentStart = info.alignmentStart;
+    unsigned int &alignmentEnd = info.alignmentEnd;
 
     if (type == "s") {  //single-end
-      if ( bam.Name != old_frag ) {  // new frag
-
-        ++BAMSTATS.num_Reads;
-        if ( bam.IsMapped() ) { //mapped
-          ++BAMSTATS.num_Mapped;
-          if ( unique == 1 ) ++BAMSTATS.num_Unique;
-          else               ++BAMSTATS.num_Multi;
-        } else { //unmapped
-           ++BAMSTATS.num_Unmapped;
-        }
-        if ( bam.IsDuplicate() ) ++BAMSTATS.num_Duplicates;
-        if (  bam.IsFailedQC() ) ++BAMSTATS.num_FailedQC;
-        if (jc == true)          ++BAMSTATS.num_spliced;
-
-        //should print out that stuff
-        if (CUR.name != "SRP") {
-          cout << CUR.name << "\t" << CUR.chr << "\t" << CUR.start << "\t" << CUR.end << "\t" << CUR.strand << "\t" << CUR.bestmis << "\t" <<  CUR.times << "\t" << CUR.mismatches << endl;
-        }
-        // redefine CUR
-        CUR.name = "SRP";
-        CUR.chr = "SRP";
-        CUR.strand = "SRP";
-        CUR.start = 0;
-        CUR.end = 0;
-        CUR.times = 0;
-        CUR.bestmis = 0;
-        CUR.mismatches = "none:";
-
-        // mismatch screening
-        //processing MD string, calculate mismatch coordinates and compare with the variants 
-        string MD;
-        bam.GetTag("MD", MD);
-        unsigned int mismatches = 0;
-        unsigned int cuPosRead = 1;
-        regex rgx( "([0-9]+)([ACGT]|\\^[ACGT]+)" );
-        int subs[] = {1,2};
-        sregex_token_iterator rit ( MD.begin(), MD.end(), rgx, subs );
-        sregex_token_iterator rend; 
-
-        map<unsigned int, unsigned int>::iterator inserit_index = insertions.begin();
-        while ( inserit_index != insertions.end() ) {  // check insertions
-          if (CUR.mismatches == "none:"){
-            CUR.mismatches = "";
-          }
-          if (strand == "-") {
-            int revcuPosRead =  (bam.Length + 1) - inserit_index->first;
-            CUR.mismatches += int2str(revcuPosRead) + "I:";
-          }
-          else {
-            CUR.mismatches += int2str(inserit_index->first) + "I:";
-          }
-          mismatches += inserit_index->second;     //should count as mismatches
-          inserit_index++;
-        }
-        inserit_index = insertions.begin();   //reset it for the begin of insertions
-
-        while ( rit != rend ) {
-
-          unsigned int incre = atoi((*rit).str().c_str());
-          cuPosRead += incre;
-
-          map<unsigned int, unsigned int>::iterator inserit = inserit_index;
-          while ( inserit != insertions.end() ) {
-            if ( inserit->first < cuPosRead ) {
-              cuPosRead += inserit->second;
-              inserit++;
-              inserit_index = inserit;
-            } else {
-              inserit_index = inserit;
-              break;
-            }
-          }
-
-          ++rit;                                            //round 1 addition
-
-          if (((*rit).str())[0] == '^') {                   //variant 2
-            incre = (*rit).length() - 1;                    //variant 2
-            mismatches += (*rit).length()-1;                //deletion*2
-            if (CUR.mismatches == "none:"){
-              CUR.mismatches = "";
-            }
-            if (strand == "-") {
-              int revcuPosRead =  (bam.Length + 1) - cuPosRead;
-              CUR.mismatches += int2str(revcuPosRead) + "D:";
-            }
-            else {
-              CUR.mismatches += int2str(cuPosRead) + "D:";
-            }
-          } else if ((*rit).length() == 1) {                // single base nucleotide change
-            mismatches += 1;
-            if (CUR.mismatches == "none:"){
-              CUR.mismatches = "";
-            }
-            if (strand == "-"){
-              int revcuPosRead =  (bam.Length + 1) - cuPosRead; 
-              CUR.mismatches += int2str(revcuPosRead) + ":";
-            }
-            else { 
-              CUR.mismatches += int2str(cuPosRead) + ":";
-            }
-            cuPosRead += 1;
-          } else {
-            cerr << "wired thing happened in the MD string of " << bam.Name << endl;
-            exit(1);
-          }
-
-          ++rit;                                            //round 2 addition
-
-        } //loop for all MD characters
-        CUR.mismatches = (CUR.mismatches).substr(0, (CUR.mismatches).size()-1);
-        CUR.mismatches += ",";
-
-        //if (mismatches == 0) {
-          CUR.name = bam.Name;
-          CUR.chr = chrom;
-          CUR.start = alignmentStart;
-          CUR.end = alignmentEnd;
-          CUR.strand = strand;
-          CUR.bestmis = mismatches;
-        //} 
-
-        old_frag = bam.Name; // reset old frag
-
-      } else {  // IT IS AN OLD FRAGMENT!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-         
-        // mismatch screening
-        //processing MD string, calculate mismatch coordinates and compare with the variants 
-        string MD;
-        bam.GetTag("MD", MD);
-        unsigned int mismatches = 0;
-        unsigned int cuPosRead = 1;
-        regex rgx( "([0-9]+)([ACGT]|\\^[ACGT]+)" );
-        int subs[] = {1,2};
-        sregex_token_iterator rit ( MD.begin(), MD.end(), rgx, subs );
-        sregex_token_iterator rend; 
-
-        map<unsigned int, unsigned int>::iterator inserit_index = insertions.begin();
-        while ( inserit_index != insertions.end() ) {  // check insertions
-          if (CUR.mismatches == "none:"){
-            CUR.mismatches = "";
-          }
-          if (strand == "-") {
-            int revcuPosRead =  (bam.Length + 1) - inserit_index->first;
-            CUR.mismatches += int2str(revcuPosRead) + "I:";
-          }
-          else {
-            CUR.mismatches += int2str(inserit_index->first) + "I:";
-          }
-          mismatches += inserit_index->second;     //should count as mismatches
-          inserit_index++;
-        }
-        inserit_index = insertions.begin();   //reset it for the begin of insertions
-
-        while ( rit != rend ) {
-
-          unsigned int incre = atoi((*rit).str().c_str());
-          cuPosRead += incre;
-
-          map<unsigned int, unsigned int>::iterator inserit = inserit_index;
-          while ( inserit != insertions.end() ) {
-            if ( inserit->first < cuPosRead ) {
-              cuPosRead += inserit->second;
-              inserit++;
-              inserit_index = inserit;
-            } else {
-              inserit_index = inserit;
-              break;
-            }
-          }
-
-          ++rit;                                            //round 1 addition
-
-          if (((*rit).str())[0] == '^') {                   //variant 2
-            incre = (*rit).length() - 1;                    //variant 2
-            mismatches += (*rit).length()-1;               //deletion*2
-            if (strand == "+")
-              CUR.mismatches += int2str(cuPosRead) + "D:";
-            else {
-              int revcuPosRead = (bam.Length + 1) - cuPosRead;
-              CUR.mismatches += int2str(revcuPosRead) + "D:";
-            }
-          } else if ((*rit).length() == 1) {                // single base nucleotide change
-            mismatches += 1;
-            if (strand == "+") 
-              CUR.mismatches += int2str(cuPosRead) + ":";
-            else {
-              int revcuPosRead = (bam.Length + 1) - cuPosRead;
-              CUR.mismatches += int2str(revcuPosRead) + ":";
-            }
-            cuPosRead += 1;
-          } else {
-            cerr << "wired thing happened in the MD string of " << bam.Name << endl;
-            exit(1);
-          }
-
-          ++rit;                                            //round 2 addition
-
-        } //loop for all MD characters
-        CUR.mismatches = (CUR.mismatches).substr(0, (CUR.mismatches).size()-1);
-        CUR.mismatches += ",";
-        
-        if (mismatches <= CUR.bestmis){
-          CUR.times += 1;
-        }
-
-      }
+      flank_record(bam, info, CUR, old_frag, BAMSTATS, hits_out, verdicts);
     } else { // paired-end
       unsigned int mate = 1;
       if ( bam.IsFirstMate() == false ) mate = 2;           // second mate
@@ -549,7 +386,7 @@ int main (int argc, char *argv[]) {
               struct Alignment tmp = {"UM", 0, 0, chrom, alignmentStart, alignmentEnd, 3, jc, cBAM, bam};
               fragment.insert( pair<string, struct Alignment>(bam.Name, tmp) );
             }
-            if ( arp != "" ) arp_f << bam.Name << endl;       // write arp
+            if ( arp != "" ) arp_f << bam.Name << '\n';       // write arp
           } // Singletons
 
         } //one another end is not mappable
@@ -621,7 +458,7 @@ int main (int argc, char *argv[]) {
               fragment[bam.Name].end1 = alignmentEnd;
               fragment[bam.Name].junction = jc;
               fragment[bam.Name].mate1 = bam;
-              if ( arp != "" ) arp_f << bam.Name << endl;       // write arp
+              if ( arp != "" ) arp_f << bam.Name << '\n';       // write arp
             }
             else {
               fragment[bam.Name].chr2 = chrom;
@@ -629,7 +466,7 @@ int main (int argc, char *argv[]) {
               fragment[bam.Name].end2 = alignmentEnd;
               fragment[bam.Name].junction = jc;
               fragment[bam.Name].mate2 = bam;
-              if ( arp != "" ) arp_f << bam.Name << endl;       // write arp
+              if ( arp != "" ) arp_f << bam.Name << '\n';       // write arp
             }
             fragment[bam.Name].cate = 3;
           } // Singletons
@@ -643,7 +480,7 @@ int main (int argc, char *argv[]) {
             else { //print out the current alignment
               //writer.SaveAlignment(bam);                          // write
               if ( arp != "" ) {
-                arp_f << bam.Name << endl;
+                arp_f << bam.Name << '\n';
               }
               continue;
             }
@@ -663,7 +500,7 @@ int main (int argc, char *argv[]) {
             if ( arp != "" ) {
               int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
               if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > 230000) ) 
-                arp_f << bam.Name << endl;
+                arp_f << bam.Name << '\n';
             }
 
           } // both ends are unique
@@ -680,7 +517,7 @@ int main (int argc, char *argv[]) {
               if ( arp != "" ) {
                 int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
                 if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > 230000) ) 
-                  arp_f << bam.Name << endl;
+                  arp_f << bam.Name << '\n';
               }
             }
           }
@@ -693,7 +530,7 @@ int main (int argc, char *argv[]) {
             else { //print out the current alignment
               //writer.SaveAlignment(bam);                          // write
               if ( arp != "" ) {
-                arp_f << bam.Name << endl;
+                arp_f << bam.Name << '\n';
               }
               continue;
             }
@@ -713,7 +550,7 @@ int main (int argc, char *argv[]) {
             if ( arp != "" ) {
               int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
               if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > 230000) ) 
-                arp_f << bam.Name << endl;
+                arp_f << bam.Name << '\n';
             }
           } // both ends are unique
           else { // the mate 1 is multi
@@ -729,7 +566,7 @@ int main (int argc, char *argv[]) {
               if ( arp != "" ) {
                 int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
                 if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > 230000) ) 
-                  arp_f << bam.Name << endl;
+                  arp_f << bam.Name << '\n';
               }
             }
           }
@@ -759,7 +596,7 @@ int main (int argc, char *argv[]) {
               if ( arp != "" ) {
                 int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
                 if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > 230000) ) 
-                  arp_f << bam.Name << endl;
+                  arp_f << bam.Name << '\n';
               }
             }
             else { // if mate 2 is multi
@@ -795,7 +632,7 @@ int main (int argc, char *argv[]) {
               if ( arp != "" ) {
                 int dis = fragment[bam.Name].start1 - fragment[bam.Name].start2;
                 if ( (fragment[bam.Name].chr1 != fragment[bam.Name].chr2) || (abs(dis) > 230000) ) 
-                  arp_f << bam.Name << endl;
+                  arp_f << bam.Name << '\n';
               }
             }
             else { // if mate 1 is multi
@@ -812,10 +649,18 @@ int main (int argc, char *argv[]) {
     } // paired-end
 
   }  //  read a bam
+
+  if (type == "s") {
+    if (CUR.name != "SRP") close_flank(CUR, hits_out, verdicts);
+    if (paralog != "") write_paralog(variants, paralog, verdicts);
+  }
+  hits_f.Close();
       
   reader.Close();
   writer.Close();
-  arp_f.close();
+  arp_f.Close();
+  bp_f.Close();
+  unmapped_f.Close();
 
   print_stats(BAMSTATS);
 
@@ -823,10 +668,7 @@ int main (int argc, char *argv[]) {
 } //main
 
 inline string int2str(unsigned int i){
-  string s;
-  stringstream ss(s);
-  ss << i;
-  return ss.str();
+  return uint_text(i);
 }
 
 inline void splitstring(const string &str, vector<string> &elements, const string &delimiter) {
@@ -841,6 +683,503 @@ inline void splitstring(const string &str, vector<string> &elements, const strin
 }
 
 
+inline void write_flanks(const string &genome, const string &variants, const string &flanks, bool snvCheck, const KmerIndex *kmers, unsigned int maxdist, map<string, bool> &verdicts) {
+
+  // 50 bp either side of each variant with the alt put in (as readsFlankingVariants.pl)
+  // with a kmer index the flank is checked right here, the fasta is then only written when asked for
+  FastaIndex fasta;
+  if ( !fasta.Open(genome) ) {
+    cerr << "Could not open the genome fasta " << genome << endl;
+    exit(1);
+  }
+  ifstream var_f(variants.c_str());
+  if ( !var_f.is_open() ) {
+    cerr << "Could not open the variant file " << variants << endl;
+    exit(1);
+  }
+  FILE *out_f = NULL;
+  if ( flanks == "-" || (flanks == "" && kmers == NULL) ) out_f = stdout;
+  else if ( flanks != "" )                               out_f = fopen(flanks.c_str(), "w");
+  if ( out_f == NULL && (flanks != "" || kmers == NULL) ) {
+    cerr << "Could not open the flank output " << flanks << endl;
+    exit(1);
+  }
+
+  string line;
+  string seq;
+  string window;
+  string record;
+  vector <string> cols;
+  while ( getline(var_f, line) ) {
+    if ( line.empty() || line[0] == '#' || line[0] == '@' || line.compare(0, 4, "chr\t") == 0 ) continue;
+    cols.clear();
+    string::size_type from = 0;
+    while ( cols.size() < 5 ) {                      // empty columns are kept (perl split /\t/)
+      string::size_type tab = line.find('\t', from);
+      cols.push_back(line.substr(from, tab - from));
+      if ( tab == string::npos ) break;
+      from = tab + 1;
+    }
+    if ( cols.size() < 5 ) continue;
+
+    string chr = (cols[0].compare(0, 3, "chr") == 0) ? cols[0].substr(3) : cols[0];
+    long pos = atol(cols[1].c_str());
+    string ref = cols[3];
+    string alt = cols[4];
+    if ( ref.find_first_of("ACGT-") == string::npos ) continue;
+    string::size_type dash = ref.find('-');
+    if ( dash != string::npos ) ref.erase(dash, 1);
+    dash = alt.find('-');
+    if ( dash != string::npos ) alt.erase(dash, 1);
+
+    long lengthRef = ref.size();
+    long add = (lengthRef == 0) ? 0 : 1;
+    if ( !fasta.Fetch(chr, pos - (50 + add), 100 + lengthRef, seq) ) {
+      cerr << "flank: chromosome " << chr << " is not in the genome, skipped " << chr << ":" << pos << endl;
+      continue;
+    }
+    if ( (long)seq.size() < 50 + lengthRef ) {
+      cerr << "flank: window out of the chromosome, skipped " << chr << ":" << pos << endl;
+      continue;
+    }
+    string realref = seq.substr(50, 1);
+    if ( snvCheck == true && realref != ref ) {
+      cerr << "shit_not_same_ref\t" << chr << "\t" << pos << "\t" << ref << "\t" << realref << endl;
+    }
+    if ( kmers != NULL ) window = seq;
+    seq.replace(50, lengthRef, alt);
+
+    if ( kmers != NULL && flank_paralog(*kmers, seq, window, lengthRef, alt.size(), maxdist) ) {
+      verdicts[flank_key(chr, cols[1])] = true;
+    }
+    if ( out_f == NULL ) continue;
+    record = ">" + chr + ":" + cols[1] + "\n";
+    record += seq;
+    record += '\n';
+    fwrite(record.data(), 1, record.size(), out_f);
+  }
+
+  if ( out_f == stdout )    fflush(out_f);
+  else if ( out_f != NULL ) fclose(out_f);
+
+}
+
+
+inline void record_info(BamAlignment &bam, const RefVector &refs, const string &type, unsigned int cliplen, struct RecordInfo &info, LineWriter *bp_out) {
+
+  // uniqueness, alignment span and insertions of one record, the breakpoint line for chimeric unique reads
+  info.unique = 0;
+  info.jc = false;
+  info.chrom = "SRP";
+  info.strand = "+";
+  info.alignmentStart = 0;
+  info.alignmentEnd = 0;
+  info.insertions.clear();
+
+  unsigned int &unique = info.unique;
+  string XS = "SRP";
+  bool &jc = info.jc;
+  bool chimeric = false;
+  string cliptype = "N";
+  bool hoe = true;                               //true is head
+  string mateStatus = "p";                       //'w' hints breakpoints
+  unsigned int breakpoint = 0;
+  string &chrom = info.chrom;
+  string &strand = info.strand;
+  unsigned int &alignmentStart = info.alignmentStart;
+  unsigned int &alignmentEnd = info.alignmentEnd;
+  unsigned int cigarEnd;
+  vector <int> blockLengths;
+  vector <int> blockStarts;
+  string mateChr = "SRP";
+  unsigned int matePos = 0;
+  map<unsigned int, unsigned int> &insertions = info.insertions;       // for insertions 
+  unsigned int softClip = 0; 
+
+
+  if ( bam.IsMapped() == true) {
+
+    bam.GetTag("NH", unique);                     // uniqueness
+
+    blockStarts.push_back(0);
+    ParseCigar(bam.CigarData, blockStarts, blockLengths, cigarEnd, jc, chimeric, hoe, cliptype, cliplen, insertions, softClip); 
+
+    chrom  = refs.at(bam.RefID).RefName;          // chromosome
+    if (bam.IsReverseStrand()) strand = "-";      // strand -
+    alignmentStart = bam.Position+1;              // start
+    alignmentEnd   = bam.GetEndPosition();        // end
+
+    if ( unique == 1 ) {                            // check breakpoint reads
+
+      if (chimeric == true) {
+
+        if (type == "p"){
+          if ( bam.IsMateMapped() == true){
+            mateChr = refs.at(bam.MateRefID).RefName;
+            matePos = bam.MatePosition;
+            int mateDistance = matePos-alignmentStart;
+            if (mateChr != chrom || abs(mateDistance) > 230000) 
+              mateStatus = "w";
+          }
+        }
+
+        if (hoe  == false) {
+          breakpoint =  alignmentStart;
+        }
+        else if (hoe == true) {
+          vector<int>::iterator bsiter = blockStarts.end();
+          vector<int>::iterator bliter = blockLengths.end();
+          breakpoint = alignmentStart + *(bsiter-1) + *(bliter-1);
+        }
+        if ( bp_out != NULL ) {
+          *bp_out << chrom << "\t" << breakpoint << "\t" << bam.Name << "\t" << mateStatus << "\t" << cliptype << '\n';
+        }
+      }
+
+    } // check breakpoint reads
+
+  }
+
+}
+
+
+inline void flank_record(BamAlignment &bam, struct RecordInfo &info, struct taginfo &CUR, string &old_frag, struct RseqSTATS &BAMSTATS, LineWriter *hits_out, map<string, bool> &verdicts) {
+
+  // the single-end (flank) counting, the hits of a flank are expected one after the other
+  static const struct taginfo NONE = {"SRP","SRP","SRP",0,0,0,0,UINT_MAX,"SRP",0,0,"none:"};
+  const unsigned int &unique = info.unique;
+  const bool &jc = info.jc;
+  const string &chrom = info.chrom;
+  const string &strand = info.strand;
+  const unsigned int &alignmentStart = info.alignmentStart;
+  const unsigned int &alignmentEnd = info.alignmentEnd;
+  bool dumping = (hits_out != NULL);
+
+  if ( bam.Name != old_frag ) {  // new frag
+
+    ++BAMSTATS.num_Reads;
+    if ( bam.IsMapped() ) { //mapped
+      ++BAMSTATS.num_Mapped;
+      if ( unique == 1 ) ++BAMSTATS.num_Unique;
+      else               ++BAMSTATS.num_Multi;
+    } else { //unmapped
+       ++BAMSTATS.num_Unmapped;
+    }
+    if ( bam.IsDuplicate() ) ++BAMSTATS.num_Duplicates;
+    if (  bam.IsFailedQC() ) ++BAMSTATS.num_FailedQC;
+    if (jc == true)          ++BAMSTATS.num_spliced;
+
+    if (CUR.name != "SRP") close_flank(CUR, hits_out, verdicts);
+    CUR = NONE;
+
+    // mismatch screening
+    unsigned int mismatches = flank_edits(bam, chrom, info.insertions, strand, CUR.mismatches, dumping);
+
+    //if (mismatches == 0) {
+      CUR.name = bam.Name;
+      CUR.chr = chrom;
+      CUR.start = alignmentStart;
+      CUR.end = alignmentEnd;
+      CUR.strand = strand;
+      CUR.bestmis = mismatches;
+      CUR.hits = 1;
+    //} 
+
+    old_frag = bam.Name; // reset old frag
+
+  } else {  // IT IS AN OLD FRAGMENT!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+     
+    // mismatch screening
+    unsigned int mismatches = flank_edits(bam, chrom, info.insertions, strand, CUR.mismatches, dumping);
+
+    if (mismatches <= CUR.bestmis){
+      CUR.times += 1;
+    }
+    if (mismatches < CUR.secondmis) {
+      CUR.secondmis = mismatches;
+      CUR.secondchr = chrom;
+      CUR.secondstart = alignmentStart;
+    }
+    CUR.hits += 1;
+
+  }
+
+}
+
+
+inline void flank_pipeline(BamMultiReader &reader, const RefVector &refs, BamWriter &writer, unsigned int cliplen, const string &type, LineWriter *bp_out, LineWriter *unmapped_out, LineWriter *hits_out, map<string, bool> &verdicts, struct RseqSTATS &BAMSTATS, int threads) {
+
+  // one reader thread cuts the input into batches, only where the read name changes so the hits of a flank
+  // stay in one batch, the workers count whole batches with their own CUR, and this thread writes the
+  // batches back in input order (bounded number in flight)
+  const size_t batch_reads = 4096;
+  const size_t max_batches = 4 * threads;
+  deque < std::shared_ptr<struct FlankBatch> > inflight;     // batches in input order
+  deque < std::shared_ptr<struct FlankBatch> > todo;         // batches waiting for a worker
+  bool reading = true;
+  std::mutex mtx;
+  std::condition_variable space_cv, todo_cv, done_cv;
+
+  std::thread reader_t([&]() {
+    std::shared_ptr<struct FlankBatch> batch(new FlankBatch);
+    BamAlignment bam;
+    while ( reader.GetNextAlignment(bam) ) {
+      if ( batch->reads.size() >= batch_reads && bam.Name != batch->reads.back().Name ) {
+        std::shared_ptr<struct FlankBatch> next(new FlankBatch);
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          while ( inflight.size() >= max_batches ) space_cv.wait(lock);
+          batch->done = false;
+          inflight.push_back(batch);
+          todo.push_back(batch);
+        }
+        todo_cv.notify_one();
+        batch = next;
+      }
+      batch->reads.push_back(bam);
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    if ( !batch->reads.empty() ) {
+      batch->done = false;
+      inflight.push_back(batch);
+      todo.push_back(batch);
+    }
+    reading = false;
+    todo_cv.notify_all();
+    done_cv.notify_all();
+  });
+
+  vector <std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.push_back(std::thread([&]() {
+      while ( true ) {
+        std::shared_ptr<struct FlankBatch> batch;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          while ( todo.empty() && reading == true ) todo_cv.wait(lock);
+          if ( todo.empty() ) return;
+          batch = todo.front();
+          todo.pop_front();
+        }
+        struct RseqSTATS stats = {0,0,0,0,0,0,0,0,0,0,0,0};
+        struct taginfo CUR = {"SRP","SRP","SRP",0,0,0,0,UINT_MAX,"SRP",0,0,"none:"};
+        string old_frag = "SRP";
+        LineWriter bp_ss, unmapped_ss, hits_ss;                   // not opened: the batch text
+        vector <BamAlignment>::iterator rit = batch->reads.begin();
+        for (; rit != batch->reads.end(); ++rit) {
+          struct RecordInfo info;
+          record_info(*rit, refs, type, cliplen, info, (bp_out == NULL) ? NULL : &bp_ss);
+          if ( rit->IsMapped() == false && unmapped_out != NULL ) unmapped_ss << rit->Name << '\n';
+          flank_record(*rit, info, CUR, old_frag, stats, (hits_out == NULL) ? NULL : &hits_ss, batch->verdicts);
+        }
+        if (CUR.name != "SRP") close_flank(CUR, (hits_out == NULL) ? NULL : &hits_ss, batch->verdicts);
+        batch->stats = stats;
+        bp_ss.Take(batch->breakpoints);
+        unmapped_ss.Take(batch->unmapped);
+        hits_ss.Take(batch->hits);
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          batch->done = true;
+        }
+        done_cv.notify_all();
+      }
+    }));
+  }
+
+  while ( true ) {                                     // ordered writer
+    std::shared_ptr<struct FlankBatch> batch;
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      while ( (inflight.empty() && reading == true) || (!inflight.empty() && inflight.front()->done == false) ) done_cv.wait(lock);
+      if ( inflight.empty() ) break;
+      batch = inflight.front();
+      inflight.pop_front();
+    }
+    space_cv.notify_one();
+    vector <BamAlignment>::iterator rit = batch->reads.begin();
+    for (; rit != batch->reads.end(); ++rit) {
+      if ( rit->IsMapped() == true ) writer.SaveAlignment(*rit);      // write mapped tags to a new bam
+    }
+    if ( bp_out != NULL ) *bp_out << batch->breakpoints;
+    if ( unmapped_out != NULL ) *unmapped_out << batch->unmapped;
+    if ( hits_out != NULL ) *hits_out << batch->hits;
+    verdicts.insert(batch->verdicts.begin(), batch->verdicts.end());
+    add_stats(BAMSTATS, batch->stats);
+  }
+
+  reader_t.join();
+  for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+}
+
+
+inline void add_stats(struct RseqSTATS &total, const struct RseqSTATS &part) {
+  total.num_Reads      += part.num_Reads;
+  total.num_Duplicates += part.num_Duplicates;
+  total.num_FailedQC   += part.num_FailedQC;
+  total.num_Mapped     += part.num_Mapped;
+  total.num_Unique     += part.num_Unique;
+  total.num_spliced    += part.num_spliced;
+  total.num_Singletons += part.num_Singletons;
+  total.num_ProperPair += part.num_ProperPair;
+  total.num_WrongPair  += part.num_WrongPair;
+  total.num_Multi      += part.num_Multi;
+  total.num_Unmapped   += part.num_Unmapped;
+  total.num_UniqueHalf += part.num_UniqueHalf;
+}
+
+
+inline bool flank_paralog(const KmerIndex &kmers, const string &flank, const string &window, long lengthRef, long lengthAlt, unsigned int maxdist) {
+
+  // every kmer of the flank is looked up with its neighbours, the one occurrence at the variant's own locus
+  // (the reference kmer at the same place, shifted past an indel) is taken off, what is left occurs elsewhere.
+  // a sampled index sees 1 in Sample() of those, so the flank is a paralog when the kmers seen elsewhere,
+  // scaled up, cover at least half of the flank (a second equally good hit covers all of it)
+  unsigned int k = kmers.K();
+  long positions = 0;
+  long elsewhere = 0;
+  for (long i = 0; i + (long)k <= (long)flank.size(); i++) {
+    uint64_t fwd, rev;
+    if ( !KmerIndex::Encode(flank.data() + i, k, fwd, rev) ) continue;
+    ++positions;
+    unsigned int hits = kmers.Neighbours(fwd, rev, maxdist);
+    if ( hits == 0 ) continue;
+    long j = (i >= 50 + lengthAlt) ? i - lengthAlt + lengthRef : i;
+    uint64_t ofwd, orev;
+    if ( j + (long)k <= (long)window.size() && KmerIndex::Encode(window.data() + j, k, ofwd, orev)
+         && KmerIndex::Distance(fwd, ofwd) <= maxdist && kmers.Count(ofwd < orev ? ofwd : orev) > 0 ) {
+      --hits;
+    }
+    if ( hits > 0 ) ++elsewhere;
+  }
+  return elsewhere > 0 && 2 * elsewhere * kmers.Sample() >= positions;
+
+}
+
+
+inline unsigned int flank_edits(BamAlignment &bam, const string &chrom, map<unsigned int, unsigned int> &insertions, const string &strand, string &positions, bool dumping) {
+
+  //mismatch coordinates (against --genome, else from the MD string), compared with the variants
+  //the positions (read coordinates, I/D marked) are appended to the comma separated list of the flank
+  vector <struct MismatchEvent> events;
+  mismatch_events(ref_mismatch, bam, chrom, events);
+  unsigned int mismatches = 0;
+  unsigned int softClip = 0;                   // the positions count from the first aligned base, as the MD string does
+  if ( !bam.CigarData.empty() && bam.CigarData[0].Type == 'S' ) softClip = bam.CigarData[0].Length;
+
+  map<unsigned int, unsigned int>::iterator inserit_index = insertions.begin();
+  while ( inserit_index != insertions.end() ) {  // check insertions
+    if (dumping) {
+      if (positions == "none:") positions = "";
+      if (strand == "-") {
+        int revcuPosRead =  (bam.Length + 1) - inserit_index->first;
+        positions += int2str(revcuPosRead) + "I:";
+      }
+      else {
+        positions += int2str(inserit_index->first) + "I:";
+      }
+    }
+    mismatches += inserit_index->second;     //should count as mismatches
+    inserit_index++;
+  }
+  for (size_t e = 0; e < events.size(); e++) {
+
+    unsigned int cuPosRead = events[e].readPos - softClip;
+    string mark;
+    if ( events[e].type == 'D' ) {
+      mismatches += events[e].length;                 //deletion*2
+      mark = "D:";
+    } else {                                          // single base nucleotide change
+      mismatches += 1;
+      mark = ":";
+    }
+    if (dumping) {
+      if (positions == "none:") positions = "";
+      if (strand == "-") {
+        int revcuPosRead =  (bam.Length + 1) - cuPosRead;
+        positions += int2str(revcuPosRead) + mark;
+      }
+      else {
+        positions += int2str(cuPosRead) + mark;
+      }
+    }
+
+  } //loop for all events
+  if (dumping) {
+    positions = positions.substr(0, positions.size()-1);
+    positions += ",";
+  }
+
+  return mismatches;
+}
+
+
+inline string flank_key(const string &chr, const string &pos) {   // chr:pos as intersectFiles.pl matches them
+  string c = (chr.compare(0, 3, "chr") == 0) ? chr : "chr" + chr;
+  if (c == "chrMT") c = "chrM";
+  return c + ":" + int2str(atoi(pos.c_str()));
+}
+
+
+inline void close_flank(const struct taginfo &cur, LineWriter *hits_f, map<string, bool> &verdicts) {
+
+  // paralog when another hit is as good, or the best hit is off the chromosome or the variant (as badvariantmapping.pl)
+  string::size_type colon = cur.name.rfind(':');
+  if (colon == string::npos) return;
+  string chr = cur.name.substr(0, colon);
+  string pos = cur.name.substr(colon + 1);
+  string vchr = "chr" + chr;
+  if (vchr.compare(0, 5, "chrMT") == 0) vchr.replace(0, 5, "chrM");
+  int distance = abs(atoi(pos.c_str()) - (int)cur.start);
+
+  bool out = false;
+  if (cur.times > 1)
+    out = true;
+  else if (cur.chr != vchr)
+    out = true;
+  else if (distance > 70 || distance < 30)
+    out = true;
+  if (out == true) verdicts[flank_key(chr, pos)] = true;
+
+  if (hits_f != NULL) {
+    *hits_f << cur.name << "\t" << cur.chr << "\t" << cur.start << "\t" << cur.end << "\t" << cur.strand << "\t" << cur.bestmis << "\t" << cur.times << "\t" << cur.mismatches << "\t";
+    if (cur.hits > 1) *hits_f << cur.secondmis << "\t" << cur.secondchr << ":" << cur.secondstart;
+    else              *hits_f << "NA\tNA";
+    *hits_f << "\t" << cur.hits << '\n';
+  }
+
+}
+
+
+inline void write_paralog(const string &variants, const string &paralog, map<string, bool> &verdicts) {
+
+  // the variant table with the paralog column appended (1: paralog, 0: fine)
+  ifstream var_f(variants.c_str());
+  if ( !var_f.is_open() ) {
+    cerr << "Could not open the variant file " << variants << endl;
+    exit(1);
+  }
+  LineWriter out_f;
+  out_f.Open(paralog);
+  string line;
+  while ( getline(var_f, line) ) {
+    if ( !line.empty() && isspace(line[line.size()-1]) ) line.erase(line.size()-1);
+    if ( line.empty() ) continue;
+    if ( line[0] == '#' || (line.size() > 3 && strncasecmp(line.c_str(), "chr\t", 4) == 0) ) {
+      out_f << line << "\tparalog" << '\n';
+      continue;
+    }
+    string::size_type tab1 = line.find('\t');
+    string::size_type tab2 = (tab1 == string::npos) ? string::npos : line.find('\t', tab1 + 1);
+    if ( tab1 == string::npos ) continue;
+    string key = flank_key(line.substr(0, tab1), line.substr(tab1 + 1, tab2 - tab1 - 1));
+    out_f << line << "\t" << (verdicts.count(key) ? 1 : 0) << '\n';
+  }
+  out_f.Close();
+
+}
+
+
 inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, vector<int> &blockLengths, unsigned int &alignmentEnd, bool &jc, bool &chimeric, bool &hoe, string &cliptype, unsigned int &cliplen, map<unsigned int, unsigned int> &insertions, unsigned int &softClip) {
 
   int currPosition = 0;
@@ -914,7 +1253,7 @@ inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, v
 }
 
 
-inline void print_stats(struct RseqSTATS &rstats) {
+inline void print_stats(struct RseqSTATS & /*rstats*/) {   // the report is switched off
   //cout << "Reads:      " << rstats.num_Reads      << endl;
   //cout << "Mapped:     " << rstats.num_Mapped     << endl;
   //cout << "Unmapped:   " << rstats.num_Unmapped   << endl;
@@ -13,6 +13,17 @@ struct parameters {
   char* arp;
   char* breakpoint;
   unsigned int readlength;
+  char* genome;
+  char* variants;
+  char* flanks;
+  char* paralog;
+  char* hits;
+  char* kmerIndex;
+  char* buildIndex;
+  unsigned int kmer;
+  unsigned int kmerSample;
+  unsigned int kmerDistance;
+  unsigned int threads;
 };
 
 struct parameters* interface(struct parameters* param,int argc, char *argv[]);
@@ -40,6 +51,25 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   param->unmapped = new char; 
   param->arp = new char;
   param->breakpoint = new char;
+  param->genome = new char;
+  param->variants = new char;
+  param->flanks = new char;
+  *param->mapping_f = '\0';
+  *param->genome = '\0';
+  *param->variants = '\0';
+  *param->flanks = '\0';
+  param->paralog = new char;
+  param->hits = new char;
+  *param->paralog = '\0';
+  *param->hits = '\0';
+  param->kmerIndex = new char;
+  param->buildIndex = new char;
+  *param->kmerIndex = '\0';
+  *param->buildIndex = '\0';
+  param->kmer = 24;
+  param->kmerSample = 8;
+  param->kmerDistance = 1;
+  param->threads = 1;
 
   const struct option long_options[] ={
     {"mapping",1,0,'m'},
@@ -50,6 +80,17 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     {"arp",1,0,'a'},
     {"breakpoint",1,0,'b'},
     {"readlength",1,0,'l'},
+    {"genome",1,0,'g'},
+    {"variants",1,0,'v'},
+    {"flanks",1,0,'f'},
+    {"paralog",1,0,'o'},
+    {"hits",1,0,'d'},
+    {"kmerIndex",1,0,'x'},
+    {"buildIndex",1,0,'i'},
+    {"kmer",1,0,'k'},
+    {"kmerSample",1,0,'s'},
+    {"kmerDistance",1,0,'e'},
+    {"threads",1,0,'n'},
     {"help",0,0,'h'},
     {0, 0, 0, 0}
   };
@@ -58,7 +99,7 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   while (1){
 
     int option_index = 0;
-    c = getopt_long_only (argc, argv,"hm:t:p:w:u:a:b:l:",long_options, &option_index);
+    c = getopt_long_only (argc, argv,"hm:t:p:w:u:a:b:l:g:v:f:o:d:x:i:k:s:e:n:",long_options, &option_index);
 
     if (c == -1){
       break;
@@ -91,6 +132,39 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     case 'l':
       param->readlength = atoi(optarg);
       break;
+    case 'g':
+      param->genome = optarg;
+      break;
+    case 'v':
+      param->variants = optarg;
+      break;
+    case 'f':
+      param->flanks = optarg;
+      break;
+    case 'o':
+      param->paralog = optarg;
+      break;
+    case 'd':
+      param->hits = optarg;
+      break;
+    case 'x':
+      param->kmerIndex = optarg;
+      break;
+    case 'i':
+      param->buildIndex = optarg;
+      break;
+    case 'k':
+      param->kmer = atoi(optarg);
+      break;
+    case 's':
+      param->kmerSample = atoi(optarg);
+      break;
+    case 'e':
+      param->kmerDistance = atoi(optarg);
+      break;
+    case 'n':
+      param->threads = atoi(optarg);
+      break;
     case 'h':
       help = 1;
       break;
@@ -126,6 +200,26 @@ void usage()
   fprintf(stdout, "-b --breakpoint  the file for output of potential breakpoint.\n");
   fprintf(stdout, "-l --readlength  the length of the reads.\n");
   fprintf(stdout, "-t --type        (p)aired-end or (s)ingle-end.\n");
+  fprintf(stdout, "-n --threads     (type s, name grouped) the hits are cut into batches at read name boundaries and counted\n");
+  fprintf(stdout, "                 on this many threads, output in input order as with one thread (default 1).\n");
+  fprintf(stdout, "-v --variants    variant table (chr pos id ref alt ...) of the flanks.\n");
+  fprintf(stdout, "-g --genome      (with --mapping) the flank hits' mismatches are found against this fasta, no MD tag needed.\n");
+  fprintf(stdout, "-o --paralog     (type s, with --variants) the variant table with a paralog column: 1 when the flank has an equally\n");
+  fprintf(stdout, "                 good other hit, maps to another chromosome or away from the variant, else 0.\n");
+  fprintf(stdout, "-d --hits        debug: one line per flank (best hit, hits as good, mismatch positions, second best edits, hits),\n");
+  fprintf(stdout, "                 - is stdout (default stdout when --paralog is not given).\n");
+  fprintf(stdout, "\nflank mode (instead of the mapping stats):\n");
+  fprintf(stdout, "-g --genome      reference fasta, read through its .fai (built in memory when missing).\n");
+  fprintf(stdout, "-v --variants    variant table, one alt-substituted 100 bp flank per variant.\n");
+  fprintf(stdout, "-f --flanks      the flank fasta output, - is stdout (e.g. for bowtie2 -f -) (default stdout).\n");
+  fprintf(stdout, "                 with --type snv the reference base of each variant is checked against the genome.\n");
+  fprintf(stdout, "-x --kmerIndex   decide the paralog flanks by kmer lookups instead of mapping them: --paralog gets the variant\n");
+  fprintf(stdout, "                 table with the paralog column (1 when half of the flank's kmers occur elsewhere), no fasta\n");
+  fprintf(stdout, "                 unless --flanks is given.\n");
+  fprintf(stdout, "-e --kmerDistance  kmers within this Hamming distance (0, 1 or 2) count as occurrences (default 1).\n");
+  fprintf(stdout, "-i --buildIndex  write the kmer index of --genome to this file (once per genome) and exit.\n");
+  fprintf(stdout, "-k --kmer        kmer length of the index, 11 to 28 (default 24).\n");
+  fprintf(stdout, "-s --kmerSample  keep 1 in this many kmers (by hash) in the index (default 8, about 2.5 GB for hg38).\n");
   fprintf(stdout, "\n");
 }
 
@@ -139,5 +233,12 @@ void delete_param(struct parameters* param)
   delete(param->unmapped);
   delete(param->arp);
   delete(param->breakpoint);
+  delete(param->genome);
+  delete(param->variants);
+  delete(param->flanks);
+  delete(param->paralog);
+  delete(param->hits);
+  delete(param->kmerIndex);
+  delete(param->buildIndex);
   delete(param);
 }
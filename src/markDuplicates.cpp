@@ -0,0 +1,908 @@
+/*****************************************************************************
+
+  markDuplicates.cpp
+  duplicate marking of a coordinate sorted bam in one streaming pass, the
+  flags and the metrics file as Picard MarkDuplicates writes them
+
+  the records wait in a short output window while their duplicate sets
+  fill up: fragments are keyed by library, unclipped 5' end and strand,
+  pairs by the 5' ends and orientation of both mates. a set is decided
+  once the input has moved past its upper 5' end (by a read length), the
+  best scored member (sum of the base qualities >= 15 of both mates) is
+  kept, ties go by read name, tile, x, y and the index in the file as in
+  Picard, single ends at the position of a pair are duplicates. the first
+  mate of a pair farther apart than the window is written at once with
+  the flag cleared and waits by its mate's position (spilled to sorted
+  run files beyond the memory cap); its mate makes the pair with the real
+  5' ends and scores, and the first mates found duplicate get the flag by
+  a patch of the written bam, where only the bgzf blocks holding them are
+  inflated and deflated again. secondary, supplementary and unmapped
+  records are not marked, as Picard does for coordinate sorted input.
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+g++ -std=c++11 -pthread markDuplicates.cpp -I/home/ruping/ruping/tools/bamtools/include/bamtools/ -I/home/ruping/ruping/tools/zlib/current/include/ -L/home/ruping/ruping/tools/bamtools/lib64/ -L/home/ruping/ruping/tools/zlib/current/lib/ -lbamtools -lz -o markDuplicates
+
+******************************************************************************/
+
+#include <api/BamAlignment.h>
+#include <api/BamAux.h>
+
+using namespace BamTools;
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <climits>
+#include <cmath>
+#include <ctime>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include "markDuplicates.h"
+#include "bgzf_reader.h"
+#include "bgzf_writer.h"
+#include "dup_sketch.h"
+using namespace std;
+
+
+struct DupLibrary {      // the DuplicationMetrics row of a library
+  string name;
+  unsigned long long unpaired;
+  unsigned long long pairedRecords;        // primary mapped records with a mapped mate, two per pair
+  unsigned long long secondary;
+  unsigned long long unmapped;
+  unsigned long long unpairedDups;
+  unsigned long long pairDups;
+  unsigned long long opticalDups;
+};
+
+struct EndInfo {         // a primary mapped record, as the duplicate sets need it
+  uint64_t index;        // in the output window
+  unsigned int lib;
+  int refID;
+  int position;
+  long five;             // unclipped 5' end
+  bool reverse;
+  int score;
+  int mateRefID;
+  int matePosition;
+  string name;
+  string rg;
+};
+
+struct FarEnd {          // a first mate written already, waiting for its mate beyond the window
+  uint64_t index;
+  int refID;
+  long five;
+  bool reverse;
+  int score;
+  uint64_t flagAt;       // block << 16 | offset of its upper flag byte in the output, for the patch
+  string name;
+  string rg;
+};
+
+struct PairEnds {        // a pair in a duplicate set
+  uint64_t index1;
+  uint64_t index2;
+  bool far;              // the first mate is written already, a duplicate gets its flag by the patch
+  int score;
+  uint64_t flagAt;
+  string name;
+  string rg;
+};
+
+struct PairKey {         // ordered by the upper 5' end, the set is complete once the input is past it
+  int ref1;
+  long five1;
+  unsigned int lib;
+  int orient;            // strands of the lower and the upper end
+  int ref2;
+  long five2;
+  bool operator<(const PairKey &o) const {
+    if ( ref2 != o.ref2 )   return ref2 < o.ref2;
+    if ( five2 != o.five2 ) return five2 < o.five2;
+    if ( ref1 != o.ref1 )   return ref1 < o.ref1;
+    if ( five1 != o.five1 ) return five1 < o.five1;
+    if ( lib != o.lib )     return lib < o.lib;
+    return orient < o.orient;
+  }
+};
+
+struct FragKey {
+  int ref;
+  long five;
+  unsigned int lib;
+  bool reverse;
+  bool operator<(const FragKey &o) const {
+    if ( ref != o.ref )   return ref < o.ref;
+    if ( five != o.five ) return five < o.five;
+    if ( lib != o.lib )   return lib < o.lib;
+    return reverse < o.reverse;
+  }
+};
+
+struct FragEnd {         // a single end in a fragment set
+  uint64_t index;
+  int score;
+  string name;
+};
+
+struct FragSet {
+  vector <struct FragEnd> ends;
+  bool paired;                             // an end of a pair has this 5' end too
+};
+
+struct WindowRecord {    // a record waiting for its duplicate decision
+  string raw;
+  bool pending;
+  bool dup;
+  bool far;              // a first mate whose mate is beyond the window
+};
+
+
+inline int base_score(const string &raw);
+inline bool raw_string_tag(const string &raw, const char *tag, string &value);
+inline bool read_location(const string &name, int &tile, int &x, int &y);
+inline bool picard_before(const string &nameA, uint64_t indexA, const string &nameB, uint64_t indexB);
+inline void patch_block(string &blk, const vector <size_t> &offsets, int level);
+inline void patch_flags(const string &from, const string &to, vector <uint64_t> &places, int level, unsigned int threads);
+inline void write_metrics(const string &file, const string &command, const vector <struct DupLibrary> &libs);
+
+
+class FarMates {
+
+  // first mates of the far pairs, kept by the position their mate will show up at; beyond the memory cap
+  // they are written to a run file sorted the same way, and the runs are read back as the input reaches
+  // their positions
+
+ public:
+  FarMates(size_t capMB, const string &dir) : cap(capMB * 1048576), bytes(0), spilled(false) {
+    prefix = (dir == "") ? "." : dir;
+    stringstream ss;
+    ss << prefix << "/markDuplicates." << getpid() << ".mates.";
+    prefix = ss.str();
+  }
+
+  ~FarMates() {
+    for (size_t r = 0; r < runs.size(); r++) {
+      delete runs[r].in;
+      remove(run_file(r).c_str());
+    }
+  }
+
+  void Add(int refID, int position, const struct FarEnd &end) {
+    mates.insert( pair < pair <int, int>, struct FarEnd > (make_pair(refID, position), end) );
+    bytes += end_bytes(end);
+    if ( bytes > cap ) spill();
+  }
+
+  bool Take(int refID, int position, const string &name, struct FarEnd &end) {   // the first mate of the record at this position
+    pair <int, int> at(refID, position);
+    load(at);
+    while ( !mates.empty() && mates.begin()->first < at ) {   // mates that never came
+      bytes -= end_bytes(mates.begin()->second);
+      mates.erase(mates.begin());
+    }
+    multimap < pair <int, int>, struct FarEnd >::iterator it = mates.lower_bound(at);
+    for (; it != mates.end() && it->first == at; ++it) {
+      if ( it->second.name != name ) continue;
+      end = it->second;
+      bytes -= end_bytes(end);
+      mates.erase(it);
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  struct run {
+    ifstream *in;
+    pair <int, int> at;
+    struct FarEnd end;
+    bool live;
+  };
+
+  size_t cap;
+  size_t bytes;
+  bool spilled;
+  string prefix;
+  multimap < pair <int, int>, struct FarEnd > mates;
+  vector <struct run> runs;
+
+  size_t end_bytes(const struct FarEnd &end) {
+    return end.name.size() + end.rg.size() + 128;
+  }
+
+  string run_file(size_t r) {
+    stringstream ss;
+    ss << prefix << r;
+    return ss.str();
+  }
+
+  void spill() {
+    if ( spilled == false ) cerr << "far mates: over " << cap/1048576 << " MB, the waiting first mates are spilled to " << prefix << "*" << endl;
+    spilled = true;
+    string file = run_file(runs.size());
+    ofstream out_f(file.c_str());
+    if ( !out_f.is_open() ) {
+      cerr << "far mates ERROR: could not open spill file " << file << endl;
+      exit(1);
+    }
+    multimap < pair <int, int>, struct FarEnd >::iterator it = mates.begin();
+    for (; it != mates.end(); ++it) {
+      const struct FarEnd &e = it->second;
+      out_f << it->first.first << "\t" << it->first.second << "\t" << e.index << "\t" << e.refID << "\t" << e.five << "\t" << e.reverse
+            << "\t" << e.score << "\t" << e.flagAt << "\t" << e.name << "\t" << e.rg << "\n";      // the read group last, it may be empty
+    }
+    out_f.close();
+    mates.clear();
+    bytes = 0;
+    struct run r;
+    r.in = new ifstream(file.c_str());
+    r.live = true;
+    runs.push_back(r);
+    advance(runs.back());
+  }
+
+  void advance(struct run &r) {
+    struct FarEnd &e = r.end;
+    if ( !(*r.in >> r.at.first >> r.at.second >> e.index >> e.refID >> e.five >> e.reverse >> e.score >> e.flagAt >> e.name) ) {
+      r.live = false;
+      return;
+    }
+    r.in->get();
+    getline(*r.in, e.rg);
+  }
+
+  void load(const pair <int, int> &at) {
+    for (size_t i = 0; i < runs.size(); i++) {
+      while ( runs[i].live == true && !(at < runs[i].at) ) {
+        if ( runs[i].at == at ) mates.insert( pair < pair <int, int>, struct FarEnd > (at, runs[i].end) );
+        advance(runs[i]);
+      }
+    }
+  }
+
+};
+
+
+class DuplicateMarker {
+
+ public:
+  DuplicateMarker(const string &header, BgzfWriter &out, unsigned int win, unsigned int optical, size_t capMB, const string &dir)
+    : writer(out), window(win), margin(500), opticalDistance(optical), base(0), lastRef(-1), lastPos(-1), unplaced(false), far(capMB, dir) {
+    istringstream lines(header);                     // read group -> library, Picard's name when LB is missing
+    string line;
+    while ( getline(lines, line) ) {
+      if ( line.compare(0, 4, "@RG\t") != 0 ) continue;
+      string id, lb = "Unknown Library";
+      istringstream fields(line);
+      string field;
+      while ( getline(fields, field, '\t') ) {
+        if ( field.compare(0, 3, "ID:") == 0 ) id = field.substr(3);
+        if ( field.compare(0, 3, "LB:") == 0 ) lb = field.substr(3);
+      }
+      if ( id != "" ) rgName[id] = lb;
+    }
+  }
+
+  void Add(const string &raw) {
+
+    BamAlignment bam;
+    raw_core(raw, bam);
+    if ( bam.RefID < 0 ) {
+      unplaced = true;
+    } else if ( unplaced == true || bam.RefID < lastRef || (bam.RefID == lastRef && bam.Position < lastPos) ) {
+      cerr << "markDuplicates ERROR: the input is not sorted by coordinate (at " << raw.data() + 32 << ")" << endl;
+      exit(1);
+    } else {
+      lastRef = bam.RefID;
+      lastPos = bam.Position;
+    }
+    resolve((bam.RefID < 0) ? INT_MAX : bam.RefID, bam.Position);
+
+    struct WindowRecord rec = {raw, false, false, false};
+    records.push_back(rec);
+    uint64_t index = base + records.size() - 1;
+
+    string rg;
+    raw_string_tag(raw, "RG", rg);
+    unsigned int lib = library_of(rg);
+
+    if ( bam.IsMapped() == false ) {
+      ++libs[lib].unmapped;
+    } else if ( bam.IsPrimaryAlignment() == false || (bam.AlignmentFlag & 0x800) ) {
+      ++libs[lib].secondary;
+    } else {
+
+      struct EndInfo end;
+      end.index = index;
+      end.lib = lib;
+      end.refID = bam.RefID;
+      end.position = bam.Position;
+      end.reverse = bam.IsReverseStrand();
+      end.five = DupSketches::FivePrime(bam.Position, bam.CigarData, end.reverse);
+      end.score = base_score(raw);
+      end.name = raw.data() + 32;
+      end.rg = rg;
+      unsigned int clipped = bam.Length;
+      for (size_t i = 0; i < bam.CigarData.size(); i++) {
+        if ( bam.CigarData[i].Type == 'H' ) clipped += bam.CigarData[i].Length;
+      }
+      if ( clipped > margin ) margin = clipped;
+
+      bool paired = ( bam.IsPaired() == true && bam.IsMateMapped() == true );
+      struct FragKey fkey = {end.refID, end.five, lib, end.reverse};
+      map <struct FragKey, struct FragSet>::iterator fit = frags.find(fkey);
+      if ( fit == frags.end() ) {
+        struct FragSet empty;
+        empty.paired = false;
+        fit = frags.insert( pair <struct FragKey, struct FragSet> (fkey, empty) ).first;
+      }
+
+      if ( paired == false ) {                       // a single end (unpaired or mate unmapped)
+        ++libs[lib].unpaired;
+        struct FragEnd single = {index, end.score, end.name};
+        fit->second.ends.push_back(single);
+        records.back().pending = true;
+      } else {
+        ++libs[lib].pairedRecords;
+        fit->second.paired = true;
+        end.mateRefID = bam.MateRefID;
+        end.matePosition = bam.MatePosition;
+
+        unordered_map <string, struct EndInfo>::iterator oit = open.find(end.name);
+        struct FarEnd first;
+        if ( oit != open.end() ) {                   // the second mate of a pair in the window
+          pair_window(oit->second, end);
+          open.erase(oit);
+        } else if ( bam.MateRefID < bam.RefID || (bam.MateRefID == bam.RefID && bam.MatePosition < bam.Position) ) {
+          oit = waiting.find(end.name);
+          if ( oit != waiting.end() ) {              // its far first mate is not written yet, it waits for the set again
+            records[oit->second.index - base].pending = true;
+            records[oit->second.index - base].far = false;
+            pair_window(oit->second, end);
+            waiting.erase(oit);
+          } else if ( far.Take(bam.RefID, bam.Position, end.name, first) ) {   // the second mate of a far pair
+            struct PairEnds p = {first.index, index, true, first.score + end.score, first.flagAt, end.name, first.rg};
+            add_pair(first.refID, first.five, first.reverse, end.refID, end.five, end.reverse, lib, p);
+            records.back().pending = true;
+          }
+        } else if ( bam.MateRefID == bam.RefID && bam.MatePosition - bam.Position <= (int)window ) {
+          open.insert( pair <string, struct EndInfo> (end.name, end) );
+          openOrder.push_back( make_pair(end.name, index) );
+          records.back().pending = true;
+        } else {                                     // written with the flag cleared, waits for its mate
+          waiting.insert( pair <string, struct EndInfo> (end.name, end) );
+          records.back().far = true;
+        }
+      }
+
+    }
+
+    emit();
+
+  }
+
+  void Finish() {
+    resolve(INT_MAX, 0);
+    emit();
+    if ( !records.empty() ) {
+      cerr << "markDuplicates ERROR: " << records.size() << " records left undecided" << endl;
+      exit(1);
+    }
+  }
+
+  vector <struct DupLibrary> libs;
+  vector <uint64_t> patches;                         // flag bytes of the far first mates found duplicate
+
+ private:
+  BgzfWriter &writer;
+  unsigned int window;
+  unsigned int margin;                               // longest read with its clips, bounds a 5' end's distance to its start
+  unsigned int opticalDistance;
+  deque <struct WindowRecord> records;
+  uint64_t base;                                     // window index of records.front()
+  int lastRef;
+  int lastPos;
+  bool unplaced;
+  map <string, unsigned int> libIndex;
+  unordered_map <string, string> rgName;             // read group -> library name, from the header
+  unordered_map <string, unsigned int> rgLibrary;    // read group -> library, as the reads show up
+  map <struct PairKey, vector <struct PairEnds> > pairs;
+  map <struct FragKey, struct FragSet> frags;
+  unordered_map <string, struct EndInfo> open;      // first mates waiting for their mate in the window
+  deque < pair <string, uint64_t> > openOrder;
+  unordered_map <string, struct EndInfo> waiting;   // far first mates not written yet
+  FarMates far;
+
+  unsigned int library(const string &name) {
+    map <string, unsigned int>::iterator it = libIndex.find(name);
+    if ( it != libIndex.end() ) return it->second;
+    struct DupLibrary lib = {name, 0, 0, 0, 0, 0, 0, 0};
+    libs.push_back(lib);
+    libIndex[name] = libs.size() - 1;
+    return libs.size() - 1;
+  }
+
+  unsigned int library_of(const string &rg) {       // libraries get their metrics row once a read shows up, as in Picard
+    unordered_map <string, unsigned int>::iterator it = rgLibrary.find(rg);
+    if ( it != rgLibrary.end() ) return it->second;
+    unordered_map <string, string>::iterator nit = rgName.find(rg);
+    unsigned int lib = library( (nit != rgName.end()) ? nit->second : "Unknown Library" );
+    rgLibrary[rg] = lib;
+    return lib;
+  }
+
+  void add_pair(int refA, long fiveA, bool revA, int refB, long fiveB, bool revB, unsigned int lib, const struct PairEnds &p) {
+    if ( refB < refA || (refB == refA && (fiveB < fiveA || (fiveB == fiveA && revA == true && revB == false))) ) {
+      swap(refA, refB);
+      swap(fiveA, fiveB);
+      swap(revA, revB);
+    }
+    struct PairKey key = {refA, fiveA, lib, (revA ? 2 : 0) + (revB ? 1 : 0), refB, fiveB};
+    pairs[key].push_back(p);
+  }
+
+  void pair_window(const struct EndInfo &first, const struct EndInfo &second) {   // both mates are in the window
+    struct PairEnds p = {first.index, second.index, false, first.score + second.score, 0, second.name, first.rg};
+    add_pair(first.refID, first.five, first.reverse, second.refID, second.five, second.reverse, second.lib, p);
+    records[second.index - base].pending = true;
+  }
+
+  void resolve(int refID, int position) {
+
+    // first mates whose mate did not come within the window wait for it as far first mates
+    while ( !openOrder.empty() ) {
+      unordered_map <string, struct EndInfo>::iterator oit = open.find(openOrder.front().first);
+      if ( oit != open.end() && oit->second.index == openOrder.front().second ) {
+        if ( oit->second.refID == refID && (long)position <= (long)oit->second.position + window + margin ) break;
+        struct WindowRecord &rec = records[oit->second.index - base];
+        rec.pending = false;
+        rec.far = true;
+        waiting.insert(*oit);
+        open.erase(oit);
+      }
+      openOrder.pop_front();
+    }
+
+    // the sets the input has moved past, no more pairs can join them
+    while ( !pairs.empty() ) {
+      map <struct PairKey, vector <struct PairEnds> >::iterator pit = pairs.begin();
+      if ( pit->first.ref2 == refID && (long)position <= pit->first.five2 + margin ) break;
+      decide_pairs(pit->first, pit->second);
+      pairs.erase(pit);
+    }
+    while ( !frags.empty() ) {
+      map <struct FragKey, struct FragSet>::iterator fit = frags.begin();
+      if ( fit->first.ref == refID && (long)position <= fit->first.five + margin ) break;
+      decide_frags(fit->first, fit->second);
+      frags.erase(fit);
+    }
+
+  }
+
+  void decide_pairs(const struct PairKey &key, vector <struct PairEnds> &set) {
+
+    // the best score is kept, on a tie the first in Picard's order; the optical ones among the set counted
+    size_t best = 0;
+    for (size_t i = 1; i < set.size(); i++) {
+      if ( set[i].score > set[best].score
+           || (set[i].score == set[best].score && picard_before(set[i].name, set[i].index1, set[best].name, set[best].index1)) ) best = i;
+    }
+    for (size_t i = 0; i < set.size(); i++) {
+      release(set[i], i != best);
+      if ( i != best ) ++libs[key.lib].pairDups;
+    }
+    if ( set.size() < 2 || set.size() > 300000 ) return;
+
+    vector <bool> located(set.size(), false);
+    vector <int> tile(set.size()), x(set.size()), y(set.size());
+    for (size_t i = 0; i < set.size(); i++) located[i] = read_location(set[i].name, tile[i], x[i], y[i]);
+    vector <bool> optical(set.size(), false);
+    for (size_t i = 0; i < set.size(); i++) {
+      if ( located[i] == false ) continue;
+      for (size_t j = i + 1; j < set.size(); j++) {
+        if ( located[j] == false || optical[j] == true || set[i].rg != set[j].rg || tile[i] != tile[j] ) continue;
+        if ( abs(x[i] - x[j]) <= (int)opticalDistance && abs(y[i] - y[j]) <= (int)opticalDistance ) optical[j] = true;
+      }
+    }
+    for (size_t j = 0; j < set.size(); j++) {
+      if ( optical[j] == true ) ++libs[key.lib].opticalDups;
+    }
+
+  }
+
+  void decide_frags(const struct FragKey &key, struct FragSet &set) {
+
+    // single ends at the 5' end of a pair are all duplicates, else the best score is kept (Picard's order on a tie)
+    size_t best = 0;
+    for (size_t i = 1; i < set.ends.size(); i++) {
+      const struct FragEnd &e = set.ends[i];
+      if ( e.score > set.ends[best].score
+           || (e.score == set.ends[best].score && picard_before(e.name, e.index, set.ends[best].name, set.ends[best].index)) ) best = i;
+    }
+    for (size_t i = 0; i < set.ends.size(); i++) {
+      bool dup = ( set.paired == true || i != best );
+      mark(set.ends[i].index, dup);
+      if ( dup == true ) ++libs[key.lib].unpairedDups;
+    }
+
+  }
+
+  void release(const struct PairEnds &p, bool dup) {
+    mark(p.index2, dup);
+    if ( p.far == false ) {
+      mark(p.index1, dup);
+    } else if ( dup == true ) {
+      patches.push_back(p.flagAt);
+    }
+  }
+
+  void mark(uint64_t index, bool dup) {
+    struct WindowRecord &rec = records[index - base];
+    rec.pending = false;
+    rec.dup = dup;
+  }
+
+  uint64_t flag_place() {                            // the upper flag byte of the record written next (block_size, then 15 bytes)
+    uint64_t block;
+    size_t offset;
+    writer.Tell(block, offset);
+    offset += 4 + 15;
+    block += offset / bgzf_block_data;               // the blocks after the header are all full
+    offset %= bgzf_block_data;
+    return (block << 16) | offset;
+  }
+
+  void emit() {                                      // the decided records at the front, flag 0x400 set or cleared
+    while ( !records.empty() && records.front().pending == false ) {
+      struct WindowRecord &rec = records.front();
+      if ( rec.far == true ) {                       // a far first mate waits for its mate with the place of its flag
+        unordered_map <string, struct EndInfo>::iterator wit = waiting.find(rec.raw.data() + 32);
+        if ( wit != waiting.end() && wit->second.index == base ) {
+          const struct EndInfo &e = wit->second;
+          struct FarEnd first = {e.index, e.refID, e.five, e.reverse, e.score, flag_place(), e.name, e.rg};
+          far.Add(e.mateRefID, e.matePosition, first);
+          waiting.erase(wit);
+        }
+      }
+      uint16_t flag;
+      memcpy(&flag, &rec.raw[14], 2);
+      raw_patch_flag(rec.raw, rec.dup ? (flag | 0x400) : (flag & ~0x400));
+      writer.SaveRaw(rec.raw);
+      records.pop_front();
+      ++base;
+    }
+  }
+
+};
+
+
+int main (int argc, char *argv[]) {
+
+  struct parameters *param = 0;
+  param = interface(param, argc, argv);
+
+  string input = param->input;
+  string output = param->output;
+  string metrics = param->metrics;
+  if ( input == "" || output == "" ) {
+    cerr << "markDuplicates needs --input and --output" << endl;
+    exit(1);
+  }
+
+  string command = argv[0];
+  for (int i = 1; i < argc; i++) command += string(" ") + argv[i];
+
+  BgzfReader reader;
+  if ( !reader.Open(input) ) {
+    cerr << "Could not open the input bam " << input << endl;
+    exit(1);
+  }
+  string header = reader.GetHeaderText();
+  RefVector refs = reader.GetReferenceData();
+  if ( header.find("SO:queryname") != string::npos || header.find("SO:unsorted") != string::npos ) {
+    cerr << "markDuplicates ERROR: " << input << " is not sorted by coordinate" << endl;
+    exit(1);
+  }
+  if ( header.find("@PG\tID:markDuplicates\t") == string::npos ) {
+    if ( header != "" && header[header.size()-1] != '\n' ) header += "\n";
+    header += "@PG\tID:markDuplicates\tPN:markDuplicates\tCL:" + command + "\n";
+  }
+
+  // the far first mates found duplicate get their flag by a patch of the written bam, a bam for
+  // stdout is written to the spill directory first
+  string written = output;
+  if ( output == "-" ) {
+    stringstream ss;
+    ss << ((*param->spillDir == '\0') ? "." : param->spillDir) << "/markDuplicates." << getpid() << ".bam";
+    written = ss.str();
+  }
+
+  BgzfWriter writer;
+  writer.SetCompressionLevel(param->clevel);
+  if ( !writer.Open(written, header, refs, param->threads) ) {
+    cerr << "Could not open output BAM file" << endl;
+    exit(1);
+  }
+
+  DuplicateMarker marker(header, writer, param->window, param->opticalDistance, param->cacheMB, param->spillDir);
+  string raw;
+  while ( reader.Next(raw) ) {
+    marker.Add(raw);
+  }
+  marker.Finish();
+
+  reader.Close();
+  writer.Close();
+
+  if ( output == "-" ) {
+    patch_flags(written, output, marker.patches, param->clevel, param->threads);
+    remove(written.c_str());
+  } else if ( !marker.patches.empty() ) {
+    string patched = output + ".patch";
+    patch_flags(output, patched, marker.patches, param->clevel, param->threads);
+    if ( rename(patched.c_str(), output.c_str()) != 0 ) {
+      cerr << "markDuplicates ERROR: could not move " << patched << " to " << output << endl;
+      exit(1);
+    }
+  }
+
+  if ( metrics != "" ) write_metrics(metrics, command, marker.libs);
+
+  return 0;
+} //main
+
+
+inline int base_score(const string &raw) {
+
+  // Picard's SUM_OF_BASE_QUALITIES: the qualities of 15 and above
+  const char *p = raw.data();
+  uint16_t ncigar;
+  memcpy(&ncigar, p + 12, 2);
+  int32_t lseq;
+  memcpy(&lseq, p + 16, 4);
+  const unsigned char *qual = (const unsigned char *)(p + 32 + (unsigned char)p[8] + 4*ncigar + (lseq + 1)/2);
+  if ( lseq <= 0 || qual[0] == 0xff ) return 0;
+  int score = 0;
+  for (int32_t i = 0; i < lseq; i++) {
+    if ( qual[i] >= 15 ) score += qual[i];
+  }
+  return (score > SHRT_MAX / 2) ? SHRT_MAX / 2 : score;
+
+}
+
+
+inline bool raw_string_tag(const string &raw, const char *tag, string &value) {
+
+  // a Z tag straight from the raw record (no decoding of the bases)
+  const char *p = raw.data();
+  uint16_t ncigar;
+  memcpy(&ncigar, p + 12, 2);
+  int32_t lseq;
+  memcpy(&lseq, p + 16, 4);
+  const char *aux = p + 32 + (unsigned char)p[8] + 4*ncigar + (lseq + 1)/2 + lseq;
+  const char *stop = p + raw.size();
+  while ( aux + 3 <= stop ) {
+    char type = aux[2];
+    const char *v = aux + 3;
+    if ( aux[0] == tag[0] && aux[1] == tag[1] && type == 'Z' ) {
+      value = v;
+      return true;
+    }
+    switch (type) {
+    case 'A': case 'c': case 'C': aux = v + 1; break;
+    case 's': case 'S':           aux = v + 2; break;
+    case 'i': case 'I': case 'f': aux = v + 4; break;
+    case 'Z': case 'H':           aux = v + strlen(v) + 1; break;
+    case 'B': {
+      char sub = v[0];
+      int32_t count;
+      memcpy(&count, v + 1, 4);
+      int size = (sub == 'c' || sub == 'C') ? 1 : (sub == 's' || sub == 'S') ? 2 : 4;
+      aux = v + 5 + (size_t)count * size;
+      break;
+    }
+    default: return false;
+    }
+  }
+  return false;
+
+}
+
+
+inline bool read_location(const string &name, int &tile, int &x, int &y) {
+
+  // tile, x and y: the last three fields of an Illumina read name (5 or 7 fields), as Picard's default
+  vector <size_t> colons;
+  for (size_t i = 0; i < name.size(); i++) {
+    if ( name[i] == ':' ) colons.push_back(i);
+  }
+  if ( colons.size() != 4 && colons.size() != 6 ) return false;
+  size_t n = colons.size();
+  tile = atoi(name.c_str() + colons[n-3] + 1);
+  x = atoi(name.c_str() + colons[n-2] + 1);
+  y = atoi(name.c_str() + colons[n-1] + 1);
+  return true;
+
+}
+
+
+inline bool picard_before(const string &nameA, uint64_t indexA, const string &nameB, uint64_t indexB) {
+
+  // the order Picard takes equally scored ends in: read name, tile, x, y, then the index in the file
+  int c = nameA.compare(nameB);
+  if ( c != 0 ) return c < 0;
+  int locA[3] = {-1, -1, -1}, locB[3] = {-1, -1, -1};
+  read_location(nameA, locA[0], locA[1], locA[2]);
+  read_location(nameB, locB[0], locB[1], locB[2]);
+  for (int i = 0; i < 3; i++) {
+    if ( locA[i] != locB[i] ) return locA[i] < locB[i];
+  }
+  return indexA < indexB;
+
+}
+
+
+inline void patch_block(string &blk, const vector <size_t> &offsets, int level) {
+
+  // a bgzf block inflated, the duplicate bit (0x400, 0x04 of the upper flag byte) set at the offsets, deflated again
+  uint32_t isize;
+  memcpy(&isize, &blk[blk.size() - 4], 4);
+  string raw(isize, '\0');
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  int status = inflateInit2(&zs, -15);
+  if ( status == Z_OK ) {
+    zs.next_in = (Bytef *)&blk[18];
+    zs.avail_in = blk.size() - 26;
+    zs.next_out = (Bytef *)&raw[0];
+    zs.avail_out = isize;
+    status = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+  }
+  if ( status != Z_STREAM_END || zs.total_out != isize ) {
+    cerr << "markDuplicates ERROR: could not inflate a block of the written bam" << endl;
+    exit(1);
+  }
+  for (size_t i = 0; i < offsets.size(); i++) raw[offsets[i]] |= 0x04;
+  if ( bgzf_deflate(raw, blk, level) == false ) {
+    cerr << "markDuplicates ERROR: could not deflate a patched block" << endl;
+    exit(1);
+  }
+
+}
+
+
+inline void patch_flags(const string &from, const string &to, vector <uint64_t> &places, int level, unsigned int threads) {
+
+  // the bgzf blocks of from copied to to ("-" is stdout), the ones with a place (block << 16 | offset) patched on the threads
+  sort(places.begin(), places.end());
+  FILE *in_f = fopen(from.c_str(), "rb");
+  FILE *out_f = (to == "-") ? stdout : fopen(to.c_str(), "wb");
+  if ( in_f == NULL || out_f == NULL ) {
+    cerr << "markDuplicates ERROR: could not copy " << from << " to " << to << endl;
+    exit(1);
+  }
+  if ( threads < 1 ) threads = 1;
+  uint64_t number = 0;                               // of the block read next
+  size_t next = 0;                                   // the place to patch next
+  bool more = true;
+  while ( more ) {
+
+    vector <string> blocks;
+    vector < vector <size_t> > offsets;
+    while ( blocks.size() < 64 * threads ) {
+      string blk(18, '\0');
+      size_t got = fread(&blk[0], 1, 18, in_f);
+      if ( got == 0 ) {
+        more = false;
+        break;
+      }
+      uint16_t bsize;
+      memcpy(&bsize, &blk[16], 2);
+      if ( got != 18 || blk[12] != 'B' || blk[13] != 'C' || bsize < 25 ) {
+        cerr << "markDuplicates ERROR: " << from << " is not a bgzf file" << endl;
+        exit(1);
+      }
+      blk.resize(bsize + 1);
+      if ( fread(&blk[18], 1, blk.size() - 18, in_f) != blk.size() - 18 ) {
+        cerr << "markDuplicates ERROR: " << from << " is truncated" << endl;
+        exit(1);
+      }
+      vector <size_t> here;
+      for (; next < places.size() && (places[next] >> 16) == number; next++) here.push_back(places[next] & 0xffff);
+      blocks.push_back(blk);
+      offsets.push_back(here);
+      ++number;
+    }
+
+    vector <thread> workers;
+    for (unsigned int t = 0; t < threads; t++) {
+      workers.push_back(thread([&, t]() {
+        for (size_t b = t; b < blocks.size(); b += threads) {
+          if ( !offsets[b].empty() ) patch_block(blocks[b], offsets[b], level);
+        }
+      }));
+    }
+    for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+    for (size_t b = 0; b < blocks.size(); b++) fwrite(blocks[b].data(), 1, blocks[b].size(), out_f);
+
+  }
+  if ( next < places.size() ) {
+    cerr << "markDuplicates ERROR: " << places.size() - next << " flags beyond the end of " << from << endl;
+    exit(1);
+  }
+  fclose(in_f);
+  if ( out_f == stdout ) fflush(out_f);
+  else if ( fclose(out_f) != 0 ) {
+    cerr << "markDuplicates ERROR: could not write " << to << endl;
+    exit(1);
+  }
+
+}
+
+
+inline void write_metrics(const string &file, const string &command, const vector <struct DupLibrary> &libs) {
+
+  // picard.sam.DuplicationMetrics, one row per library, and the return on investment histogram
+  ofstream out_f(file.c_str());
+  if ( !out_f.is_open() ) {
+    cerr << "Could not open the metrics file " << file << endl;
+    exit(1);
+  }
+  time_t now = time(NULL);
+  char started[64];
+  strftime(started, sizeof(started), "%a %b %d %H:%M:%S %Z %Y", localtime(&now));
+  out_f << "## htsjdk.samtools.metrics.StringHeader" << endl;
+  out_f << "# " << command << endl;
+  out_f << "## htsjdk.samtools.metrics.StringHeader" << endl;
+  out_f << "# Started on: " << started << endl;
+  out_f << endl;
+  out_f << "## METRICS CLASS\tpicard.sam.DuplicationMetrics" << endl;
+  out_f << "LIBRARY\tUNPAIRED_READS_EXAMINED\tREAD_PAIRS_EXAMINED\tSECONDARY_OR_SUPPLEMENTARY_RDS\tUNMAPPED_READS\tUNPAIRED_READ_DUPLICATES"
+        << "\tREAD_PAIR_DUPLICATES\tREAD_PAIR_OPTICAL_DUPLICATES\tPERCENT_DUPLICATION\tESTIMATED_LIBRARY_SIZE" << endl;
+
+  double histSize = 0, histPairs = 0, histUnique = 0;
+  for (size_t l = 0; l < libs.size(); l++) {
+    const struct DupLibrary &lib = libs[l];
+    unsigned long long pairs = lib.pairedRecords / 2;
+    unsigned long long examined = lib.unpaired + 2 * pairs;
+    double percent = (examined > 0) ? (double)(lib.unpairedDups + 2 * lib.pairDups) / examined : 0;
+    double size = DupSketches::LibrarySize(pairs - lib.opticalDups, pairs - lib.pairDups);
+    out_f << lib.name << "\t" << lib.unpaired << "\t" << pairs << "\t" << lib.secondary << "\t" << lib.unmapped << "\t"
+          << lib.unpairedDups << "\t" << lib.pairDups << "\t" << lib.opticalDups << "\t"
+          << fixed << setprecision(6) << percent << "\t";
+    if ( size > 0 ) out_f << (unsigned long long)size;
+    out_f << endl;
+    if ( size > 0 && libs.size() == 1 ) {             // as Picard, the histogram only for a single library
+      histSize = size;
+      histPairs = pairs;
+      histUnique = pairs - lib.pairDups;
+    }
+  }
+  out_f << endl;
+
+  if ( histSize > 0 ) {                              // the unique pairs of sequencing x times as much
+    out_f << "## HISTOGRAM\tjava.lang.Double" << endl;
+    out_f << "BIN\tVALUE" << endl;
+    for (int x = 1; x <= 100; x++) {
+      double value = histSize * (1 - exp(-(x * histPairs) / histSize)) / histUnique;
+      out_f << setprecision(1) << (double)x << "\t" << setprecision(6) << value << endl;
+    }
+    out_f << endl;
+  }
+  out_f.close();
+
+}
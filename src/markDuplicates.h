@@ -0,0 +1,154 @@
+#include <cstdio>
+#include <getopt.h>
+#include <cstdlib>
+#include <cstring>
+
+
+struct parameters {
+  char* input;
+  char* output;
+  char* metrics;
+  unsigned int threads;
+  unsigned int window;
+  unsigned int cacheMB;
+  char* spillDir;
+  unsigned int opticalDistance;
+  int clevel;
+};
+
+struct parameters* interface(struct parameters* param,int argc, char *argv[]);
+void delete_param(struct parameters* param);
+void usage(void);
+
+const char* program_name;
+
+struct parameters* interface(struct parameters* param, int argc, char *argv[]){
+
+  program_name = argv[0];
+  int c;     // the next argument
+  int help = 0;
+
+  if (argc < 2){
+    usage();
+    exit(0);
+  }
+
+  param = new struct parameters;
+  param->input = new char;
+  param->output = new char;
+  param->metrics = new char;
+  param->spillDir = new char;
+  *param->input = '\0';
+  *param->output = '\0';
+  *param->metrics = '\0';
+  *param->spillDir = '\0';
+  param->threads = 1;
+  param->window = 10000;
+  param->cacheMB = 1024;
+  param->opticalDistance = 100;
+  param->clevel = -1;
+
+  const struct option long_options[] ={
+    {"input",1,0,'i'},
+    {"output",1,0,'o'},
+    {"metrics",1,0,'m'},
+    {"threads",1,0,'n'},
+    {"window",1,0,'w'},
+    {"cacheMB",1,0,'c'},
+    {"spillDir",1,0,'d'},
+    {"opticalDistance",1,0,'p'},
+    {"compression-level",1,0,'z'},
+    {"help",0,0,'h'},
+    {0, 0, 0, 0}
+  };
+
+
+  while (1){
+
+    int option_index = 0;
+    c = getopt_long_only (argc, argv,"hi:o:m:n:w:c:d:p:z:",long_options, &option_index);
+
+    if (c == -1){
+      break;
+    }
+
+    switch(c) {
+    case 0:
+      break;
+    case 'i':
+      param->input = optarg;
+      break;
+    case 'o':
+      param->output = optarg;
+      break;
+    case 'm':
+      param->metrics = optarg;
+      break;
+    case 'n':
+      param->threads = atoi(optarg);
+      break;
+    case 'w':
+      param->window = atoi(optarg);
+      break;
+    case 'c':
+      param->cacheMB = atoi(optarg);
+      break;
+    case 'd':
+      param->spillDir = optarg;
+      break;
+    case 'p':
+      param->opticalDistance = atoi(optarg);
+      break;
+    case 'z':
+      param->clevel = atoi(optarg);
+      break;
+    case 'h':
+      help = 1;
+      break;
+    case '?':
+      help = 1;
+      break;
+    default:
+      help = 1;
+      break;
+    }
+  }
+
+  if(help){
+    usage();
+    delete_param(param);
+    exit(0);
+  }
+
+  return param;
+}
+
+void usage()
+{
+  fprintf(stdout, "\nmarkDuplicates, Copyright (C) 2020 Sun Ruping <ruping@umn.edu>\n");
+  fprintf(stdout, "\n");
+  fprintf(stdout, "Usage: %s options [inputfile] \n\n", program_name);
+  fprintf(stdout, "-h --help        print the help message\n");
+  fprintf(stdout, "-i --input       coordinate sorted bam, - is stdin.\n");
+  fprintf(stdout, "-o --output      the bam with the duplicate flags set (as Picard MarkDuplicates REMOVE_DUPLICATES=false),\n");
+  fprintf(stdout, "                 - is stdout (written to --spillDir first, then copied).\n");
+  fprintf(stdout, "-m --metrics     the duplication metrics, in Picard's DuplicationMetrics format.\n");
+  fprintf(stdout, "-n --threads     threads for the bam compression and the patch (default 1).\n");
+  fprintf(stdout, "-w --window      mates closer than this (bp) are paired in the output window, the first mates of farther pairs\n");
+  fprintf(stdout, "                 are written at once and get their flag by a patch of the output (default 10000).\n");
+  fprintf(stdout, "-c --cacheMB     memory cap of the first mates waiting for a far mate in MB, beyond it they are spilled to disk (default 1024).\n");
+  fprintf(stdout, "-d --spillDir    directory for the spilled first mates (default: the current directory).\n");
+  fprintf(stdout, "-p --opticalDistance  duplicates of a set on the same tile closer than this (pixels) are optical (default 100).\n");
+  fprintf(stdout, "-z --compression-level  deflate level (0-9) of the output bam (default zlib's 6).\n");
+  fprintf(stdout, "\n");
+}
+
+
+void delete_param(struct parameters* param)
+{
+  delete(param->input);
+  delete(param->output);
+  delete(param->metrics);
+  delete(param->spillDir);
+  delete(param);
+}
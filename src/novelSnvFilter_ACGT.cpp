@@ -25,58 +25,213 @@ using namespace BamTools;
 #include <cstring>
 #include <sstream>
 #include <iomanip>
-#include "boost/regex.hpp"
+#include <map>
+#include <algorithm>
+#include <climits>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
 #include "novelSnvFilter_ACGT.h"
+#include "ref_mismatch.h"
+#include "line_writer.h"
 using namespace std;
-using namespace boost;
-
-
-struct var {  // a bed file containing gene annotations
-  string chr;
-  string chro;  //original chr name from the input list
-  string snpID;
-  string ref;
-  string alt;
-  unsigned int start;
-  unsigned int end;
-  // results storing here
-  unsigned int countAlt;
-  unsigned int countAll;
-  unsigned int countA;
-  unsigned int countAn;
-  unsigned int countC;
-  unsigned int countCn;
-  unsigned int countG;
-  unsigned int countGn;
-  unsigned int countT;
-  unsigned int countTn;
-  unsigned int countMappingGood;
-  unsigned int countMappingBad;
-  unsigned int countPositive;
-  unsigned int countNegative;
-  unsigned int inends;
-  unsigned int countJump;
-  unsigned int F1R2_alt;
-  unsigned int F1R2_all;
-  unsigned int F2R1_alt;
-  unsigned int F2R1_all;
-  unsigned int readlen;
-  vector <unsigned int> lenVarReads;
-  vector <unsigned int> surrounding;
-  vector <unsigned int> surroundingIndels;
-  map <unsigned int, unsigned int> conMis;
-  string qualities;
+
+
+enum VarCount {   // the counters of a variant, the printed ones in the column order of the output
+  C_ALL, C_POSITIVE, C_NEGATIVE, C_F1R2_ALL, C_F2R1_ALL, C_F1R2_ALT, C_F2R1_ALT, C_ALT,
+  C_A, C_AN, C_C, C_CN, C_G, C_GN, C_T, C_TN, C_INENDS, C_JUMP,
+  C_MAPPING_GOOD, C_MAPPING_BAD, C_N
+};
+const unsigned int printed_counts = C_JUMP + 1;
+const unsigned char no_base = 7;          // base code of anything but a single A, C, G, T or N
+
+
+inline unsigned char base_code(char b) {
+  switch (b) {
+  case 'A': return 0;
+  case 'C': return 1;
+  case 'G': return 2;
+  case 'T': return 3;
+  case 'N': return 4;
+  default:  return no_base;
+  }
+}
+
+
+class VarStore {
+
+  // the variants between the list and the output, one column per field: a variant is a slot number,
+  // slots are reused once the variant is written, so the memory is that of the variants the reads
+  // currently overlap. chromosome names are interned (the name of the list and the one of the bam),
+  // ref and alt are base codes packed in one byte, and the counters the read loop updates are arrays
+  // of their own. the list is read in 4 MB blocks and the lines parsed in place.
+
+ public:
+  VarStore() : fd(-1), pos(0), last(UINT_MAX) {}
+
+  bool Open(const string &file, const string &prefix) {
+    fd = open(file.c_str(), O_RDONLY);
+    withChr = prefix;
+    return fd >= 0;
+  }
+
+  bool Next(deque <unsigned int> &window) {         // the next variant of the list to the back of the window, false at the end
+    while ( true ) {
+      const char *eol = (const char *)memchr(text.data() + pos, '\n', text.size() - pos);
+      if ( eol == NULL && fill() ) continue;
+      const char *p = text.data() + pos;
+      const char *end = (eol != NULL) ? eol : text.data() + text.size();
+      if ( eol == NULL && p == end ) return false;
+      pos = end - text.data() + ((eol != NULL) ? 1 : 0);
+      if ( end > p && end[-1] == '\r' ) --end;
+      if ( p == end || *p == '#' || *p == '@' ) continue;   // header and comment lines
+      window.push_back(parse(p, end));
+      return true;
+    }
+  }
+
+  void Release(unsigned int v) {
+    spare.push_back(v);
+  }
+
+  const string &Name(unsigned int id) const {
+    return names[id];
+  }
+
+  vector <unsigned int> chr;                 // interned, with the chr prefix of the bam
+  vector <unsigned int> chro;                // interned, as in the list
+  vector <unsigned int> start;
+  vector <unsigned char> bases;              // ref code << 4 | alt code
+  vector <unsigned int> counts[C_N];
+  vector <unsigned int> readlen;
+  vector < vector <unsigned int> > lenVarReads;
+  vector < vector <unsigned int> > surrounding;
+  vector < vector <unsigned int> > surroundingIndels;
+  vector < map <unsigned int, unsigned int> > conMis;
+  vector <string> qualities;
+
+ private:
+  int fd;
+  string text;
+  size_t pos;
+  string withChr;
+  vector <string> names;
+  vector <unsigned int> normal;              // name id -> id of the name with the bam's prefix
+  map <string, unsigned int> index;
+  unsigned int last;
+  vector <unsigned int> spare;
+
+  bool fill() {                              // the unparsed rest and the next block of the list
+    if ( fd < 0 ) return false;
+    text.erase(0, pos);
+    pos = 0;
+    size_t have = text.size();
+    text.resize(have + (4 << 20));
+    ssize_t n;
+    do n = read(fd, &text[have], text.size() - have); while ( n < 0 && errno == EINTR );
+    text.resize(have + ((n > 0) ? n : 0));
+    if ( n > 0 ) return true;
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  unsigned int slot() {                      // a slot with zero counts
+    unsigned int v;
+    if ( spare.empty() ) {
+      v = start.size();
+      chr.push_back(0);
+      chro.push_back(0);
+      start.push_back(0);
+      bases.push_back(0);
+      for (unsigned int c = 0; c < C_N; c++) counts[c].push_back(0);
+      readlen.push_back(0);
+      lenVarReads.push_back(vector <unsigned int>());
+      surrounding.push_back(vector <unsigned int>());
+      surroundingIndels.push_back(vector <unsigned int>());
+      conMis.push_back(map <unsigned int, unsigned int>());
+      qualities.push_back(string());
+      return v;
+    }
+    v = spare.back();
+    spare.pop_back();
+    for (unsigned int c = 0; c < C_N; c++) counts[c][v] = 0;
+    readlen[v] = 0;
+    lenVarReads[v].clear();
+    surrounding[v].clear();
+    surroundingIndels[v].clear();
+    conMis[v].clear();
+    qualities[v].clear();
+    return v;
+  }
+
+  unsigned int parse(const char *p, const char *end) {   // chr pos id ref alt, tab separated (runs of tabs as one)
+    const char *field[5];
+    size_t length[5];
+    unsigned int n = 0;
+    while ( n < 5 ) {
+      while ( p < end && *p == '\t' ) ++p;
+      if ( p == end ) break;
+      field[n] = p;
+      while ( p < end && *p != '\t' ) ++p;
+      length[n] = p - field[n];
+      ++n;
+    }
+    unsigned int v = slot();
+    chro[v] = (n > 0) ? chrom(field[0], length[0]) : chrom("", 0);
+    chr[v] = normal[chro[v]];
+    start[v] = (n > 1) ? strtoul(field[1], NULL, 10) : 0;
+    unsigned char ref = (n > 3 && length[3] == 1) ? base_code(*field[3]) : no_base;
+    unsigned char alt = (n > 4 && length[4] == 1) ? base_code(*field[4]) : no_base;
+    bases[v] = (ref << 4) | alt;
+    return v;
+  }
+
+  unsigned int chrom(const char *name, size_t len) {     // the id of a name of the list, its bam name interned with it
+    if ( last != UINT_MAX && names[last].size() == len && memcmp(names[last].data(), name, len) == 0 ) return last;
+    last = intern(string(name, len));
+    if ( normal[last] == UINT_MAX ) {
+      unsigned int id = intern(bam_name(names[last]));
+      normal[last] = id;
+    }
+    return last;
+  }
+
+  unsigned int intern(const string &name) {
+    map <string, unsigned int>::iterator it = index.find(name);
+    if ( it != index.end() ) return it->second;
+    index.insert( pair <string, unsigned int> (name, names.size()) );
+    names.push_back(name);
+    normal.push_back(UINT_MAX);
+    return names.size() - 1;
+  }
+
+  string bam_name(const string &name) const {
+    if (withChr != "none") {
+      if (name.substr(0,1) != "c" && name.substr(0,1) != "C" && name.length() < 3) {   //mostlikely not starting with chr
+        return withChr + name;
+      }
+    } else { //'chr' is not required
+      if ( (name.substr(0,1) == "c" || name.substr(0,1) == "C") && name.length() > 3) {   //mostlikely starting with chr
+        return name.substr(3);
+      }
+    }
+    return name;
+  }
+
 };
 
 
 //unsigned int read_length = 0;
+class RefMismatch *ref_mismatch = NULL;   // --genome: the mismatches against the reference, else from the MD tag
+LineWriter var_out;                       // the variant rows (stdout)
+class VarStore store;                     // the variants the reads overlap
 
 inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, vector<int> &blockEnds, unsigned int &alignmentEnd, map<unsigned int, unsigned int> &insertions, unsigned int &softClip);
 inline void splitstring(const string &str, vector<string> &elements, const string &delimiter);
-inline bool eatline(const string &str, deque <struct var> &var_ref, string &withChr);
 inline string int2str(unsigned int &i);
 inline string float2str(float &f);
-inline void var_processing(struct var &variant);
+inline void var_processing(unsigned int v);
 inline float CalcMedian (vector<unsigned int> &scores);
 
 int main ( int argc, char *argv[] ) {
@@ -84,9 +239,7 @@ int main ( int argc, char *argv[] ) {
   struct parameters *param = 0;
   param = interface(param, argc, argv);
 
-  //region file input (the region file should be sorted as the same way as the bam file)
-  ifstream var_f;
-  var_f.open(param->var_f, ios_base::in);  // the region file is opened
+  var_out.OpenStdout();
 
 
   //bam input and generate index if not yet 
@@ -158,8 +311,7 @@ int main ( int argc, char *argv[] ) {
 
 
   //should decide which chromosome
-  string line;
-  string old_chr = "SRP";
+  unsigned int old_chr = UINT_MAX;
   string type = param->type;
   string startwithChr = param->chr;
   if (startwithChr == "") {
@@ -167,43 +319,47 @@ int main ( int argc, char *argv[] ) {
   }
   cerr << "chr prefix is: " << startwithChr << endl;
 
-  //regions for the input of region file
-  deque <struct var> variants;
-
-  bool isComment;
-  getline(var_f, line); //get the first line
-  isComment = eatline(line, variants, startwithChr);
-  while (isComment == true){
-    //print comment
-    //cout << line << endl;
-    getline(var_f, line); //get a new line
-    isComment = eatline(line, variants, startwithChr); //eat a new line
+  //variant list input (sorted the same way as the bam file)
+  if ( !store.Open(param->var_f, startwithChr) ) {
+    cerr << "Could not open the variant file " << param->var_f << endl;
+    exit(1);
   }
+  string genome = param->genome;
+  if ( genome != "" ) {
+    ref_mismatch = new RefMismatch;
+    if ( !ref_mismatch->Open(genome) ) {
+      cerr << "Could not open the genome fasta " << genome << endl;
+      exit(1);
+    }
+  }
+
+  //regions for the input of region file
+  deque <unsigned int> variants;            // slots of the store, in list order
+
+  store.Next(variants);                     //get the first variant (header lines are skipped)
   
-  deque <struct var>::iterator it = variants.begin();
+  deque <unsigned int>::iterator it = variants.begin();
 
-  while ( it->chr != old_chr ) {
+  while ( !variants.empty() && store.chr[*it] != old_chr ) {
 
-    old_chr = it->chr;  // set the current chr as old chr
+    old_chr = store.chr[*it];  // set the current chr as old chr
 
-    int chr_id  = reader.GetReferenceID(it->chr);
+    int chr_id  = reader.GetReferenceID(store.Name(old_chr));
 
     if ( chr_id == -1 ) {  //reference not found
 
-      for (; it != variants.end() && it->chr == old_chr; ) {
+      for (; it != variants.end() && store.chr[*it] == old_chr; ) {
         var_processing(*it);           // print the old region info
         it = variants.erase(it);         // erase the current region
       }
   
       while ( variants.empty() ) {    
-        getline(var_f, line);
-        if ( var_f.eof() ){
+        if ( !store.Next(variants) ){
           cerr << "finished: end of region file, zone 0" << endl;
           break;
         }
-        eatline(line, variants, startwithChr);
         it = variants.begin();
-        if (it->chr == old_chr){  
+        if (store.chr[*it] == old_chr){  
           var_processing(*it);      
           variants.clear();
           continue;
@@ -216,7 +372,7 @@ int main ( int argc, char *argv[] ) {
 
     if ( !reader.SetRegion(chr_id, 1, chr_id, chr_len) ) // here set region
       {
-        cerr << "bamtools count ERROR: Jump region failed " << it->chr << endl;
+        cerr << "bamtools count ERROR: Jump region failed " << store.Name(old_chr) << endl;
         reader.Close();
         exit(1);
       }
@@ -282,6 +438,8 @@ int main ( int argc, char *argv[] ) {
       unsigned int softClip = 0;                        // for soft clipping
       blockStarts.push_back(0);
       ParseCigar(bam.CigarData, blockStarts, blockLengths, cigarEnd, insertions, softClip);
+      vector <struct MismatchEvent> events;             // mismatch and deletion events of the read, found once
+      bool evented = false;
 
 
       //// do pileup check for duplicates
@@ -303,20 +461,19 @@ int main ( int argc, char *argv[] ) {
       ////pile up check
 
 
-      deque <struct var>::iterator iter = variants.begin();
+      deque <unsigned int>::iterator iter = variants.begin();
 
-      if ( iter->start > alignmentEnd ) continue;          // skip reads not overlapping with the first region
+      if ( variants.empty() || store.start[*iter] > alignmentEnd ) continue;          // skip reads not overlapping with the first region
 
-      while ( iter->chr == old_chr && iter->start <= alignmentEnd && iter != variants.end() ) {
+      while ( iter != variants.end() && store.chr[*iter] == old_chr && store.start[*iter] <= alignmentEnd ) {
 
-        if (iter->end < alignmentStart) {                  // the region end is beyond the alignmentStart
+        const unsigned int v = *iter;
+        if (store.start[v] < alignmentStart) {             // the variant is before the alignmentStart
 
-          var_processing(*iter);                           // processing
+          var_processing(v);                               // processing
           iter = variants.erase(iter);                     // this region should be removed
           if ( variants.empty() ) { 
-            getline(var_f, line);                          // get a line of region file
-            if ( ! var_f.eof() ) {
-              eatline(line, variants, startwithChr);                     // eat a line and put it into the duque
+            if ( store.Next(variants) ) {                  // the next variant into the deque
               iter = variants.begin();
             }
             else {  // it's reaching the end of the region file
@@ -327,10 +484,10 @@ int main ( int argc, char *argv[] ) {
           continue;
         }
 
-        if ( iter->end >= alignmentStart && iter->start <= alignmentEnd ) {  //overlapping, should take action
+        if ( store.start[v] >= alignmentStart && store.start[v] <= alignmentEnd ) {  //overlapping, should take action
 
-          if (bam.Length > iter->readlen) {                 // should we re-define the read length?
-            iter->readlen = bam.Length;
+          if (bam.Length > store.readlen[v]) {              // should we re-define the read length?
+            store.readlen[v] = bam.Length;
           }
           
           unsigned int mismatches = 0;                      // how many mismatches (including indels) does this read have?
@@ -342,7 +499,7 @@ int main ( int argc, char *argv[] ) {
           while (bliter != blockLengths.end() && bSiter != blockStarts.end()) {
             unsigned int blockstart = *bSiter + alignmentStart;
             unsigned int blockend = *bliter + blockstart;
-            if (iter->start >= blockstart && iter->end <= blockend) {
+            if (store.start[v] >= blockstart && store.start[v] <= blockend) {
                posInRead = true;
                break;
             } //overlap
@@ -351,35 +508,26 @@ int main ( int argc, char *argv[] ) {
           }
 
           if (posInRead == true) {    //need to get strand information for all reads !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-             iter->countAll += 1;
+             store.counts[C_ALL][v] += 1;
              if (strand == "+") {
-               iter->countPositive += 1;
+               store.counts[C_POSITIVE][v] += 1;
              } else {
-               iter->countNegative += 1;
+               store.counts[C_NEGATIVE][v] += 1;
              }
              if (FxRx == "F1R2") {
-               iter->F1R2_all += 1;
+               store.counts[C_F1R2_ALL][v] += 1;
              } else if (FxRx == "F2R1") {
-               iter->F2R1_all += 1;
+               store.counts[C_F2R1_ALL][v] += 1;
              }
           }
           else
-            iter->countJump += 1;
-
-          //processing MD string, calculate mismatch coordinates and compare with the variants 
-          string MD;
-          bam.GetTag("MD", MD);
-          //cerr << MD << endl;
-
-          unsigned int cuPos = alignmentStart;
-          unsigned int cuPosRead = softClip + 1;
+            store.counts[C_JUMP][v] += 1;
 
-          //cerr << iter->start << "\t" << bam.Name << "\t" << cuPosRead << endl;      //deBUG!!!!!!!!
-
-          regex rgx( "([0-9]+)([ACGTacgt]|\\^[ACGTacgt]+)" );
-          int subs[] = {1,2};
-          sregex_token_iterator rit ( MD.begin(), MD.end(), rgx, subs );
-          sregex_token_iterator rend;
+          //mismatch coordinates (against --genome, else from the MD string), compared with the variants
+          if ( evented == false ) {
+            mismatch_events(ref_mismatch, bam, chrom, events);
+            evented = true;
+          }
 
           map<unsigned int, unsigned int>::iterator inserit_index = insertions.begin();
           while ( inserit_index != insertions.end() ) {    // check insertions
@@ -387,126 +535,63 @@ int main ( int argc, char *argv[] ) {
             indels += 1;                                   // count for indels
             inserit_index++;
           }
-          inserit_index = insertions.begin();              //reset it for the begin of insertions
-
 
-          while ( rit != rend ) {
-
-            unsigned int incre = atoi((*rit).str().c_str());                  //number 1
-            cuPos += incre;                                                   //number 1
-            cuPosRead += incre; 
-
-            if (blockStarts.size() > 1) {                 //judge which block the mutation locate
-              vector <int>::iterator bliter2 = blockLengths.begin();
-              vector <int>::iterator bSiter2 = blockStarts.begin();
-              unsigned int culength = 0;
-              while (bliter2 != blockLengths.end() && bSiter2 != blockStarts.end()) {
-                if (cuPosRead <= (culength + *bliter2)) {
-                  cuPos += (*bSiter2 - culength);
-                  break;
-                }
-                culength += *bliter2;
-                bliter2++;
-                bSiter2++;
-              }               
-            } //multi blocks especially useful for RNA-seq junction reads
-
-            map<unsigned int, unsigned int>::iterator inserit = inserit_index;
-            while ( inserit != insertions.end() ) {
-              if ( inserit->first < cuPosRead ) {
-                cuPosRead += inserit->second;
-                inserit++;
-                inserit_index = inserit;
-              } else {
-                inserit_index = inserit;
-                break;
-              }
-            }
+          for (size_t e = 0; e < events.size(); e++) {
 
-            ++rit;                                            //round 1 addition
+            unsigned int cuPos = events[e].refPos;
+            unsigned int cuPosRead = events[e].readPos;
 
-            if (((*rit).str())[0] == '^') {                   //variant 2
-              incre = (*rit).length() - 1;                    //variant 2
-              cuPos += incre;                                 //variant 2
+            if ( events[e].type == 'D' ) {                    //deletion
               mismatches += 1;
               indels += 1;
-            } else if ((*rit).length() == 1) {                // single base nucleotide change
-
-              //check whether it is "N" or not
-              string baseInReadPre = (bam.QueryBases).substr( cuPosRead-1, 1 );
-              if (baseInReadPre != "N") {
-                 mismatches += 1;
-                 map<unsigned int, unsigned int>::iterator cmi = (iter->conMis).find(cuPos);
-                 if ( cmi == (iter->conMis).end() ) {                                            // not found need to record mismatch in a map
-                   (iter->conMis).insert( pair <unsigned int, unsigned int> (cuPos, 1) );        // not found need to record mismatch in a map
-                 } else {
-                   cmi->second += 1;                                                             // found increase it
-                 }
-              }
+              continue;
+            }
+            if ( cuPosRead > bam.QueryBases.size() ) continue;
+
+            // single base nucleotide change
+            //check whether it is "N" or not
+            char baseInRead = bam.QueryBases[cuPosRead-1];
+            if (baseInRead != 'N') {
+               mismatches += 1;
+               store.conMis[v][cuPos] += 1;                                                    // record the mismatch position
+            }
 
-              if ( cuPos == iter->start ) { // it is right here with some variant base!!!
+            if ( cuPos == store.start[v] ) { // it is right here with some variant base!!!
 
-                varInRead = true;
-                
-                if ((alignmentEnd - cuPos) <= 10 || (cuPos - alignmentStart) <= 10) {        // inends
-                  iter->inends += 1;
-                }
+              varInRead = true;
+              
+              if ((alignmentEnd - cuPos) <= 10 || (cuPos - alignmentStart) <= 10) {        // inends
+                store.counts[C_INENDS][v] += 1;
+              }
 
-                if ( mappingQuality >= 30 ) {         //good mapping qual
-                    iter->countMappingGood += 1;
-                } else if (mappingQuality <= 29) {    // bad mapping qual
-                    iter->countMappingBad += 1;
-                }
+              if ( mappingQuality >= 30 ) {         //good mapping qual
+                  store.counts[C_MAPPING_GOOD][v] += 1;
+              } else if (mappingQuality <= 29) {    // bad mapping qual
+                  store.counts[C_MAPPING_BAD][v] += 1;
+              }
 
-                //cout << cuPosRead << endl;             // deBUG!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-                string baseInRead = (bam.QueryBases).substr( cuPosRead-1, 1 );
-                if (baseInRead == iter->alt) {           // it is exactly the same alt base
-                  iter->qualities += (bam.Qualities).substr( cuPosRead-1, 1 );   //base quality
-                  if (FxRx == "F1R2") {
-                    iter->F1R2_alt += 1;
-                  } else if (FxRx == "F2R1") {
-                    iter->F2R1_alt += 1;
-                  }
-                }
-                
-                iter->countAlt += 1;
-                if (strand == "+") {                  //positive strand
-                  if (baseInRead == "A") {
-                    iter->countA += 1;
-                  } else if (baseInRead == "C") {
-                    iter->countC += 1;
-                  } else if (baseInRead == "G") {
-                    iter->countG += 1;
-                  } else if (baseInRead == "T") {
-                    iter->countT += 1;
-                  }
-                } else {                              //negative strand
-                  if (baseInRead == "A") {
-                    iter->countAn += 1;
-                  } else if (baseInRead == "C") {
-                    iter->countCn += 1;
-                  } else if (baseInRead == "G") {
-                    iter->countGn += 1;
-                  } else if (baseInRead == "T") {
-                    iter->countTn += 1;
-                  }
+              unsigned char code = base_code(baseInRead);
+              if (code != no_base && code == (store.bases[v] & 0xf)) {      // it is exactly the same alt base
+                if (cuPosRead <= bam.Qualities.size()) store.qualities[v] += bam.Qualities[cuPosRead-1];   //base quality
+                if (FxRx == "F1R2") {
+                  store.counts[C_F1R2_ALT][v] += 1;
+                } else if (FxRx == "F2R1") {
+                  store.counts[C_F2R1_ALT][v] += 1;
                 }
               }
-              cuPos += 1;
-              cuPosRead += 1;
-            } else {
-              cerr << "wired thing happened in the MD string of " << bam.Name << endl;
-              exit(1);
+              
+              store.counts[C_ALT][v] += 1;
+              if (code < 4) {                       // A, C, G, T on the positive, then the negative strand
+                store.counts[C_A + 2*code + ((strand == "+") ? 0 : 1)][v] += 1;
+              }
             }
 
-            ++rit;                                            //round 2 addition
-
-          } //loop for all MD characters
+          } //loop for all events
 
           if (varInRead == true) {
-            (iter->surrounding).push_back(mismatches);
-            (iter->surroundingIndels).push_back(indels);
-            (iter->lenVarReads).push_back(bam.Length);
+            store.surrounding[v].push_back(mismatches);
+            store.surroundingIndels[v].push_back(indels);
+            store.lenVarReads[v].push_back(bam.Length);
           }
 
         }  // overlapping take action!
@@ -514,9 +599,7 @@ int main ( int argc, char *argv[] ) {
         if ( (iter+1) != variants.end() )
           iter++;                                           // if this region is not the last element in the deque
         else {                                              // the last element
-          getline(var_f, line);                             // get a line of region file
-          if ( ! var_f.eof() ) {
-            eatline(line, variants, startwithChr);                        // eat a line and put it into the duque
+          if ( store.Next(variants) ) {                     // the next variant into the deque
             iter = variants.end();
             iter--;
           }
@@ -533,21 +616,19 @@ int main ( int argc, char *argv[] ) {
  
     //somehow to loop back
     it = variants.begin();                   //reset to begin
-    for (; it != variants.end() && it->chr == old_chr; ) {
+    for (; it != variants.end() && store.chr[*it] == old_chr; ) {
       var_processing(*it);              // print the old region info
       it = variants.erase(it);             // erase the current region
     }
   
     while ( variants.empty() ) {    
 
-      getline(var_f, line);
-      if ( var_f.eof() ){
+      if ( !store.Next(variants) ){
         cerr << "finished: end of region file, zone 5" << endl;
         exit(0);
       }
-      eatline(line, variants, startwithChr);
       it = variants.begin();
-      if (it->chr == old_chr){
+      if (store.chr[*it] == old_chr){
         var_processing(*it);
         variants.clear();
         continue;
@@ -558,25 +639,18 @@ int main ( int argc, char *argv[] ) {
       
   variants.clear();
   reader.Close();
-  var_f.close();
   return 0;
 
 } //main
 
 
 inline string int2str(unsigned int &i){
-  string s;
-  stringstream ss(s);
-  ss << i;
-  return ss.str();
+  return uint_text(i);
 }
 
 
 inline string float2str(float &f){
-  string s;
-  stringstream ss(s);
-  ss << f;
-  return ss.str();
+  return float_text(f);
 }
 
 
@@ -592,86 +666,6 @@ inline void splitstring(const string &str, vector<string> &elements, const strin
 }
 
 
-inline bool eatline(const string &str, deque <struct var> &var_ref, string &withChr) {
-  
-  bool isComment = false;
-  if (str[0] == '#' || str[0] == '@') {
-    isComment = true;
-    return isComment;
-  }
-
-  vector <string> line_content;
-  //split line and then put it into a deque
-
-  splitstring(str, line_content, "\t");
-  vector <string>::iterator iter = line_content.begin();
-  unsigned int i;
-
-  struct var tmp;
-  tmp.countAlt = 0;
-  tmp.countAll = 0;
-  tmp.countA = 0;
-  tmp.countAn = 0;
-  tmp.countC = 0;
-  tmp.countCn = 0;
-  tmp.countG = 0;
-  tmp.countGn = 0;
-  tmp.countT = 0;
-  tmp.countTn = 0;
-  tmp.countMappingGood = 0;
-  tmp.countMappingBad = 0;
-  tmp.countPositive = 0;
-  tmp.countNegative = 0;
-  tmp.inends = 0;
-  tmp.countJump = 0;
-  tmp.F1R2_alt = 0;
-  tmp.F1R2_all = 0;
-  tmp.F2R1_alt = 0;
-  tmp.F2R1_all = 0;
-  tmp.readlen = 0;
-  
-  for(i = 1; iter != line_content.end(); iter++, i++) {
-    switch (i) {
-    case 1:  // chr
-      tmp.chr = *iter;
-      tmp.chro = *iter;
-      if (withChr != "none") {
-        if ((tmp.chr).substr(0,1) != "c" && (tmp.chr).substr(0,1) != "C" && (tmp.chr).length() < 3) {   //mostlikely not starting with chr
-          tmp.chr = withChr + tmp.chr;
-        }
-        //if(tmp.chr == "chrMT") {
-        //  tmp.chr = "chrM";
-        //}
-      } else { //'chr' is not required
-        if ( ( (tmp.chr).substr(0,1) == "c" || (tmp.chr).substr(0,1) == "C" ) && (tmp.chr).length() > 3) {   //mostlikely starting with chr
-          tmp.chr = (tmp.chr).substr(3);
-        }
-      }
-      continue;
-    case 2:  // pos
-      tmp.start = atoi((*iter).c_str());
-      tmp.end = atoi((*iter).c_str());
-      continue;
-    case 3:  // id
-      tmp.snpID = *iter;
-      continue;
-    case 4:  // ref
-      tmp.ref = *iter;
-      continue;
-    case 5:  // alt
-      tmp.alt = *iter;
-      continue;
-    default:
-      break;
-    }
-  }
-
-  var_ref.push_back(tmp);
-  return isComment;
-
-}
-
-
 inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, vector<int> &blockLengths, unsigned int &alignmentEnd, map<unsigned int, unsigned int> &insertions, unsigned int &softClip) {
 
   int currPosition = 0;
@@ -724,70 +718,74 @@ inline void ParseCigar(const vector<CigarOp> &cigar, vector<int> &blockStarts, v
 }
 
 
-inline void var_processing(struct var &variant) {
+inline void var_processing(unsigned int v) {
+
+  // the row of a variant, then its slot is free again
 
   unsigned int ssum = 0;
-  vector <unsigned int>::iterator sit = (variant.surrounding).begin();
-  for(; sit != (variant.surrounding).end(); sit++) {
+  vector <unsigned int>::iterator sit = store.surrounding[v].begin();
+  for(; sit != store.surrounding[v].end(); sit++) {
     ssum += *sit;
   }
 
   float meanMis;
   float medianMis;
-  unsigned int surrSize = variant.surrounding.size();
+  unsigned int surrSize = store.surrounding[v].size();
   if (surrSize == 0) {
     meanMis = 0.0;
     medianMis = 0.0;
   } else {
     meanMis = ((float)ssum)/((float)surrSize);
-    medianMis = CalcMedian(variant.surrounding);
+    medianMis = CalcMedian(store.surrounding[v]);
   }
 
   unsigned int indelsum = 0;
-  vector <unsigned int>::iterator indit = (variant.surroundingIndels).begin();
-  for(; indit != (variant.surroundingIndels).end(); indit++) {
+  vector <unsigned int>::iterator indit = store.surroundingIndels[v].begin();
+  for(; indit != store.surroundingIndels[v].end(); indit++) {
       indelsum += *indit;
   }
 
   float meanIndel;
   float medianIndel;
-  unsigned int surrIndelSize = variant.surroundingIndels.size();
+  unsigned int surrIndelSize = store.surroundingIndels[v].size();
   if (surrIndelSize == 0) {
     meanIndel = 0.0;
     medianIndel = 0.0;
   } else {
     meanIndel = ((float)indelsum)/((float)surrIndelSize);
-    medianIndel = CalcMedian(variant.surroundingIndels);
+    medianIndel = CalcMedian(store.surroundingIndels[v]);
   }
 
   //unsigned int lenSum;
-  //vector <unsigned int>::iterator lenit = (variant.lenVarReads).begin();
-  //for(; lenit != (variant.lenVarReads).end(); lenit++) {
+  //vector <unsigned int>::iterator lenit = store.lenVarReads[v].begin();
+  //for(; lenit != store.lenVarReads[v].end(); lenit++) {
   //  lenSum += *lenit;
   //}
   
   //float meanVRLength;        // get Length of reads with variants
   float medianVRLength;      // get Length of reads with variants
-  unsigned int lenVRSize = variant.lenVarReads.size();
+  unsigned int lenVRSize = store.lenVarReads[v].size();
   if (surrIndelSize == 0) {
     //meanVRLength = 0.0;
     medianVRLength = 0.0;
   } else {
     //meanVRLength = ((float)lenSum)/((float)lenVRSize);
-    medianVRLength = CalcMedian(variant.lenVarReads);
+    medianVRLength = CalcMedian(store.lenVarReads[v]);
   }
   
 
   float fracBadMappingQual = 0;
-  if ((variant.countMappingGood + variant.countMappingBad) > 0) {
-    fracBadMappingQual = ((float)(variant.countMappingBad))/((float)(variant.countMappingGood + variant.countMappingBad));
+  unsigned int mappingGood = store.counts[C_MAPPING_GOOD][v];
+  unsigned int mappingBad = store.counts[C_MAPPING_BAD][v];
+  if ((mappingGood + mappingBad) > 0) {
+    fracBadMappingQual = ((float)(mappingBad))/((float)(mappingGood + mappingBad));
   }
 
   // get local error rate estimate
-  float totalBases = (float)variant.countAll * (float)variant.readlen;
-  map<unsigned int, unsigned int>::iterator cmi = (variant.conMis).begin();
+  float totalBases = (float)store.counts[C_ALL][v] * (float)store.readlen[v];
+  map<unsigned int, unsigned int>::iterator cmi = store.conMis[v].begin();
   unsigned int numncMis = 0;
-  for (; cmi != (variant.conMis).end(); cmi++) {
+  for (; cmi != store.conMis[v].end(); cmi++) {
     if (cmi->second == 1) {
       numncMis += 1;
     }
@@ -799,7 +797,10 @@ inline void var_processing(struct var &variant) {
     localEr = ((float)numncMis)/totalBases;
   }
   
-  cout << variant.chro << "\t" << variant.start << "\t" << variant.countAll << "\t" << variant.countPositive << "\t" << variant.countNegative << "\t" << variant.F1R2_all << "\t" << variant.F2R1_all << "\t" << variant.F1R2_alt << "\t" << variant.F2R1_alt << "\t" << variant.countAlt << "\t" << variant.countA << "\t" << variant.countAn << "\t" << variant.countC << "\t" << variant.countCn << "\t" << variant.countG << "\t" << variant.countGn << "\t" << variant.countT << "\t" << variant.countTn << "\t" << variant.inends << "\t" << variant.countJump << "\t" << setprecision(4) << fracBadMappingQual << "\t" << setprecision(2) << meanMis << "\t" << setprecision(2) << medianMis << "\t" << setprecision(3) << meanIndel << "\t" << setprecision(3) << medianIndel << "\t" << setprecision(3) << medianVRLength << "\t" << setprecision(2) << localEr << "\t" << variant.qualities << endl;
+  var_out << store.Name(store.chro[v]) << "\t" << store.start[v];
+  for (unsigned int c = 0; c < printed_counts; c++) var_out << "\t" << store.counts[c][v];
+  var_out << "\t" << Precision(4) << fracBadMappingQual << "\t" << Precision(2) << meanMis << "\t" << Precision(2) << medianMis << "\t" << Precision(3) << meanIndel << "\t" << Precision(3) << medianIndel << "\t" << Precision(3) << medianVRLength << "\t" << Precision(2) << localEr << "\t" << store.qualities[v] << '\n';
+  store.Release(v);
 
 }
 
@@ -11,6 +11,7 @@ struct parameters {
   unsigned int unique;
   unsigned int skipPileup;
   char* chr;
+  char* genome;
 };
 
 struct parameters* interface(struct parameters* param,int argc, char *argv[]);
@@ -35,6 +36,8 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   param->mapping_f = new char;
   param->type = new char;
   param->chr = new char;
+  param->genome = new char;
+  *param->genome = '\0';
  
   const struct option long_options[] ={
     {"var",1,0, 'v'},
@@ -43,6 +46,7 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     {"unique",0,0,'u'},
     {"skipPileup",0,0,'s'},
     {"chr",1,0,'c'},
+    {"genome",1,0,'g'},
     {"help",0,0,'h'},
     {0, 0, 0, 0}
   };
@@ -50,7 +54,7 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
   while (1) {
 
     int option_index = 0;
-    c = getopt_long_only (argc, argv,"husv:m:t:c:",long_options, &option_index);
+    c = getopt_long_only (argc, argv,"husv:m:t:c:g:",long_options, &option_index);
 
     if (c == -1) {
       break;
@@ -77,6 +81,9 @@ struct parameters* interface(struct parameters* param, int argc, char *argv[]){
     case 'c':
       param->chr = optarg;
       break;
+    case 'g':
+      param->genome = optarg;
+      break;
     case 'h':
       help = 1;
       break;
@@ -109,6 +116,7 @@ void usage()
   fprintf(stdout, "-q --unique              only calculate for uniquely mapped reads.\n");
   fprintf(stdout, "-q --skipPileup          skip piled up reads.\n");
   fprintf(stdout, "-c --chr     <prefix>    set to prefix when the chromosome names in bam files starting with \'prefix\', e.g., chr, Chr or CHR.\n");
+  fprintf(stdout, "-g --genome  <filename>  reference fasta, the mismatches are found against it instead of the MD tag (no calmd needed).\n");
   fprintf(stdout, "-t --type    <p/s>       under development, do not set at this moment\n");
   fprintf(stdout, "\n");
 }
@@ -120,5 +128,6 @@ void delete_param(struct parameters* param)
   delete(param->mapping_f);
   delete(param->type);
   delete(param->chr);
+  delete(param->genome);
   delete(param);
 }
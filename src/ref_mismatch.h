@@ -0,0 +1,205 @@
+/*****************************************************************************
+
+  ref_mismatch.h
+  mismatch and deletion events of an alignment without the MD tag
+
+  the aligned blocks of the CIGAR are compared with the reference cut from
+  the mmap'd FASTA (fasta_index.h), 32 or 16 bases at a time with AVX2 or
+  SSE2 byte compares (-mavx2 to get the former, scalar without either), so
+  the tools need no samtools calmd rewrite of the bam. as calmd writes MD,
+  an N in the read or the reference is a mismatch and '=' in the read is a
+  match. bams with an MD tag give the same events from the tag, walked
+  along the CIGAR without a regex.
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef REF_MISMATCH_H
+#define REF_MISMATCH_H
+
+#include "fasta_index.h"
+#include <api/BamAlignment.h>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace BamTools;
+using namespace std;
+
+
+struct MismatchEvent {
+  char type;               // 'X' a base change, 'D' a deletion
+  unsigned int refPos;     // 1-based, the first deleted base of a D
+  unsigned int readPos;    // 1-based in QueryBases (soft clips and insertions counted), the base after a D
+  unsigned int length;     // 1, or the deleted bases
+};
+
+
+inline void mismatch_offsets(const char *read, const char *ref, unsigned int n, vector <unsigned int> &at) {
+
+  // offsets where the read differs from the reference or has an N
+  unsigned int i = 0;
+#if defined(__AVX2__)
+  const __m256i n32 = _mm256_set1_epi8('N');
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(read + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(ref + i));
+    __m256i same = _mm256_andnot_si256(_mm256_cmpeq_epi8(a, n32), _mm256_cmpeq_epi8(a, b));
+    uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(same);
+    for (; diff != 0; diff &= diff - 1) at.push_back(i + __builtin_ctz(diff));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i n16 = _mm_set1_epi8('N');
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(read + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(ref + i));
+    __m128i same = _mm_andnot_si128(_mm_cmpeq_epi8(a, n16), _mm_cmpeq_epi8(a, b));
+    uint32_t diff = ~(uint32_t)_mm_movemask_epi8(same) & 0xffff;
+    for (; diff != 0; diff &= diff - 1) at.push_back(i + __builtin_ctz(diff));
+  }
+#endif
+  for (; i < n; i++) {
+    if ( read[i] != ref[i] || read[i] == 'N' ) at.push_back(i);
+  }
+
+}
+
+
+class RefMismatch {
+
+ public:
+  bool Open(const string &fasta) {
+    return genome.Open(fasta);
+  }
+
+  bool Events(const BamAlignment &bam, const string &chr, vector <struct MismatchEvent> &events) {
+
+    // false when the chromosome is not in the FASTA; safe from several threads (the map is only read)
+    events.clear();
+    if ( genome.Length(chr) == 0 ) return false;
+    string window;
+    vector <unsigned int> at;
+    const string &read = bam.QueryBases;
+    unsigned int refPos = bam.Position;
+    unsigned int readPos = 0;
+    for (size_t i = 0; i < bam.CigarData.size(); i++) {
+      unsigned int len = bam.CigarData[i].Length;
+      switch (bam.CigarData[i].Type) {
+      case 'M': case '=': case 'X': {
+        genome.Fetch(chr, refPos, len, window);
+        unsigned int n = window.size();
+        if ( readPos + n > read.size() ) n = (readPos < read.size()) ? read.size() - readPos : 0;
+        at.clear();
+        mismatch_offsets(read.data() + readPos, window.data(), n, at);
+        for (size_t m = 0; m < at.size(); m++) {
+          if ( read[readPos + at[m]] == '=' ) continue;
+          struct MismatchEvent e = {'X', refPos + at[m] + 1, readPos + at[m] + 1, 1};
+          events.push_back(e);
+        }
+        refPos += len;
+        readPos += len;
+        break;
+      }
+      case 'I': case 'S':
+        readPos += len;
+        break;
+      case 'D': {
+        struct MismatchEvent e = {'D', refPos + 1, readPos + 1, len};
+        events.push_back(e);
+        refPos += len;
+        break;
+      }
+      case 'N':
+        refPos += len;
+        break;
+      default:
+        break;
+      }
+    }
+    return true;
+
+  }
+
+  static bool MdEvents(const BamAlignment &bam, vector <struct MismatchEvent> &events) {
+
+    // the same events from the MD tag, false when there is none
+    events.clear();
+    string md;
+    if ( !bam.GetTag("MD", md) ) return false;
+    size_t m = 0;
+    unsigned int run = md_number(md, m);
+    unsigned int refPos = bam.Position;
+    unsigned int readPos = 0;
+    for (size_t i = 0; i < bam.CigarData.size(); i++) {
+      unsigned int len = bam.CigarData[i].Length;
+      switch (bam.CigarData[i].Type) {
+      case 'M': case '=': case 'X':
+        while ( len > 0 ) {
+          if ( run > 0 ) {                           // matching bases
+            unsigned int take = (run < len) ? run : len;
+            run -= take;
+            len -= take;
+            refPos += take;
+            readPos += take;
+            continue;
+          }
+          if ( m >= md.size() || md[m] == '^' ) return true;   // MD shorter than the CIGAR
+          struct MismatchEvent e = {'X', refPos + 1, readPos + 1, 1};
+          events.push_back(e);
+          ++m;
+          ++refPos;
+          ++readPos;
+          --len;
+          run = md_number(md, m);
+        }
+        break;
+      case 'I': case 'S':
+        readPos += len;
+        break;
+      case 'D': {
+        if ( m < md.size() && md[m] == '^' ) {
+          for (++m; m < md.size() && isalpha(md[m]); ++m) ;
+          run = md_number(md, m);
+        }
+        struct MismatchEvent e = {'D', refPos + 1, readPos + 1, len};
+        events.push_back(e);
+        refPos += len;
+        break;
+      }
+      case 'N':
+        refPos += len;
+        break;
+      default:
+        break;
+      }
+    }
+    return true;
+
+  }
+
+ private:
+  FastaIndex genome;
+
+  static unsigned int md_number(const string &md, size_t &m) {
+    unsigned int n = 0;
+    for (; m < md.size() && md[m] >= '0' && md[m] <= '9'; ++m) n = n * 10 + (md[m] - '0');
+    return n;
+  }
+
+};
+
+
+inline void mismatch_events(class RefMismatch *ref, const BamAlignment &bam, const string &chr, vector <struct MismatchEvent> &events) {
+  // against the reference when there is one holding the chromosome, else from the MD tag
+  if ( ref == NULL || !ref->Events(bam, chr, events) ) RefMismatch::MdEvents(bam, events);
+}
+
+#endif
@@ -0,0 +1,284 @@
+/*****************************************************************************
+
+  sam_reader.h
+  SAM text (e.g. the bwa mem stream on stdin) turned into raw BAM records
+
+  lines are cut in a large read buffer and parsed in place (no per-field
+  strings), every alignment line is encoded straight into the raw record
+  bytes BgzfReader hands out, so the rest of the tools see no difference
+  between SAM and BAM input. little-endian hosts only.
+
+  (c) 2020 - Sun Ruping
+  ruping@umn.edu
+
+******************************************************************************/
+
+#ifndef SAM_READER_H
+#define SAM_READER_H
+
+#include "bgzf_reader.h"
+#include "bgzf_writer.h"
+#include <cstdlib>
+#include <unordered_map>
+
+using namespace BamTools;
+using namespace std;
+
+
+class SamReader : public RawReader {
+
+ public:
+  SamReader() : in_f(NULL), begin(0), end(0), eof(false), pending(false), lastRef(-1) {}
+  ~SamReader() { Close(); }
+
+  bool Open(const string &filename) {
+    in_f = (filename == "-") ? stdin : fopen(filename.c_str(), "r");
+    if ( in_f == NULL ) return false;
+    buf.resize(4 << 20);
+    while ( next_line(line, len) ) {                   // the header, up to the first alignment line
+      if ( line[0] != '@' ) {
+        pending = true;
+        break;
+      }
+      header.append(line, len);
+      header += '\n';
+      if ( len > 4 && strncmp(line, "@SQ\t", 4) == 0 ) {
+        string name;
+        int reflen = 0;
+        const char *p = line + 3;
+        const char *stop = line + len;
+        while ( p < stop ) {
+          const char *field = p + 1;
+          p = (const char *)memchr(field, '\t', stop - field);
+          if ( p == NULL ) p = stop;
+          if ( strncmp(field, "SN:", 3) == 0 ) name.assign(field + 3, p - field - 3);
+          if ( strncmp(field, "LN:", 3) == 0 ) reflen = atoi(field + 3);
+        }
+        refIndex[name] = refs.size();
+        refs.push_back(RefData(name, reflen));
+      }
+    }
+    return true;
+  }
+
+  void Close() {
+    if ( in_f != NULL && in_f != stdin ) fclose(in_f);
+    in_f = NULL;
+  }
+
+  const string &GetHeaderText() const {
+    return header;
+  }
+
+  const RefVector &GetReferenceData() const {
+    return refs;
+  }
+
+  bool Next(string &raw) {                             // the next alignment line as a raw record (no block_size)
+    if ( pending == false && !next_line(line, len) ) return false;
+    pending = false;
+    const char *f[11];
+    const char *p = line;
+    const char *stop = line + len;
+    for (int i = 0; i < 11; i++) {
+      f[i] = p;
+      const char *tab = (const char *)memchr(p, '\t', stop - p);
+      if ( tab == NULL ) {
+        if ( i < 10 ) {
+          cerr << "sam ERROR: fewer than 11 fields: " << string(line, len) << endl;
+          exit(1);
+        }
+        p = stop;
+      } else {
+        p = tab + 1;
+      }
+    }
+
+    raw.clear();
+    int refID = ref_id(f[2], f[3] - f[2] - 1);
+    int pos = atoi(f[3]) - 1;
+    unsigned int flag = atoi(f[1]);
+    const char *name_end = f[1] - 1;
+    const char *cigar = f[5];
+    const char *cigar_end = f[6] - 1;
+    int mrefID = (f[6][0] == '=' && f[7] - f[6] == 2) ? refID : ref_id(f[6], f[7] - f[6] - 1);
+    const char *seq = f[9];
+    size_t lseq = (seq[0] == '*' && f[10] - seq == 2) ? 0 : f[10] - seq - 1;
+
+    put_int32(raw, refID);
+    put_int32(raw, pos);
+    raw.push_back((char)(name_end - line + 1));
+    raw.push_back((char)atoi(f[4]));
+    put_uint16(raw, 0);                                // bin, filled in after the cigar
+    put_uint16(raw, 0);                                // n_cigar_op
+    put_uint16(raw, flag);
+    put_int32(raw, lseq);
+    put_int32(raw, mrefID);
+    put_int32(raw, atoi(f[7]) - 1);
+    put_int32(raw, atoi(f[8]));
+    raw.append(line, name_end - line);
+    raw.push_back('\0');
+
+    unsigned short ncigar = 0;
+    int rlen = 0;
+    if ( *cigar != '*' ) {
+      static const char *cigar_ops = "MIDNSHP=X";
+      char *q = (char *)cigar;
+      while ( q < cigar_end ) {
+        unsigned int oplen = strtoul(q, &q, 10);
+        const char *op = strchr(cigar_ops, *q);
+        int code = (op == NULL) ? 0 : op - cigar_ops;
+        put_int32(raw, (int)((oplen << 4) | code));
+        if ( code == 0 || code == 2 || code == 3 || code == 7 || code == 8 ) rlen += oplen;
+        ++q;
+        ++ncigar;
+      }
+    }
+    unsigned short bin = (pos < 0) ? 4680 : reg2bin(pos, (rlen > 0 && !(flag & 4)) ? pos + rlen : pos + 1);
+    memcpy(&raw[10], &bin, 2);
+    memcpy(&raw[12], &ncigar, 2);
+
+    static unsigned char seq_codes[256];
+    if ( seq_codes['A'] == 0 ) {
+      memset(seq_codes, 15, sizeof(seq_codes));
+      const char *codes = "=ACMGRSVTWYHKDBN";
+      for (int i = 0; i < 16; i++) {
+        seq_codes[(unsigned char)codes[i]] = i;
+        seq_codes[(unsigned char)tolower(codes[i])] = i;
+      }
+    }
+    for (size_t i = 0; i < lseq; i += 2) {
+      unsigned char code = seq_codes[(unsigned char)seq[i]] << 4;
+      if ( i + 1 < lseq ) code |= seq_codes[(unsigned char)seq[i+1]];
+      raw.push_back((char)code);
+    }
+    const char *qual = f[10];
+    const char *qual_end = (const char *)memchr(qual, '\t', stop - qual);
+    if ( qual_end == NULL ) qual_end = stop;
+    if ( lseq > 0 && (size_t)(qual_end - qual) == lseq ) {
+      for (size_t i = 0; i < lseq; i++) raw.push_back((char)(qual[i] - 33));
+    } else {
+      raw.append(lseq, (char)0xff);
+    }
+
+    p = qual_end;
+    while ( p < stop ) {                               // optional fields TAG:TYPE:VALUE
+      const char *tag = p + 1;
+      const char *tag_end = (const char *)memchr(tag, '\t', stop - tag);
+      if ( tag_end == NULL ) tag_end = stop;
+      if ( tag_end - tag >= 5 ) put_tag(raw, tag, tag_end);
+      p = tag_end;
+    }
+    return true;
+  }
+
+ private:
+  FILE *in_f;
+  vector <char> buf;
+  size_t begin;
+  size_t end;
+  bool eof;
+  const char *line;
+  size_t len;
+  bool pending;                                        // the first alignment line was read with the header
+  string header;
+  RefVector refs;
+  unordered_map <string, int> refIndex;
+  string lastName;
+  int lastRef;
+
+  bool next_line(const char *&lp, size_t &llen) {     // points into the buffer, valid until the next call
+    while ( true ) {
+      char *nl = (begin < end) ? (char *)memchr(&buf[begin], '\n', end - begin) : NULL;
+      if ( nl != NULL ) {
+        lp = &buf[begin];
+        llen = nl - lp;
+        begin += llen + 1;
+        if ( llen > 0 && lp[llen-1] == '\r' ) --llen;
+        if ( llen == 0 ) continue;
+        return true;
+      }
+      if ( eof == true ) {
+        if ( begin == end ) return false;
+        buf[end++] = '\n';                             // last line without a newline (room is kept for it)
+        continue;
+      }
+      if ( begin > 0 ) {
+        memmove(&buf[0], &buf[begin], end - begin);
+        end -= begin;
+        begin = 0;
+      }
+      if ( buf.size() - end < (1 << 20) ) buf.resize(buf.size() * 2);
+      size_t got = fread(&buf[end], 1, buf.size() - end - 1, in_f);
+      if ( got == 0 ) eof = true;
+      end += got;
+    }
+  }
+
+  int ref_id(const char *name, size_t nlen) {          // consecutive lines mostly share the reference
+    if ( nlen == 1 && name[0] == '*' ) return -1;
+    if ( lastRef >= 0 && lastName.size() == nlen && memcmp(lastName.data(), name, nlen) == 0 ) return lastRef;
+    lastName.assign(name, nlen);
+    unordered_map <string, int>::iterator it = refIndex.find(lastName);
+    if ( it == refIndex.end() ) {
+      cerr << "sam ERROR: reference " << lastName << " is not in the header" << endl;
+      exit(1);
+    }
+    lastRef = it->second;
+    return lastRef;
+  }
+
+  void put_tag(string &raw, const char *tag, const char *tag_end) {
+    char type = tag[3];
+    const char *value = tag + 5;
+    raw.append(tag, 2);
+    if ( type == 'i' ) {
+      long long v = strtoll(value, NULL, 10);
+      if ( v < 0 ) {
+        if      ( v >= -128 )   { raw.push_back('c'); raw.push_back((char)v); }
+        else if ( v >= -32768 ) { raw.push_back('s'); short x = v; raw.append((const char *)&x, 2); }
+        else                    { raw.push_back('i'); put_int32(raw, (int)v); }
+      } else {
+        if      ( v <= 255 )    { raw.push_back('C'); raw.push_back((char)v); }
+        else if ( v <= 65535 )  { raw.push_back('S'); put_uint16(raw, v); }
+        else                    { raw.push_back('I'); unsigned int x = v; raw.append((const char *)&x, 4); }
+      }
+    } else if ( type == 'f' ) {
+      raw.push_back('f');
+      float x = strtof(value, NULL);
+      raw.append((const char *)&x, 4);
+    } else if ( type == 'A' ) {
+      raw.push_back('A');
+      raw.push_back(*value);
+    } else if ( type == 'B' ) {
+      char sub = *value;
+      raw.push_back('B');
+      raw.push_back(sub);
+      size_t count_at = raw.size();
+      put_int32(raw, 0);
+      int count = 0;
+      char *q = (char *)value + 1;
+      while ( q < tag_end && *q == ',' ) {
+        ++q;
+        if ( sub == 'f' ) {
+          float x = strtof(q, &q);
+          raw.append((const char *)&x, 4);
+        } else {
+          long long v = strtoll(q, &q, 10);
+          if      ( sub == 'c' || sub == 'C' ) raw.push_back((char)v);
+          else if ( sub == 's' || sub == 'S' ) { short x = v; raw.append((const char *)&x, 2); }
+          else                                 put_int32(raw, (int)v);
+        }
+        ++count;
+      }
+      memcpy(&raw[count_at], &count, 4);
+    } else {                                           // Z and H
+      raw.push_back(type);
+      raw.append(value, tag_end - value);
+      raw.push_back('\0');
+    }
+  }
+
+};
+
+#endif